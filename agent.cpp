@@ -14,9 +14,9 @@
 
 #if 1
 #define DBG_RUN      DBG("Run:    %20s 0x%p"ENDL                               \
-                         "        [thread %04d] (sts %d)"ENDL                  \
+                         "        (sts %d)"ENDL                                \
                          "        in 0x%p  out 0x%p"ENDL,                      \
-                        name(),this,GetThreadId(_thread), sts,                 \
+                        name(),this, sts,                                      \
                         (_owner->_in )?Chan_Id(_owner->_in->contents[0]):NULL, \
                         (_owner->_out)?Chan_Id(_owner->_out->contents[0]):NULL)
 #define DBG_STOP     DBG("Stop     %20s 0x%p"ENDL,name(), this)
@@ -49,7 +49,9 @@ namespace fetch
     }
 
     Agent::Agent(IDevice *owner) :
-      _thread(INVALID_HANDLE_VALUE),
+      _notify_done(INVALID_HANDLE_VALUE),
+      _worker(NULL),
+      _worker_arg(NULL),
       _is_available(0),
       _is_running(0),
       _owner(owner),
@@ -62,7 +64,9 @@ namespace fetch
     }
 
     Agent::Agent(char *name, IDevice *owner) :
-      _thread(INVALID_HANDLE_VALUE),
+      _notify_done(INVALID_HANDLE_VALUE),
+      _worker(NULL),
+      _worker_arg(NULL),
       _is_available(0),
       _is_running(0),
       _owner(owner),
@@ -87,9 +91,16 @@ namespace fetch
         //if(this->detach() > 0)                                       // FIXME: This doesn't work
         //    warning("~Agent : Attempt to detach() timed out.\r\n");
 
+        u32 running;
         if(_num_waiting > 0)
             warning("[%s] ~Agent : Agent has waiting tasks.\r\n         Try calling Agent::detach first.\r\n.",name());
-        _safe_free_handle(&_thread);
+        lock();
+        running = _is_running;
+        unlock();
+        if(running)
+            stop(AGENT_DESTROY_TIMEOUT); // abandons the worker if the task won't stop
+        _stop_worker();
+        _safe_free_handle(&_notify_done);
         _safe_free_handle(&_notify_available);
         _safe_free_handle(&_notify_stop);
         DeleteCriticalSection(&_lock);
@@ -192,14 +203,136 @@ namespace fetch
         Guarded_Assert_WinErr(SetEvent(this->_notify_available));
     }
 
+    // Everything the worker thread touches lives here rather than in the
+    // Agent, so an abandoned worker can be leaked without dangling.
+    struct Agent::Worker
+    { Thread    *thread;
+      Mutex     *lock;   // protects everything below
+      Condition *wake,   // signalled to run the task or to quit
+                *idle;   // signalled when the task returns
+      IDevice   *arg;
+      HANDLE     done;   // the agent's _notify_done
+      u32        go,
+                 busy,   // set by run(), cleared when the task returns
+                 quit;
+    };
+
+    // Returns 1 if the worker's task returned within the timeout, 0 otherwise.
+    static unsigned _worker_wait_idle(Agent::Worker *w, DWORD timeout_ms)
+    { double   t0 = Clock_Seconds(),
+               elapsed_ms;
+      unsigned ok;
+      Mutex_Lock(w->lock);
+      while(w->busy)
+      { if(timeout_ms==INFINITE)
+        { Condition_Wait(w->idle,w->lock);
+          continue;
+        }
+        elapsed_ms = 1000.0*(Clock_Seconds()-t0);
+        if(elapsed_ms>=timeout_ms)
+          break;
+        Condition_Timed_Wait(w->idle,w->lock,(unsigned)(timeout_ms-elapsed_ms));
+      }
+      ok = !w->busy;
+      Mutex_Unlock(w->lock);
+      return ok;
+    }
+
     unsigned int Agent::wait_till_stopped(DWORD timeout_ms)
-    { unsigned int sts = 0;
-      if( this->_thread != INVALID_HANDLE_VALUE )
-        // thread could still become invalidated between if and wait, but need to enter wait unlocked
-        // I expect Wait will return WAIT_FAILED immediately if that's the case, so this isn't really
-        // a problem.
-        sts = WaitForSingleObject(this->_thread,timeout_ms) == WAIT_OBJECT_0;
-      return sts;
+    { Worker *w;
+      lock();
+      w = _worker;
+      unlock();
+      return w && _worker_wait_idle(w,timeout_ms);
+    }
+
+    // The worker parks on w->wake until run() sets go or _stop_worker()
+    // sets quit.
+    void* Agent::_worker_main(void *arg)
+    { Worker  *w = (Worker*)arg;
+      IDevice *dc;
+      Mutex_Lock(w->lock);
+      while(1)
+      { while(!w->go && !w->quit)
+          Condition_Wait(w->wake,w->lock);
+        if(w->quit)
+          break;
+        w->go = 0;
+        dc = w->arg;
+        Mutex_Unlock(w->lock);
+        Task::thread_main(dc);
+        Mutex_Lock(w->lock);
+        w->busy = 0;
+        Guarded_Assert_WinErr(SetEvent(w->done));
+        Condition_Notify_All(w->idle);
+      }
+      Mutex_Unlock(w->lock);
+      return NULL;
+    }
+
+    // Call with the agent locked.
+    void Agent::_start_worker()
+    { Worker *w;
+      if(_worker)
+        return;
+      Guarded_Assert(w = (Worker*)calloc(1,sizeof(Worker)));
+      Guarded_Assert(w->lock = Mutex_Alloc());
+      Guarded_Assert(w->wake = Condition_Alloc());
+      Guarded_Assert(w->idle = Condition_Alloc());
+      w->done = _notify_done;
+      Guarded_Assert(w->thread = Thread_Alloc(_worker_main,w));
+      _worker = w;
+    }
+
+    // Call with the agent locked.
+    // Terminates the worker.  A cancelled pthread only dies at its next
+    // cancellation point, so the worker and the _notify_done event it sets
+    // are leaked on purpose and the agent gets a fresh event.
+    void Agent::_abandon_worker()
+    { Worker *w = _worker;
+      Thread_Terminate(w->thread);
+      _worker = NULL;
+      Guarded_Assert_WinErr(
+        _notify_done = CreateEvent( NULL,  // default security attr
+        TRUE,   // manual reset
+        TRUE,   // initially signalled - nothing is running
+        NULL ));
+      Guarded_Assert_WinErr__NoPanic(SetEvent(w->done)); // release anybody waiting on the old one
+    }
+
+    // Joins the worker.  Abandons it if its task doesn't return in time.
+    void Agent::_stop_worker()
+    { Worker *w;
+      unsigned ok;
+      lock();
+      w = _worker;
+      unlock();
+      if(!w)
+        return;
+      ok = _worker_wait_idle(w,AGENT_DESTROY_TIMEOUT); // the task may need the agent lock to finish
+      lock();
+      if(w!=_worker)   // abandoned meanwhile
+      { unlock();
+        return;
+      }
+      if(!ok)
+      { warning("[%s] Agent's task is still running.  Abandoning its worker thread."ENDL,name());
+        _abandon_worker();
+        unlock();
+        return;
+      }
+      _worker = NULL;
+      unlock();
+      Mutex_Lock(w->lock);
+      w->quit = 1;
+      Condition_Notify(w->wake);
+      Mutex_Unlock(w->lock);
+      Thread_Join(w->thread);
+      Thread_Free(w->thread);
+      Condition_Free(w->wake);
+      Condition_Free(w->idle);
+      Mutex_Free(w->lock);
+      free(w);
     }
 
 #define TRY(expr,lbl) \
@@ -222,14 +355,8 @@ namespace fetch
         warning("[%s] While loading task, something went wrong with the task configuration.\r\n\tAgent not armed.\r\n",name());
         goto Error;
       }
-      // Create thread for running task
-      Guarded_Assert_WinErr( this->_thread = CreateThread(
-        0,                  // use default access rights
-        0,                  // use default stack size (1 MB)
-        task->thread_main,  // main function
-        dc,                 // arguments
-        CREATE_SUSPENDED,   // don't start yet
-        NULL )); // don't worry about the thread id
+      _start_worker();
+      _worker_arg = dc; // handed to the worker by run()
       _task = task; // save the task - this also indicates the agent is armed
       unlock();
       DBG_ARMED;
@@ -358,8 +485,10 @@ Error:
     // Transitions from armed to running state
     // Returns 1 on success
     //         0 otherwise
-    // A return of 0 indicates a failure to start the thread
-    // and could be due to multiple suspensions on the thread.
+    // A return of 0 indicates the agent wasn't armed or was already running.
+    // The task runs on the parked worker thread, which is only created
+    // here if a forced stop() had to abandon the previous one.
+    // Doesn't wait for the task to start.
     unsigned int Agent::run(void)
     {
       DWORD sts = 0;
@@ -367,23 +496,15 @@ Error:
       if(this->is_runnable())
       {
         this->_is_running = 1;
-        if( this->_thread != INVALID_HANDLE_VALUE )
-        {
-          sts = ResumeThread(this->_thread) <= 1; // Thread's already allocated so go!
-          DBG("Agent Run: ResumeThread id:%d"ENDL,GetThreadId(this->_thread));
-        }
-        else
-        { // Create thread for running the task
-          Guarded_Assert_WinErr(
-            this->_thread = CreateThread(0, // use default access rights
-            0,                  // use default stack size (1 MB)
-            this->_task->thread_main, // main function
-            this->_owner,       // arguments
-            0,                  // run immediately
-            NULL ));            // don't worry about the thread id
-          sts = 1;
-          DBG("Agent Run: Created thread(id:%d) for %s\r\n",GetThreadId(this->_thread),name());
-        }
+        Guarded_Assert_WinErr(ResetEvent(_notify_done));
+        _start_worker();
+        Mutex_Lock(_worker->lock);
+        _worker->arg  = _worker_arg;
+        _worker->go   = 1;
+        _worker->busy = 1;
+        Condition_Notify(_worker->wake);
+        Mutex_Unlock(_worker->lock);
+        sts = 1;
       } else //(then not runnable)
       {
         warning(
@@ -396,81 +517,35 @@ Error:
       return sts;
     }
 
-    DWORD WINAPI _agent_run_thread_proc(LPVOID lparam)
-    {
-        struct T
-        {
-            Agent *d;
-        };
-        Chan *reader,*q = (Chan*)(lparam);
-        struct T args = {0};
-        reader=Chan_Open(q,CHAN_READ);
-        if(CHAN_FAILURE( Chan_Next_Copy(reader, &args, sizeof(T)) )){
-            warning("In Agent::run_nonblocking work procedure:\r\n\tCould not pop arguments from queue.\r\n");
-            return 0;
-        }
-        Chan_Close(reader);
-        return args.d->run();
-    }
-
+    // run() only signals the parked worker, so it's already non-blocking.
     BOOL Agent::run_nowait()
     {
-        struct T
-        {
-            Agent *d;
-        };
-        struct T args = {this};
-        static Chan *q = NULL;
-        Chan *writer;
         return_val_if_fail( this, 0 );
-        if(!q)
-        {   q = Chan_Alloc(32, sizeof (T));
-            Chan_Set_Expand_On_Full(q,1);
-        }
-
-        writer=Chan_Open(q,CHAN_WRITE);
-        if(CHAN_FAILURE( Chan_Next_Copy(writer, &args, sizeof(T)) )){
-            warning("[%s] In Agent_Run_Nonblocking:\r\n\tCould not push request arguments to queue.\r\n",name());
-            return 0;
-        }
-        Chan_Close(writer);
-
-        BOOL sts;
-        sts = QueueUserWorkItem(&_agent_run_thread_proc, (void*)q, NULL /*default flags*/);
-        return sts;
+        return run();
     }
 
     // Transitions from running to armed state.
     // Returns 1 on success
     unsigned int Agent::stop(DWORD timeout_ms)
     {
-      DWORD res;
-      HANDLE t;
+      Worker *w;
       lock();
       DBG("Agent: [ ] Stopping %s 0x%p\r\n",name(), this);
       if( _is_running )
       {
         _is_running = 0;
-        if( _thread != INVALID_HANDLE_VALUE)
-        { t = _thread;
+        if( w=_worker )
+        { unsigned ok;
+          Guarded_Assert_WinErr(SetEvent(_notify_stop));
           unlock();
-          res = SignalObjectAndWait(_notify_stop,t,timeout_ms,FALSE);  // notifies and waits on thread to signal
-            //res = WaitForSingleObject(t, timeout_ms); // wait for running thread to stop
+          ok = _worker_wait_idle(w,timeout_ms); // waits on the task to return
           lock();
           // Handle a timeout on the wait.
-          if( !_handle_wait_for_result(res, "Agent stop: Wait for thread."))
-          { Guarded_Assert_WinErr__NoPanic(TerminateThread(_thread,127)); // Force the thread to stop
-            warning("%s(%d)"ENDL "\t[%s] Timed out waiting for task thread (%d) to stop."ENDL,__FILE__,__LINE__,name(), GetThreadId(_thread));
+          if( !ok && w==_worker )
+          { _abandon_worker(); // Force the task to stop.  The next run() starts a new worker.
+            warning("%s(%d)"ENDL "\t[%s] Timed out waiting for task to stop."ENDL,__FILE__,__LINE__,name());
           }
-          CloseHandle(_thread);
-          _thread = INVALID_HANDLE_VALUE;
-
           ResetEvent(_notify_stop);
-
-          if(_thread!=INVALID_HANDLE_VALUE)
-          { CloseHandle(_thread);
-            _thread = INVALID_HANDLE_VALUE;
-          }
         }
       }
       unlock();
@@ -598,6 +673,14 @@ Error:
       NULL ));
     Guarded_Assert_WinErr(
       InitializeCriticalSectionAndSpinCount( &_lock, 0x8000400 ));
+    // default security attr
+    // manual reset
+    // initially signaled - nothing is running
+    Guarded_Assert_WinErr(
+      this->_notify_done      = CreateEvent( NULL,  // default security attr
+      TRUE,   // manual reset
+      TRUE,   // initially signalled
+      NULL ));
   }
 
 
@@ -606,17 +689,156 @@ Error:
     :_agent(agent),
     _in(NULL)
     ,_out(NULL)
+    ,_observer_lock(NULL)
+    ,_observers(NULL)
+    ,_nobservers(0)
+    ,_observers_cap(0)
   {
+    Guarded_Assert(_observer_lock = Mutex_Alloc());
   }
 
   IDevice::~IDevice()
   {
     // should detach if attached?
 
+    while(_nobservers)
+      observer_free(_observers[--_nobservers]);
+    free(_observers);
+    Mutex_Free(_observer_lock);
     _free_qs(&_in);
     _free_qs(&_out);
   }
 
+  //
+  // Observers
+  //
+  // A threaded observer parks on its own condition variable.  The producer
+  // hands it a message by setting msg and pending, and waits for pending to
+  // clear.  _observer_lock is held through a whole notify, so observers
+  // aren't added or removed while a message is out.
+  //
+
+  struct IDevice::observer_t
+  { IDevice      *self;
+    IObserver    *o;
+    size_t        ichan;
+    ObserverMode  mode;
+    // OBSERVE_THREAD only
+    Thread       *thread;
+    Mutex        *lock;
+    Condition    *cv;
+    void         *msg;     // protected by lock
+    size_t        nbytes;  // protected by lock
+    int           pending, // protected by lock
+                  quit;    // protected by lock
+  };
+
+  void* IDevice::observer_thread(void *arg)
+  { observer_t *ob = (observer_t*)arg;
+    Mutex_Lock(ob->lock);
+    while(1)
+    { while(!ob->pending && !ob->quit)
+        Condition_Wait(ob->cv,ob->lock);
+      if(!ob->pending)
+        break;
+      Mutex_Unlock(ob->lock);
+      ob->o->on_message(ob->self,ob->ichan,ob->msg,ob->nbytes);
+      Mutex_Lock(ob->lock);
+      ob->pending = 0;
+      Condition_Notify_All(ob->cv);
+    }
+    Mutex_Unlock(ob->lock);
+    return NULL;
+  }
+
+  void IDevice::observer_free(observer_t *ob)
+  { if(ob->thread)
+    { Mutex_Lock(ob->lock);
+      ob->quit = 1;
+      Condition_Notify_All(ob->cv);
+      Mutex_Unlock(ob->lock);
+      Thread_Join(ob->thread);
+      Thread_Free(ob->thread);
+    }
+    if(ob->cv)   Condition_Free(ob->cv);
+    if(ob->lock) Mutex_Free(ob->lock);
+    free(ob);
+  }
+
+  void IDevice::observe(IObserver *o, size_t ichan, ObserverMode mode)
+  { observer_t *ob;
+    size_t i;
+    Mutex_Lock(_observer_lock);
+    for(i=0;i<_nobservers;++i)
+      if(_observers[i]->o==o && _observers[i]->ichan==ichan)
+      { if(_observers[i]->mode==mode)
+          goto Finalize;
+        observer_free(_observers[i]);
+        _observers[i] = _observers[--_nobservers];
+        break;
+      }
+    Guarded_Assert(ob = (observer_t*)calloc(1,sizeof(observer_t)));
+    ob->self  = this;
+    ob->o     = o;
+    ob->ichan = ichan;
+    ob->mode  = mode;
+    if(mode==OBSERVE_THREAD)
+    { Guarded_Assert(ob->lock   = Mutex_Alloc());
+      Guarded_Assert(ob->cv     = Condition_Alloc());
+      Guarded_Assert(ob->thread = Thread_Alloc(observer_thread,ob));
+    }
+    if(_nobservers>=_observers_cap)
+    { _observers_cap = _observers_cap?2*_observers_cap:4;
+      Guarded_Assert(_observers = (observer_t**)realloc(_observers,_observers_cap*sizeof(observer_t*)));
+    }
+    _observers[_nobservers++] = ob;
+  Finalize:
+    Mutex_Unlock(_observer_lock);
+  }
+
+  void IDevice::unobserve(IObserver *o)
+  { size_t i;
+    Mutex_Lock(_observer_lock);
+    for(i=0;i<_nobservers;)
+      if(_observers[i]->o==o)
+      { observer_free(_observers[i]);
+        _observers[i] = _observers[--_nobservers];
+      } else
+        ++i;
+    Mutex_Unlock(_observer_lock);
+  }
+
+  void IDevice::_notify_observers(size_t ichan, void *msg, size_t nbytes)
+  { size_t i;
+    if(!_nobservers) // unlocked peek.  An observer attached right now may miss this message.
+      return;
+    Mutex_Lock(_observer_lock);
+    for(i=0;i<_nobservers;++i)
+    { observer_t *ob = _observers[i];
+      if(ob->ichan!=ichan || ob->mode!=OBSERVE_THREAD) continue;
+      Mutex_Lock(ob->lock);
+      ob->msg     = msg;
+      ob->nbytes  = nbytes;
+      ob->pending = 1;
+      Condition_Notify_All(ob->cv);
+      Mutex_Unlock(ob->lock);
+    }
+    for(i=0;i<_nobservers;++i)
+    { observer_t *ob = _observers[i];
+      if(ob->ichan==ichan && ob->mode==OBSERVE_INLINE)
+        ob->o->on_message(this,ichan,msg,nbytes);
+    }
+    for(i=0;i<_nobservers;++i)
+    { observer_t *ob = _observers[i];
+      if(ob->ichan!=ichan || ob->mode!=OBSERVE_THREAD) continue;
+      Mutex_Lock(ob->lock);
+      while(ob->pending)
+        Condition_Wait(ob->cv,ob->lock);
+      Mutex_Unlock(ob->lock);
+    }
+    Mutex_Unlock(_observer_lock);
+  }
+
   void IDevice::_free_qs(vector_PCHAN **pqs)
   {
     vector_PCHAN *qs = *pqs;
@@ -634,25 +856,29 @@ Error:
     }
   }
 
-  void IDevice::_alloc_qs(vector_PCHAN **pqs, size_t n, size_t *nbuf, size_t *nbytes)
+  // Page aligned so workers can use aligned loads.  Pre-faulted so the first
+  // frames of an acquisition don't stall on page faults.
+  const ChanAllocator IDevice::FRAME_QUEUE_ALLOCATOR = {4096,0,CHAN_ALLOC_PREFAULT};
+
+  void IDevice::_alloc_qs(vector_PCHAN **pqs, size_t n, size_t *nbuf, size_t *nbytes, const ChanAllocator *allocator)
   {
     if(n){
       IDevice::_free_qs(pqs); // Release existing queues.
       *pqs = vector_PCHAN_alloc(n);
       while(n--)
-        (*pqs)->contents[n] = Chan_Alloc(nbuf[n], nbytes[n]);
+        (*pqs)->contents[n] = Chan_Alloc_With(nbuf[n], nbytes[n], allocator);
 
       (*pqs)->count = (*pqs)->nelem; // This is so we can resize correctly later.
     }
   }
 
-  void IDevice::_alloc_qs_easy(vector_PCHAN **pqs, size_t n, size_t nbuf, size_t nbytes)
+  void IDevice::_alloc_qs_easy(vector_PCHAN **pqs, size_t n, size_t nbuf, size_t nbytes, const ChanAllocator *allocator)
   {
     if(n){
       IDevice::_free_qs(pqs); // Release existing queues.
       *pqs = vector_PCHAN_alloc(n);
       while(n--)
-        (*pqs)->contents[n] = Chan_Alloc(nbuf, nbytes);
+        (*pqs)->contents[n] = Chan_Alloc_With(nbuf, nbytes, allocator);
 
       (*pqs)->count = (*pqs)->nelem; // This is so we can resize correctly later.
     }
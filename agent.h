@@ -15,6 +15,7 @@
 
 #include "common.h"
 #include "chan.h"
+#include "thread.h"
 #include "object.h"
 #include "util\util-protobuf.h"
 
@@ -42,8 +43,18 @@
 
     The arm() step associates the \ref Agent with a \ref fetch::Task.  Only one
     \ref fetch::Task can be associated at a time.  It defines a function that
-    will be run in it's own thread when the \ref Agent is run().  When that
-    function returns, the \ref Agent will go back to the armed() state.
+    will be run on the agent's worker thread when the \ref Agent is run().  When
+    that function returns, the \ref Agent will go back to the armed() state.
+
+    The worker thread is started the first time the agent is armed and parks
+    between runs, so a run()/stop() cycle (once per tile or stack) doesn't pay
+    for creating and destroying a thread.  Wait on \c _notify_done to wait for
+    a run to finish.
+
+    The worker only uses the portable primitives in thread.h.  The agent's
+    notifications (\c _notify_done, \c _notify_stop and \c _notify_available)
+    are still Win32 events, because tasks wait on them together with other
+    handles, so the agent as a whole still needs Windows.
 
     After an agent object is initially constructed, a context must be assigned
     via the Attach() method.  Once a context is assigned, the Agent is "available"
@@ -79,6 +90,7 @@
  */
 
 #define AGENT_DEFAULT_TIMEOUT INFINITE
+#define AGENT_DESTROY_TIMEOUT 5000     ///< ms ~Agent() waits for a running task to stop before abandoning it
 
 namespace fetch {
 
@@ -88,6 +100,21 @@ namespace fetch {
 
   class Task;
   class Agent;
+  class IDevice;
+
+  //  IObserver
+  /** Looks at the messages a device pushes to one of its outputs without
+      being a stage in the chain.  See IDevice::observe().
+
+      on_message() sees each message in place, just before the producer pushes
+      it.  It must not change the message or hold on to the pointer.
+   */
+  class IObserver
+  {
+  public:
+    virtual ~IObserver() {}
+    virtual void on_message(IDevice *source, size_t ichan, void *msg, size_t nbytes)=0;
+  };
 
   //  IDevice
   /** Interface class defining callbacks to handle \ref Agent state changes.
@@ -142,12 +169,50 @@ namespace fetch {
     ///     Safe for calling with *qs==NULL. qs must not be NULL.
     ///     Sets *qs to NULL after releasing queues.
     ///
-    static void _alloc_qs      (vector_PCHAN **qs, size_t n, size_t *nbuf, size_t *nbytes);
-    static void _alloc_qs_easy (vector_PCHAN **qs, size_t n, size_t nbuf, size_t nbytes);
+    /// The optional allocator is used for every queue.  See Chan_Alloc_With().
+    /// FRAME_QUEUE_ALLOCATOR is the one to use for queues carrying frames.
+    ///
+    static void _alloc_qs      (vector_PCHAN **qs, size_t n, size_t *nbuf, size_t *nbytes, const ChanAllocator *allocator=NULL);
+    static void _alloc_qs_easy (vector_PCHAN **qs, size_t n, size_t nbuf, size_t nbytes, const ChanAllocator *allocator=NULL);
     static void _free_qs       (vector_PCHAN **qs);
 
+    static const ChanAllocator FRAME_QUEUE_ALLOCATOR; ///< page aligned and pre-faulted
+
+  public:
+    /// \fn observe
+    ///     Attaches an observer to out[ichan].  Observing again changes the
+    ///     mode.  Observers can come and go while the device runs.
+    /// \fn unobserve
+    ///     Detaches an observer from every output.
+    /// \fn _notify_observers
+    ///     Producers call this just before pushing \a msg to out[ichan].
+    ///     Returns when every observer of out[ichan] is done with it.
+    ///
+    /// OBSERVE_INLINE observers run one after another on the producer's
+    /// thread.  OBSERVE_THREAD observers each run on a thread of their own,
+    /// at the same time as each other and the inline ones, so several
+    /// observers cost about as much as the slowest.  Either way the message
+    /// isn't copied and isn't pushed till they're all done, so an observer
+    /// needs no queue and holds no buffers.
+    enum ObserverMode
+    { OBSERVE_INLINE=0,
+      OBSERVE_THREAD
+    };
+    void observe          (IObserver *o, size_t ichan=0, ObserverMode mode=OBSERVE_INLINE);
+    void unobserve        (IObserver *o);
+    void _notify_observers(size_t ichan, void *msg, size_t nbytes);
+
   private:
-    IDevice() {};
+    struct observer_t;
+    static void* observer_thread(void *arg);
+    static void  observer_free(observer_t *ob);
+
+    Mutex       *_observer_lock;
+    observer_t **_observers;
+    size_t       _nobservers,
+                 _observers_cap;
+
+    IDevice() :_observer_lock(NULL),_observers(NULL),_nobservers(0),_observers_cap(0) {};
   };
 
   //
@@ -174,6 +239,7 @@ namespace fetch {
   public:
     IConfigurableDevice(Agent *agent);
     IConfigurableDevice(Agent *agent, Config *config);
+    virtual ~IConfigurableDevice();
     virtual Config get_config(void);            ///< see: _get_config()        - returns a snapshot of the config
     virtual void set_config(Config *cfg);       ///< see: _set_config(Config*) - assigns the address of the config
     virtual void set_config(const Config &cfg); ///< see: _set_config(Config&) - update via copy
@@ -190,14 +256,66 @@ namespace fetch {
 
     inline void transaction_lock();
     inline void transaction_unlock();
+
+  private:
+    struct config_snapshot_t;
+  public:
+    /// \class ConfigSnapshot
+    ///     Read-only view of the last published copy of the config, for
+    ///     code that reads the config once per frame.  Takes no lock and
+    ///     makes no copy: it's two atomic adds.
+    ///
+    ///     set_config() and set_config_nowait() publish a new copy.  Code
+    ///     that changes _config any other way (e.g. a parent's _set_config)
+    ///     should call publish_config() afterwards.
+    ///     A publish waits for the views of older copies to go away, so
+    ///     keep views short-lived and don't take the transaction lock while
+    ///     holding one.
+    ///
+    ///     \code
+    ///     { ConfigSnapshot c(this);
+    ///       use(c->threshold());
+    ///     }
+    ///     \endcode
+    class ConfigSnapshot
+    { public:
+        ConfigSnapshot(IConfigurableDevice<Tcfg> *d);
+        ~ConfigSnapshot();
+        const Tcfg& operator* () const {return  s_->cfg;}
+        const Tcfg* operator->() const {return &s_->cfg;}
+        u64 version() const            {return  s_->version;}     ///< goes up by one with each publish that changes something
+        u64 fingerprint() const        {return  s_->fingerprint;} ///< content hash.  See ::fingerprint().
+      private:
+        ConfigSnapshot(const ConfigSnapshot&);            // not copyable
+        ConfigSnapshot& operator=(const ConfigSnapshot&);
+        IConfigurableDevice<Tcfg> *d_;
+        size_t slot_;
+        const config_snapshot_t *s_;
+    };
+    void publish_config();               ///< copies _config into a new snapshot if it changed.  Synchronized.
+
   protected:
     virtual void update();               ///< This stops a running agent, calls the onUpdate() function, restarting the agent as necessary.
 
 
   private:
     static DWORD WINAPI _set_config_nowait__helper(LPVOID lparam);
+    void _publish_config();              ///< call with the transaction lock held
+    bool _config_unchanged(const Config &cfg); ///< byte compare, then the equals() walk
 
     CRITICAL_SECTION _transaction_lock;
+
+    struct config_snapshot_t
+    { Tcfg        cfg;
+      u64         version,
+                  fingerprint;
+      std::string bytes;       ///< cfg serialized.  Compared to drop publishes that change nothing.
+      config_snapshot_t(const Tcfg& c, u64 v) :cfg(c),version(v),fingerprint(0) {}
+    };
+    volatile size_t _snapshot;              ///< config_snapshot_t*.  NULL till first published.
+    volatile size_t _snapshot_epoch,        ///< new views count themselves in _snapshot_readers[_snapshot_epoch&1]
+                    _snapshot_readers[2];
+    u64             _snapshot_version;      ///< protected by the transaction lock
   };
 
 
@@ -263,10 +381,13 @@ namespace fetch {
 
     public: // Section (Data): treat as protected, friended to children of Task
 
-      HANDLE           _thread,
+      struct Worker;                      ///< defined in agent.cpp
+      HANDLE           _notify_done,      ///< manual reset.  Set when the task's run function returns.  Unset while running.
                        _notify_available,
                        _notify_stop;
       CRITICAL_SECTION _lock;
+      Worker          *_worker;           ///< runs the armed task.  Parked between runs.  NULL until the first arm().
+      IDevice         *_worker_arg;       ///< the device passed to arm()
       u32              _num_waiting,
                        _is_available,
                        _is_running;
@@ -276,6 +397,10 @@ namespace fetch {
       inline static unsigned _handle_wait_for_result     (DWORD result, const char *msg);
                     Agent*   _request_available_unlocked (int is_try, DWORD timeout_ms);
       inline unsigned int    _wait_till_available(DWORD timeout_ms);///< private because it requires a particular locking pattern
+                    void     _start_worker();
+                    void     _stop_worker();
+                    void     _abandon_worker();
+      static        void*    _worker_main(void *arg);
   };
 
   //end namespace fetch
@@ -297,7 +422,11 @@ namespace fetch {
   IConfigurableDevice<Tcfg>::IConfigurableDevice(Agent *agent)
     :IDevice(agent)
     ,Configurable()
+    ,_snapshot(0)
+    ,_snapshot_epoch(0)
+    ,_snapshot_version(0)
   {
+    _snapshot_readers[0]=_snapshot_readers[1]=0;
     Guarded_Assert_WinErr(InitializeCriticalSectionAndSpinCount(&_transaction_lock,0x80000400));
   }
 
@@ -305,10 +434,96 @@ namespace fetch {
   IConfigurableDevice<Tcfg>::IConfigurableDevice( Agent *agent, Config *config )
     :IDevice(agent)
     ,Configurable(config)
+    ,_snapshot(0)
+    ,_snapshot_epoch(0)
+    ,_snapshot_version(0)
   {
+    _snapshot_readers[0]=_snapshot_readers[1]=0;
     Guarded_Assert_WinErr(InitializeCriticalSectionAndSpinCount(&_transaction_lock,0x80000400));
   }
 
+  template<class Tcfg>
+  IConfigurableDevice<Tcfg>::~IConfigurableDevice()
+  {
+    delete (config_snapshot_t*)_snapshot;
+  }
+
+  //
+  // Config snapshots
+  //
+  // RCU-style.  A view counts itself in one of two reader slots, then loads
+  // the snapshot pointer.  A publish swaps in the new snapshot, then twice
+  // flips the epoch (so new views use the other slot) and waits for the
+  // slot it just retired to drain.  After both slots have drained once,
+  // nobody can still be looking at the old snapshot, and it's freed.
+  //
+  // Each snapshot keeps its serialized bytes.  A publish that wouldn't
+  // change anything is dropped before any copy or wait, so parents can
+  // publish their children on every set_config().
+  //
+
+  template<class Tcfg>
+  IConfigurableDevice<Tcfg>::ConfigSnapshot::ConfigSnapshot(IConfigurableDevice<Tcfg> *d)
+    :d_(d)
+  {
+    if(!Atomic_Load_Acquire(&d->_snapshot))
+      d->publish_config(); // first use
+    slot_=Atomic_Load_Acquire(&d->_snapshot_epoch)&1;
+    Atomic_Add(&d->_snapshot_readers[slot_],1);
+    s_=(const config_snapshot_t*)Atomic_Load_Acquire(&d->_snapshot);
+  }
+
+  template<class Tcfg>
+  IConfigurableDevice<Tcfg>::ConfigSnapshot::~ConfigSnapshot()
+  {
+    Atomic_Add(&d_->_snapshot_readers[slot_],(size_t)-1);
+  }
+
+  template<class Tcfg>
+  void IConfigurableDevice<Tcfg>::publish_config()
+  {
+    transaction_lock();
+    _publish_config();
+    transaction_unlock();
+  }
+
+  template<class Tcfg>
+  void IConfigurableDevice<Tcfg>::_publish_config()
+  { config_snapshot_t *next,
+                      *last=(config_snapshot_t*)Atomic_Load_Acquire(&_snapshot);
+    std::string bytes;
+    int i;
+    _config->SerializePartialToString(&bytes);
+    if(last && last->bytes==bytes)
+      return; // unchanged
+    next=new config_snapshot_t(*_config,++_snapshot_version);
+    next->fingerprint=::fingerprint(bytes);
+    next->bytes.swap(bytes);
+    last=(config_snapshot_t*)Atomic_Exchange(&_snapshot,(size_t)next);
+    if(!last)
+      return;
+    for(i=0;i<2;++i)
+    { size_t slot=(Atomic_Add(&_snapshot_epoch,1)-1)&1;
+      while(Atomic_Load_Acquire(&_snapshot_readers[slot]))
+        Thread_Yield();
+    }
+    delete last;
+  }
+
+  // Compares against the live _config, not the last publish: setters like
+  // Vibratome::setAmplitude() change _config in place without publishing.
+  // Matching bytes are unchanged.  Otherwise the fields are walked once,
+  // since equals() is looser than byte equality (float tolerance, defaults).
+  template<class Tcfg>
+  bool IConfigurableDevice<Tcfg>::_config_unchanged(const Config &cfg)
+  { std::string req,cur;
+    cfg.SerializePartialToString(&req);
+    _get_config().SerializePartialToString(&cur);
+    if(req==cur)
+      return true;
+    return !(cfg != _get_config()); // requires != defined for all Tcfg
+  }
+
   //************************************
   // Method:    get_config
   // FullName:  fetch::IConfigurableDevice<Tcfg>::get_config
@@ -346,13 +561,14 @@ namespace fetch {
   {
     int run;
     _agent->lock(); //will generate a recursive lock :(
-    if( *cfg != _get_config() ) // make sure an commit is required - requires != defined for all Tcfg
+    if( !_config_unchanged(*cfg) ) // make sure an commit is required
     { run = _agent->is_running();
       if(run)
         _agent->stop(AGENT_DEFAULT_TIMEOUT);
 
       transaction_lock();
       _set_config(cfg);
+      _publish_config();
       transaction_unlock();
       update();
 
@@ -367,13 +583,14 @@ namespace fetch {
   {
     int run;
     _agent->lock();
-    if( cfg != _get_config() ) // make sure an commit is required - requires != defined for all Tcfg
+    if( !_config_unchanged(cfg) ) // make sure an commit is required
     { run = _agent->is_running();
       if(run)
         _agent->stop(AGENT_DEFAULT_TIMEOUT); //will generate a recursive lock :(
 
       transaction_lock();
       _set_config(cfg);
+      _publish_config();
       transaction_unlock();
       update();
 
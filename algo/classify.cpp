@@ -0,0 +1,365 @@
+/** \file
+    Intensity/area threshold classifier.  See classify.h.
+
+    The pixel test (double)x>intensity is done in the pixel type: lower()
+    finds the pixel value t for which x>t gives the same answer, or finds
+    that every pixel (or none) passes.  That way the inner loop is a
+    compare and a count with no conversions, and for 8 to 32 bit pixels and
+    floats it's done 16 bytes at a time with SSE2.  64 bit integer pixels
+    don't convert exactly, so they're converted to double and compared one
+    at a time, as before.
+
+    The area test count/npx>area becomes count>=need, with need worked out
+    once per threshold (min_count()).  Every BLOCK_ pixels each undecided
+    threshold is checked: it's decided foreground once count>=need, and the
+    frame is background once a threshold can't reach need with the pixels
+    it has left.
+
+    classify_ex() can test a sample of each channel first.  The sample
+    settles a channel only when its fraction is further from \c area than
+    the Hoeffding bound for the requested confidence; a channel near the
+    threshold still gets the full scan, so it gets the same answer.  The
+    budget is checked between blocks of the full scan.
+*/
+#include "classify.h"
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include "thread.h"
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_   (8192) ///< pixels tested per channel between checks for an early exit
+#define NSTACK_  (8)    ///< thresholds that fit without a malloc
+
+enum { CMP, ALL, NONE };
+
+/** The type the pixel test is done in.  Only 64 bit integers differ. */
+template<class T> struct cmp_type      {typedef T      type;};
+template<>        struct cmp_type<u64> {typedef double type;};
+template<>        struct cmp_type<i64> {typedef double type;};
+
+//
+//  lower
+//
+
+/** For integer pixels, x>intensity is x>floor(intensity). */
+template<class T> static int lower(double intensity, typename cmp_type<T>::type *t)
+{ if(intensity!=intensity)           return NONE; // NaN
+  if(intensity< (double)TypeMin<T>()) return ALL;
+  if(intensity>=(double)TypeMax<T>()) return NONE;
+  *t=(T)floor(intensity);
+  return CMP;
+}
+
+/** For floats, x>intensity is x>t where t is the largest float not above intensity. */
+template<> int lower<f32>(double intensity, f32 *t)
+{ if(intensity!=intensity) return NONE;
+  if(intensity>= FLT_MAX)  {*t=FLT_MAX;   return CMP;} // only +inf passes
+  if(intensity< -FLT_MAX)  {*t=-HUGE_VALF;return CMP;} // all but -inf and NaN pass
+  *t=(f32)intensity;
+  if((double)*t>intensity)
+    *t=nextafterf(*t,-HUGE_VALF);
+  return CMP;
+}
+
+static int lower_double(double intensity, double *t)
+{ if(intensity!=intensity) return NONE;
+  *t=intensity;
+  return CMP;
+}
+template<> int lower<f64>(double intensity, f64 *t)    {return lower_double(intensity,t);}
+template<> int lower<u64>(double intensity, double *t) {return lower_double(intensity,t);}
+template<> int lower<i64>(double intensity, double *t) {return lower_double(intensity,t);}
+
+/** \returns the smallest count with count/n>area, or n+1 if there isn't one. */
+static size_t min_count(size_t n, double area)
+{ size_t k;
+  if(area!=area)   return n+1;
+  if(area<0.0)     return 0;
+  if(area>=1.0)    return n+1;
+  k=(size_t)floor(area*n)+1;
+  if(k>n+1) k=n+1;
+  while(k>0  && (k-1)/(double)n>area) --k; // fix up rounding
+  while(k<=n && !(k/(double)n>area))  ++k;
+  return k;
+}
+
+//
+//  count_above
+//  n is at most BLOCK_
+//
+
+template<class T,class Tt> static size_t count_scalar(const T *p, size_t n, Tt t)
+{ size_t i,c=0;
+  for(i=0;i<n;++i)
+    c+=(p[i]>t);
+  return c;
+}
+
+template<class T> static size_t count_above(const T *p, size_t n, typename cmp_type<T>::type t)
+{ return count_scalar(p,n,t);
+}
+
+#ifdef HAVE_SSE2
+static size_t hsum_epi64(__m128i v)
+{ u64 s[2];
+  _mm_storeu_si128((__m128i*)s,v);
+  return (size_t)(s[0]+s[1]);
+}
+
+static size_t hsum_epi32(__m128i v)
+{ u32 s[4];
+  _mm_storeu_si128((__m128i*)s,v);
+  return (size_t)s[0]+s[1]+s[2]+s[3];
+}
+
+// Unsigned compares flip the sign bit of both sides (bias) and use the signed compare.
+// Each compare gives -1 in the lanes that pass, so subtracting counts them.
+
+// 8 bit lanes would overflow, so they're summed every 255 vectors.
+#define COUNT8(T,bias) \
+  template<> size_t count_above<T>(const T *p, size_t n, T t) \
+  { const __m128i b=_mm_set1_epi8((char)(bias)), \
+                  tt=_mm_xor_si128(_mm_set1_epi8((char)t),b), \
+                  z=_mm_setzero_si128(); \
+    __m128i acc=z,sum=z; \
+    size_t i=0; \
+    unsigned k=0; \
+    for(;i+16<=n;i+=16) \
+    { acc=_mm_sub_epi8(acc,_mm_cmpgt_epi8(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(p+i)),b),tt)); \
+      if(++k==255) \
+      { sum=_mm_add_epi64(sum,_mm_sad_epu8(acc,z)); \
+        acc=z; \
+        k=0; \
+      } \
+    } \
+    sum=_mm_add_epi64(sum,_mm_sad_epu8(acc,z)); \
+    return hsum_epi64(sum)+count_scalar(p+i,n-i,t); \
+  }
+
+#define COUNT16(T,bias) \
+  template<> size_t count_above<T>(const T *p, size_t n, T t) \
+  { const __m128i b=_mm_set1_epi16((short)(bias)), \
+                  tt=_mm_xor_si128(_mm_set1_epi16((short)t),b); \
+    __m128i acc=_mm_setzero_si128(); \
+    size_t i=0; \
+    for(;i+8<=n;i+=8) \
+      acc=_mm_sub_epi16(acc,_mm_cmpgt_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(p+i)),b),tt)); \
+    return hsum_epi32(_mm_madd_epi16(acc,_mm_set1_epi16(1)))+count_scalar(p+i,n-i,t); \
+  }
+
+#define COUNT32(T,bias) \
+  template<> size_t count_above<T>(const T *p, size_t n, T t) \
+  { const __m128i b=_mm_set1_epi32((int)(bias)), \
+                  tt=_mm_xor_si128(_mm_set1_epi32((int)t),b); \
+    __m128i acc=_mm_setzero_si128(); \
+    size_t i=0; \
+    for(;i+4<=n;i+=4) \
+      acc=_mm_sub_epi32(acc,_mm_cmpgt_epi32(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(p+i)),b),tt)); \
+    return hsum_epi32(acc)+count_scalar(p+i,n-i,t); \
+  }
+
+COUNT8 (u8 ,0x80);
+COUNT8 (i8 ,0);
+COUNT16(u16,0x8000);
+COUNT16(i16,0);
+COUNT32(u32,0x80000000u);
+COUNT32(i32,0);
+#undef COUNT8
+#undef COUNT16
+#undef COUNT32
+
+template<> size_t count_above<f32>(const f32 *p, size_t n, f32 t)
+{ const __m128 tt=_mm_set1_ps(t);
+  __m128i acc=_mm_setzero_si128();
+  size_t i=0;
+  for(;i+4<=n;i+=4)
+    acc=_mm_sub_epi32(acc,_mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(p+i),tt)));
+  return hsum_epi32(acc)+count_scalar(p+i,n-i,t);
+}
+
+template<> size_t count_above<f64>(const f64 *p, size_t n, f64 t)
+{ const __m128d tt=_mm_set1_pd(t);
+  __m128i acc=_mm_setzero_si128();
+  size_t i=0;
+  for(;i+2<=n;i+=2)
+    acc=_mm_sub_epi64(acc,_mm_castpd_si128(_mm_cmpgt_pd(_mm_loadu_pd(p+i),tt)));
+  return hsum_epi64(acc)+count_scalar(p+i,n-i,t);
+}
+#endif // HAVE_SSE2
+
+//
+//  classify
+//
+
+/** Hoeffding bound: a fraction estimated from \a m random draws is within
+    the returned margin of the true one with probability \a confidence.
+*/
+static double margin(size_t m, double confidence)
+{ if(!(confidence<1.0)) return HUGE_VAL;
+  if(confidence<0.0)    confidence=0.0;
+  return sqrt(log(2.0/(1.0-confidence))/(2.0*m));
+}
+
+template<class T>
+static int classify_(const T *data, size_t width, size_t height, unsigned nplanes,
+                     const classify_threshold_t *th, unsigned n, const classify_options_t *o)
+{ typedef typename cmp_type<T>::type Tt;
+  struct state
+  { const T *p;         // first pixel of the region
+    size_t   w,h,np,    // region: columns, rows and planes
+             n,         // pixels in the region
+             need,      // count needed for foreground
+             count,     // pixels above, so far
+             scanned,   // pixels tested, so far
+             ip,ir,ic;  // next pixel to test
+    double   est;       // sampled fraction, or -1
+    Tt       t;
+    int      done;
+  } stack[NSTACK_],*s=stack;
+  const size_t pitch=width,
+               ppitch=width*height;
+  size_t   x=0,y=0,w=width,h=height;
+  double   t0=Clock_Seconds();
+  unsigned j,nleft=0;
+  int ok=1;
+
+  if(o && o->w && o->h)
+  { x=(o->x<width) ?o->x:width;
+    y=(o->y<height)?o->y:height;
+    w=(o->w<width-x) ?o->w:width-x;
+    h=(o->h<height-y)?o->h:height-y;
+  }
+  if(!w || !h)
+    return 0;
+  if(n>NSTACK_ && !(s=(state*)malloc(n*sizeof(state))))
+    return 0;
+  for(j=0;j<n;++j)
+  { int c=th[j].ichan;
+    if(c>=(int)nplanes) c=0;
+    memset(s+j,0,sizeof(*s));
+    s[j].p   =data+y*pitch+x+((c<0)?0:(size_t)c*ppitch);
+    s[j].w   =w;
+    s[j].h   =h;
+    s[j].np  =(c<0)?nplanes:1;
+    s[j].n   =s[j].np*w*h;
+    s[j].need=min_count(s[j].n,th[j].area);
+    s[j].est =-1.0;
+    switch(lower<T>(th[j].intensity,&s[j].t))
+    { case ALL:  s[j].count=s[j].n; // fall through
+      case NONE: s[j].done=1;
+    }
+    if(s[j].count>=s[j].need) s[j].done=1;
+    else if(s[j].done || s[j].need>s[j].n) {ok=0; goto Finalize;}
+    else ++nleft;
+  }
+
+  // Sample.  A channel is only settled here if the margin is clear.
+  if(o && ((o->sample==CLASSIFY_SAMPLE_STRIDE && o->stride>1) || (o->sample==CLASSIFY_SAMPLE_RANDOM && o->count)))
+    for(j=0;j<n;++j)
+    { state *q=s+j;
+      size_t ip,ir,ic,c=0,m=0;
+      double e;
+      if(q->done) continue;
+      if(o->sample==CLASSIFY_SAMPLE_STRIDE)
+      { for(ip=0;ip<q->np;++ip)
+          for(ir=0;ir<q->h;ir+=o->stride)
+          { const T *row=q->p+ip*ppitch+ir*pitch;
+            for(ic=0;ic<q->w;ic+=o->stride,++m)
+              c+=(row[ic]>q->t);
+          }
+      } else
+      { u64 z=0x9E3779B97F4A7C15ULL*(j+1); // fixed seed, so a frame always gets the same answer
+        size_t k;
+        for(;m<o->count;++m)
+        { z=z*6364136223846793005ULL+1442695040888963407ULL;
+          k =(size_t)((z>>16)%q->n);
+          ip=k/(q->w*q->h); k-=ip*q->w*q->h;
+          ir=k/q->w;
+          ic=k-ir*q->w;
+          c+=(q->p[ip*ppitch+ir*pitch+ic]>q->t);
+        }
+      }
+      q->est=c/(double)m;
+      e=margin(m,o->confidence);
+      if(q->est>th[j].area+e)
+      { q->done=1;
+        --nleft;
+      } else if(q->est<th[j].area-e)
+      { ok=0;
+        goto Finalize;
+      }
+    }
+
+  // Full scan, a block at a time
+  while(nleft)
+  { for(j=0;j<n;++j)
+    { state *q=s+j;
+      size_t m=0,k;
+      if(q->done) continue;
+      while(m<BLOCK_ && q->ip<q->np)
+      { k=q->w-q->ic;
+        if(k>BLOCK_-m) k=BLOCK_-m;
+        q->count+=count_above<T>(q->p+q->ip*ppitch+q->ir*pitch+q->ic,k,q->t);
+        m+=k;
+        if((q->ic+=k)==q->w)
+        { q->ic=0;
+          if(++q->ir==q->h)
+          { q->ir=0;
+            ++q->ip;
+          }
+        }
+      }
+      q->scanned+=m;
+      if(q->count>=q->need)
+      { q->done=1;
+        --nleft;
+      } else if(q->count+(q->n-q->scanned)<q->need)
+      { ok=0;
+        goto Finalize;
+      }
+    }
+    if(nleft && o && o->budget_s>0.0 && Clock_Seconds()-t0>o->budget_s)
+    { // Out of time.  Go with the sample, or with what's been counted.
+      for(j=0;ok && j<n;++j)
+        if(!s[j].done)
+          ok=((s[j].est>=0.0)?s[j].est:s[j].count/(double)s[j].scanned)>th[j].area;
+      goto Finalize;
+    }
+  }
+Finalize:
+  if(s!=stack) free(s);
+  return ok;
+}
+
+#define CASE(id,T) case id: return classify_<T>((const T*)data,width,height,nplanes,t,n,opts)
+int classify_ex(const void *data, Basic_Type_ID type, size_t width, size_t height, unsigned nplanes,
+                const classify_threshold_t *t, unsigned n, const classify_options_t *opts)
+{ if(!n) return 1;
+  if(!width || !height || !nplanes) return 0;
+  switch(type)
+  { CASE(id_u8 ,u8 );
+    CASE(id_u16,u16);
+    CASE(id_u32,u32);
+    CASE(id_u64,u64);
+    CASE(id_i8 ,i8 );
+    CASE(id_i16,i16);
+    CASE(id_i32,i32);
+    CASE(id_i64,i64);
+    CASE(id_f32,f32);
+    CASE(id_f64,f64);
+    default:
+      return 0;
+  }
+}
+#undef CASE
+
+int classify(const void *data, Basic_Type_ID type, size_t npx, unsigned nplanes,
+             const classify_threshold_t *t, unsigned n)
+{ return classify_ex(data,type,npx,1,nplanes,t,n,NULL);
+}
@@ -0,0 +1,59 @@
+#pragma once
+/** \file
+    Intensity/area threshold classifier shared by TripDetect, SurfaceFind and
+    AutoTileAcquisition.
+
+    A channel is "foreground" when more than \c area of its pixels are
+    brighter than \c intensity.  classify() tests several channels of one
+    frame at once and says whether all of them are foreground.
+    classify_ex() adds a region of interest, sampling and a time budget.
+*/
+#include "types.h"
+
+typedef struct _classify_threshold_t
+{ int    ichan;     ///< plane to test.  -1 tests all the planes as one.  Out of range uses plane 0.
+  double intensity; ///< in pixel units
+  double area;      ///< 0 to 1.  Fraction of pixels that must be brighter than intensity.
+} classify_threshold_t;
+
+typedef enum _classify_sample_t
+{ CLASSIFY_SAMPLE_NONE=0, ///< scan every pixel
+  CLASSIFY_SAMPLE_STRIDE, ///< first test every stride'th row and column
+  CLASSIFY_SAMPLE_RANDOM  ///< first test count pixels drawn at random
+} classify_sample_t;
+
+typedef struct _classify_options_t
+{ unsigned          x,y,w,h;    ///< region of interest in each plane.  A w or h of 0 uses the whole plane.
+  classify_sample_t sample;
+  unsigned          stride;     ///< CLASSIFY_SAMPLE_STRIDE
+  unsigned          count;      ///< CLASSIFY_SAMPLE_RANDOM.  Pixels drawn per threshold.
+  double            confidence; ///< 0 to 1.  A sample settles a threshold only if it's this likely to agree with the full scan.
+  double            budget_s;   ///< 0 for none.  Once the full scan has taken this long, the rest is decided from the sample (or the pixels counted so far).
+} classify_options_t;
+
+/** \returns 1 if every threshold in \a t is met, otherwise 0.
+
+    \a data holds \a nplanes planes of \a npx pixels each, one after the
+    other (as in Frame_With_Interleaved_Planes or a mylib Array with the
+    channels in the last dimension).  An empty image is background.  With no
+    thresholds the frame is foreground.
+
+    The planes are walked together in blocks.  A threshold stops being
+    tested once its result is certain either way, and the whole call returns
+    as soon as any threshold fails.
+*/
+int classify(const void *data, Basic_Type_ID type, size_t npx, unsigned nplanes,
+             const classify_threshold_t *t, unsigned n);
+
+/** classify() for \a nplanes planes of \a width by \a height pixels, with
+    options.  \a opts may be NULL.
+
+    The answer is the full scan's for the region unless the budget runs
+    out.  A sampled decision is only used when the sample is clear of the
+    threshold by more than the margin for \c confidence; for random
+    sampling that's a bound on the chance of a different answer.  The
+    stride sample uses the same margin but, being regular, has no such
+    guarantee.
+*/
+int classify_ex(const void *data, Basic_Type_ID type, size_t width, size_t height, unsigned nplanes,
+                const classify_threshold_t *t, unsigned n, const classify_options_t *opts);
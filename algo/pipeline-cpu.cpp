@@ -0,0 +1,881 @@
+/** \file
+    CPU implementation of the resonant unwarp/average pipeline.
+
+    Implements the interface in pipeline.h, so it replaces pipeline.cu at
+    link time.  Output dimensions, the interval-encoded lookup table (see
+    pipeline_fill_lut()), frame averaging and intensity scaling all follow
+    the CUDA kernels.
+
+    The lookup table is re-encoded as "taps" for each block of BLOCK_
+    output columns: every column in a block gets the same number of
+    (source column, weight) pairs, padded with zero weights.  The inner loop
+    is then a gather and a multiply-add across the block.  Kernels are built
+    for AVX-512, AVX2 and plain C++.  pipeline_make() picks the best one the
+    processor supports unless pipeline_param_t::isa asks for another.
+
+    Each row goes through one fused pass: convert the source row, unwarp it
+    into a small per-worker row, and then, depending on the frame, add it to
+    the frame-average accumulator, or fold in and clear the accumulator,
+    scale, round and store to the destination.  The passes over the
+    per-worker row stay in cache, so the accumulator and destination are
+    each streamed through memory once per frame.  Without frame averaging
+    there's no accumulator at all.  The row function is a template for
+    every (source type, destination type, averaging mode).
+
+    Rows are split across a pool of worker threads that lives as long as the
+    context.  Each worker always gets the same block of rows, so the
+    accumulator rows it touches first (zeroing them) stay on its NUMA node,
+    and frame averaging needs no locking: no two workers share a row.
+
+    pipeline_submit() queues a frame on a ring of up to PIPELINE_MAX_IN_FLIGHT
+    frames and returns.  Workers take frames in order.  Since a worker only
+    ever touches its own rows, it moves on to the next frame without waiting
+    for the others.  A frame is done when every worker has finished it.
+    Anything that changes the taps, the accumulator or the row split first
+    waits for the workers to finish every queued frame.
+*/
+#include "pipeline.h"
+#include "pipeline-image.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <float.h>
+#include <stdio.h>  //for printf
+#include <stdlib.h> //for malloc
+#include <string.h> //for memset
+#include <stdint.h>
+#include <limits>
+#include "thread.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_AVX2                        // msvc emits any intrinsic without /arch
+#define TARGET_AVX512
+#if _MSC_VER>=1910
+#define HAVE_AVX512
+#endif
+#else
+#define TARGET_AVX2   __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define HAVE_AVX512
+#endif
+#endif
+
+#define BLOCK_  (16)  ///< output columns per block of taps.  One AVX-512 vector or two AVX2 vectors.
+#define ALIGN_  (256) ///< output rows are aligned to this number of elements.  Same as the CUDA backend.
+
+#if 0
+#define ECHO(estr)   LOG("---\t%s\n",estr)
+#else
+#define ECHO(estr)
+#endif
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr,msg) LOG("%s(%d): %s()\n\t%s\n\t%s\n",__FILE__,__LINE__,__FUNCTION__,estr,msg)
+#define TRY(e)       do{ECHO(#e);if(!(e)){REPORT(#e,"Evaluated to false."); goto Error;}}while(0)
+#define FAIL(msg)    do{REPORT("Failure.",msg);goto Error;} while(0)
+#define NEW(T,e,N)   TRY((e)=(T*)malloc(sizeof(T)*(N)))
+#define ZERO(T,e,N)  memset((e),0,sizeof(T)*(N))
+
+#define countof(e)   (sizeof(e)/sizeof(*(e)))
+
+#define CEIL(num,den) (((num)+(den)-(1))/(den))
+
+/**
+ * The lookup table re-encoded for the CPU kernels.
+ * Block \c b's taps are \c idx[BLOCK_*offset[b]] through \c idx[BLOCK_*offset[b+1]],
+ * laid out tap by tap, \c BLOCK_ columns per tap.
+ */
+struct pipeline_taps_t
+{ unsigned nblocks;
+  unsigned * __restrict__ offset; ///< nblocks+1 elements
+  int32_t  * __restrict__ idx;    ///< source column
+  float    * __restrict__ wt;     ///< weight.  Zero for padding.
+};
+
+typedef void (*warp_row_t) (const pipeline_taps_t *taps, float * __restrict__ out, const float * __restrict__ row);
+typedef void (*round_row_t)(float * __restrict__ v, unsigned n, float m, float b, float lo, float hi);
+
+struct pipeline_worker_t;
+struct pipeline_frame_t;
+typedef void (*job_t)(struct pipeline_worker_t *w, const struct pipeline_frame_t *f);
+
+/**
+ * One queued frame.
+ */
+struct pipeline_frame_t
+{ job_t          job;
+  struct pipeline_image_t_ src,dst;
+  float          m,b;               ///< slope and intercept for the emitted frame
+  int            fresh;             ///< workers zero their accumulator rows first
+  unsigned       pending;           ///< workers still running this frame.  Protected by the lock.
+};
+
+/**
+ * One thread's share of the work.
+ */
+struct pipeline_worker_t
+{ struct pipeline_t_ *self;
+  Thread   *thread;
+  unsigned  r0,r1;     ///< the rows this worker owns: [r0,r1)
+  unsigned  seen;      ///< the number of frames this worker has finished
+  float * __restrict__ row; ///< a source row converted to float
+  float * __restrict__ out; ///< the unwarped row.  2*ow elements.
+};
+
+/**
+ * The object that manages pipeline execution.
+ */
+typedef struct pipeline_t_
+{ pipeline_taps_t taps;
+  unsigned       count, ///< the number of frames that have been pushed to the accumulator
+                 every; ///< the number of frames to average
+  double         samples_per_scan;
+  bool           invert;
+  unsigned       downsample;
+  unsigned       alignment;         ///< output rows are aligned to this target number of elements.
+  unsigned       w,h;               ///< source width and height (height is nrows*nchan).  The shape of tmp.
+  unsigned       lut_width;         ///< source width the taps were made for.  0 if there are none.
+  unsigned       ow;                ///< output width for lut_width
+  float          norm,              ///< 1.0/the frame count as a float (eg. for every=4, this should be 0.25)
+                 m,b;               ///< slope and intercept for intensity scaling
+  pipeline_isa_t isa;               ///< the kernels in use
+  warp_row_t     warp_row;
+  round_row_t    round_row;
+  float * __restrict__ tmp;         ///< accumulator.  2*ow floats per source row.  Only used when averaging.
+
+  int            fresh;             ///< tmp was just allocated or reset.  Passed on to the next frame.
+
+  // worker pool
+  pipeline_worker_t *workers;
+  unsigned       nworkers;
+  Mutex         *lock;              ///< protects submitted, quit and each frame's pending count
+  Condition     *wake,              ///< signals a new frame
+                *done;              ///< signals a frame's pending count went to zero
+  int            quit;
+
+  // frames in flight
+  pipeline_frame_t frames[PIPELINE_MAX_IN_FLIGHT];
+  unsigned       submitted,         ///< frame i is in frames[i%PIPELINE_MAX_IN_FLIGHT]
+                 retired;           ///< only touched by the caller
+} *pipeline_t;
+
+//
+// --- KERNELS ---
+//
+
+/** Unwarps one source row into \a out (2*ow elements). */
+static void warp_row_scalar(const pipeline_taps_t *taps, float * __restrict__ out, const float * __restrict__ row)
+{ for(unsigned b=0;b<taps->nblocks;++b,out+=BLOCK_)
+  { const int32_t *idx=taps->idx+BLOCK_*taps->offset[b];
+    const float   *wt =taps->wt +BLOCK_*taps->offset[b];
+    const unsigned n  =taps->offset[b+1]-taps->offset[b];
+    float v[BLOCK_]={0};
+    for(unsigned k=0;k<n;++k,idx+=BLOCK_,wt+=BLOCK_)
+      for(int i=0;i<BLOCK_;++i)
+        v[i]+=wt[i]*row[idx[i]];
+    for(int i=0;i<BLOCK_;++i)
+      out[i]=v[i];
+  }
+}
+
+/**
+ * Scales, rounds half away from zero and clamps to [lo,hi], in place.
+ * Rounds like the CUDA cast_kernel, so it isn't appropriate for converting
+ * to floating point types.
+ */
+static void round_row_scalar(float * __restrict__ v, unsigned n, float m, float b, float lo, float hi)
+{ for(unsigned i=0;i<n;++i)
+  { const float x=roundf(fmaf(v[i],m,b));
+    v[i]=(x<lo)?lo:((x>hi)?hi:x);
+  }
+}
+
+#ifdef HAVE_X86
+TARGET_AVX2 static void warp_row_avx2(const pipeline_taps_t *taps, float * __restrict__ out, const float * __restrict__ row)
+{ for(unsigned b=0;b<taps->nblocks;++b,out+=BLOCK_)
+  { const int32_t *idx=taps->idx+BLOCK_*taps->offset[b];
+    const float   *wt =taps->wt +BLOCK_*taps->offset[b];
+    const unsigned n  =taps->offset[b+1]-taps->offset[b];
+    __m256 v0=_mm256_setzero_ps(),
+           v1=_mm256_setzero_ps();
+    for(unsigned k=0;k<n;++k,idx+=BLOCK_,wt+=BLOCK_)
+    { v0=_mm256_fmadd_ps(_mm256_loadu_ps(wt  ),_mm256_i32gather_ps(row,_mm256_loadu_si256((const __m256i*)(idx  )),4),v0);
+      v1=_mm256_fmadd_ps(_mm256_loadu_ps(wt+8),_mm256_i32gather_ps(row,_mm256_loadu_si256((const __m256i*)(idx+8)),4),v1);
+    }
+    _mm256_storeu_ps(out  ,v0);
+    _mm256_storeu_ps(out+8,v1);
+  }
+}
+
+TARGET_AVX2 static void round_row_avx2(float * __restrict__ v, unsigned n, float m, float b, float lo, float hi)
+{ const __m256 mm=_mm256_set1_ps(m),
+               bb=_mm256_set1_ps(b),
+               ll=_mm256_set1_ps(lo),
+               hh=_mm256_set1_ps(hi),
+             half=_mm256_set1_ps(0.5f),
+              one=_mm256_set1_ps(1.0f),
+             sign=_mm256_set1_ps(-0.0f);
+  unsigned i;
+  for(i=0;i+8<=n;i+=8)
+  { __m256 x=_mm256_fmadd_ps(_mm256_loadu_ps(v+i),mm,bb),
+           a=_mm256_andnot_ps(sign,x),                              // |x|
+           t=_mm256_floor_ps(a);
+    t=_mm256_add_ps(t,_mm256_and_ps(_mm256_cmp_ps(_mm256_sub_ps(a,t),half,_CMP_GE_OQ),one)); // half away from zero
+    x=_mm256_or_ps(t,_mm256_and_ps(x,sign));
+    _mm256_storeu_ps(v+i,_mm256_min_ps(_mm256_max_ps(x,ll),hh));
+  }
+  round_row_scalar(v+i,n-i,m,b,lo,hi);
+}
+#endif
+
+#ifdef HAVE_AVX512
+TARGET_AVX512 static void warp_row_avx512(const pipeline_taps_t *taps, float * __restrict__ out, const float * __restrict__ row)
+{ for(unsigned b=0;b<taps->nblocks;++b,out+=BLOCK_)
+  { const int32_t *idx=taps->idx+BLOCK_*taps->offset[b];
+    const float   *wt =taps->wt +BLOCK_*taps->offset[b];
+    const unsigned n  =taps->offset[b+1]-taps->offset[b];
+    __m512 v=_mm512_setzero_ps();
+    for(unsigned k=0;k<n;++k,idx+=BLOCK_,wt+=BLOCK_)
+      v=_mm512_fmadd_ps(_mm512_loadu_ps(wt),_mm512_i32gather_ps(_mm512_loadu_si512(idx),row,4),v);
+    _mm512_storeu_ps(out,v);
+  }
+}
+
+TARGET_AVX512 static void round_row_avx512(float * __restrict__ v, unsigned n, float m, float b, float lo, float hi)
+{ const __m512 mm=_mm512_set1_ps(m),
+               bb=_mm512_set1_ps(b),
+               ll=_mm512_set1_ps(lo),
+               hh=_mm512_set1_ps(hi),
+             half=_mm512_set1_ps(0.5f),
+              one=_mm512_set1_ps(1.0f);
+  const __m512i sign=_mm512_set1_epi32(0x80000000);
+  unsigned i;
+  for(i=0;i+16<=n;i+=16)
+  { __m512  x=_mm512_fmadd_ps(_mm512_loadu_ps(v+i),mm,bb);
+    __m512i s=_mm512_and_si512(_mm512_castps_si512(x),sign);
+    __m512  a=_mm512_castsi512_ps(_mm512_andnot_si512(sign,_mm512_castps_si512(x))), // |x|
+            t=_mm512_roundscale_ps(a,_MM_FROUND_TO_NEG_INF|_MM_FROUND_NO_EXC);
+    t=_mm512_mask_add_ps(t,_mm512_cmp_ps_mask(_mm512_sub_ps(a,t),half,_CMP_GE_OQ),t,one);  // half away from zero
+    x=_mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(t),s));
+    _mm512_storeu_ps(v+i,_mm512_min_ps(_mm512_max_ps(x,ll),hh));
+  }
+  round_row_scalar(v+i,n-i,m,b,lo,hi);
+}
+#endif
+
+/** Converts a source row to float. */
+template<typename T>
+static void load_row(float * __restrict__ dst, const T * __restrict__ src, unsigned n)
+{ for(unsigned i=0;i<n;++i)
+    dst[i]=(float)src[i];
+}
+
+/** Narrows rounded values to the output type. */
+template<typename T>
+static void store_row(T * __restrict__ dst, const float * __restrict__ src, unsigned n)
+{ for(unsigned i=0;i<n;++i)
+    dst[i]=(T)src[i];
+}
+
+static void add_row(float * __restrict__ acc, const float * __restrict__ v, unsigned n)
+{ for(unsigned i=0;i<n;++i)
+    acc[i]+=v[i];
+}
+
+/** Adds the accumulator into \a v and clears it. */
+static void fold_row(float * __restrict__ v, float * __restrict__ acc, unsigned n)
+{ for(unsigned i=0;i<n;++i)
+  { v[i]+=acc[i];
+    acc[i]=0.0f;
+  }
+}
+
+/** Clamping range for the output type.  Inside the type's range once converted to float. */
+template<typename T> static float lo_of()
+{ return std::numeric_limits<T>::is_integer?(float)std::numeric_limits<T>::min():-FLT_MAX;
+}
+template<typename T> static float hi_of()
+{ float h;
+  if(!std::numeric_limits<T>::is_integer)
+    return FLT_MAX;
+  h=(float)std::numeric_limits<T>::max();
+  if((double)h>(double)std::numeric_limits<T>::max())
+    h=nextafterf(h,0.0f);
+  return h;
+}
+
+//
+// --- DISPATCH ---
+//
+
+static pipeline_isa_t pipeline_best_isa(void)
+{
+#ifdef HAVE_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+  int r[4];
+  unsigned long long xcr0;
+  __cpuid(r,0);
+  if(r[0]<7) return PIPELINE_ISA_SCALAR;
+  __cpuid(r,1);
+  if(!(r[2]&(1<<27)) || !(r[2]&(1<<12))) return PIPELINE_ISA_SCALAR; // osxsave, fma
+  xcr0=_xgetbv(0);
+  if((xcr0&6)!=6) return PIPELINE_ISA_SCALAR;                         // os saves ymm
+  __cpuidex(r,7,0);
+  if(!(r[1]&(1<<5))) return PIPELINE_ISA_SCALAR;                      // avx2
+#ifdef HAVE_AVX512
+  if((r[1]&(1<<16)) && (xcr0&0xe6)==0xe6) return PIPELINE_ISA_AVX512; // avx512f, os saves zmm
+#endif
+  return PIPELINE_ISA_AVX2;
+#else
+  __builtin_cpu_init();
+#ifdef HAVE_AVX512
+  if(__builtin_cpu_supports("avx512f")) return PIPELINE_ISA_AVX512;
+#endif
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return PIPELINE_ISA_AVX2;
+#endif
+#endif
+  return PIPELINE_ISA_SCALAR;
+}
+
+static int pipeline_select_isa(pipeline_t self, pipeline_isa_t isa)
+{ const pipeline_isa_t best=pipeline_best_isa();
+  if(isa==PIPELINE_ISA_AUTO || isa>best)
+  { if(isa!=PIPELINE_ISA_AUTO)
+      LOG("%s(%d): %s()\n\tRequested instruction set isn't available.  Using the best one that is.\n",__FILE__,__LINE__,__FUNCTION__);
+    isa=best;
+  }
+  switch(isa)
+  { case PIPELINE_ISA_SCALAR: self->warp_row=warp_row_scalar; self->round_row=round_row_scalar; break;
+#ifdef HAVE_X86
+    case PIPELINE_ISA_AVX2:   self->warp_row=warp_row_avx2;   self->round_row=round_row_avx2;   break;
+#endif
+#ifdef HAVE_AVX512
+    case PIPELINE_ISA_AVX512: self->warp_row=warp_row_avx512; self->round_row=round_row_avx512; break;
+#endif
+    default: FAIL("Unsupported instruction set.");
+  }
+  self->isa=isa;
+  return 1;
+Error:
+  return 0;
+}
+
+//
+// --- WORKERS ---
+//
+
+static void pipeline_run_frame(pipeline_worker_t *w, const pipeline_frame_t *f)
+{ const pipeline_t self=w->self;
+  if(f->fresh && self->tmp)
+    ZERO(float,self->tmp+(size_t)w->r0*2*self->ow,(size_t)(w->r1-w->r0)*2*self->ow);
+  f->job(w,f);
+}
+
+static void* pipeline_worker_main(void *arg)
+{ pipeline_worker_t *w=(pipeline_worker_t*)arg;
+  const pipeline_t self=w->self;
+  Mutex_Lock(self->lock);
+  while(1)
+  { pipeline_frame_t *f;
+    while(w->seen==self->submitted && !self->quit)
+      Condition_Wait(self->wake,self->lock);
+    if(self->quit)
+      break;
+    f=self->frames+w->seen%PIPELINE_MAX_IN_FLIGHT;
+    Mutex_Unlock(self->lock);
+    pipeline_run_frame(w,f);
+    Mutex_Lock(self->lock);
+    w->seen++;
+    if(--f->pending==0)
+      Condition_Notify_All(self->done);
+  }
+  Mutex_Unlock(self->lock);
+  return NULL;
+}
+
+/** Waits till every worker is done with frame \a i. */
+static void pipeline_wait_frame(pipeline_t self, unsigned i)
+{ const pipeline_frame_t *f=self->frames+i%PIPELINE_MAX_IN_FLIGHT;
+  Mutex_Lock(self->lock);
+  while(f->pending)
+    Condition_Wait(self->done,self->lock);
+  Mutex_Unlock(self->lock);
+}
+
+/**
+ * Waits for the workers to finish every submitted frame.  The frames
+ * aren't retired.  Call before changing anything the workers read outside
+ * of a frame.
+ */
+static void pipeline_quiesce(pipeline_t self)
+{ if(self->submitted!=self->retired) // workers take frames in order, so the last one is enough
+    pipeline_wait_frame(self,self->submitted-1);
+}
+
+static int pipeline_start_workers(pipeline_t self, unsigned n)
+{ if(!n)
+    n=Thread_Processor_Count();
+  NEW(pipeline_worker_t,self->workers,n);
+  ZERO(pipeline_worker_t,self->workers,n);
+  self->nworkers=n;
+  TRY(self->lock=Mutex_Alloc());
+  TRY(self->wake=Condition_Alloc());
+  TRY(self->done=Condition_Alloc());
+  for(unsigned i=0;i<n;++i)
+    self->workers[i].self=self;
+  for(unsigned i=0;i<n;++i)
+    TRY(self->workers[i].thread=Thread_Alloc(pipeline_worker_main,self->workers+i));
+  return 1;
+Error:
+  return 0;
+}
+
+static void pipeline_stop_workers(pipeline_t self)
+{ if(!self->workers)
+    return;
+  if(self->lock)
+  { Mutex_Lock(self->lock);
+    self->quit=1;
+    Condition_Notify_All(self->wake);
+    Mutex_Unlock(self->lock);
+  }
+  for(unsigned i=0;i<self->nworkers;++i)
+  { if(self->workers[i].thread)
+    { Thread_Join(self->workers[i].thread);
+      Thread_Free(self->workers[i].thread);
+    }
+    if(self->workers[i].row)
+      free(self->workers[i].row);
+    if(self->workers[i].out)
+      free(self->workers[i].out);
+  }
+  if(self->lock) Mutex_Free(self->lock);
+  if(self->wake) Condition_Free(self->wake);
+  if(self->done) Condition_Free(self->done);
+  free(self->workers);
+  self->workers=0;
+  self->nworkers=0;
+}
+
+//
+// --- PUBLIC INTERFACE ---
+//
+
+pipeline_t pipeline_make(const pipeline_param_t *params)
+{ pipeline_t self=NULL;
+  TRY(params);
+  NEW(pipeline_t_,self,1);
+  ZERO(pipeline_t_,self,1);
+  self->every            = (params->frame_average_count<1)?1:params->frame_average_count;
+  self->samples_per_scan = params->sample_rate_MHz*1.0e6/(double)params->scan_rate_Hz;
+  self->invert           = (params->invert_intensity!=0);
+  self->downsample       = (params->pixel_average_count<=1)?1:params->pixel_average_count;
+  self->alignment        = ALIGN_;
+  self->norm             = 1.0f/(float)self->every;
+  self->m                = 1.0f;
+  self->b                = 0.0f;
+  TRY(pipeline_select_isa(self,params->isa));
+  TRY(pipeline_start_workers(self,params->nthreads));
+  return self;
+Error:
+  pipeline_free(&self);
+  return NULL;
+}
+
+static void pipeline_free_taps(pipeline_t self)
+{ void *ptrs[]={self->taps.offset,
+                self->taps.idx,
+                self->taps.wt};
+  for(unsigned i=0;i<countof(ptrs);++i)
+    if(ptrs[i])
+      free(ptrs[i]);
+  ZERO(pipeline_taps_t,&self->taps,1);
+  self->lut_width=0;
+}
+
+void pipeline_free(pipeline_t *self)
+{ if(self && *self)
+  { pipeline_stop_workers(*self);
+    pipeline_free_taps(*self);
+    if(self[0]->tmp) free(self[0]->tmp);
+    free(*self); *self=NULL;
+  }
+}
+
+void pipeline_reset(pipeline_t self)
+{ if(!self) return;
+  pipeline_quiesce(self);
+  self->count=0;
+  if(self->tmp)
+    self->fresh=1; // workers clear their rows with the next frame
+}
+
+pipeline_isa_t pipeline_get_isa(pipeline_t self)
+{ return self?self->isa:PIPELINE_ISA_AUTO;
+}
+
+#define EPS (1e-3)
+static unsigned pipeline_get_output_width(pipeline_t self, const double inwidth)
+{ const double d=1.0-inwidth/self->samples_per_scan; // 1 - duty
+  //max derivative of the cosine warp adjusted to cos(2pi*(d/2)) is the zero point
+  //and the positive part of the warp function goes from 0 to 1.
+  const double maxslope=M_PI*(1.0-d)/inwidth/cos(M_PI*d);
+  const double amplitude=1.0/maxslope;
+  const unsigned w=self->alignment*(unsigned)(amplitude/self->downsample/self->alignment);
+  TRY(-EPS<d && d<=(0.5+EPS));
+  TRY(0<w && w<inwidth);
+  return w;
+Error:
+  return 0;
+}
+#undef EPS
+
+extern "C" int pipeline_get_output_dims(pipeline_t self, const pipeline_image_t src, unsigned *w, unsigned *h, unsigned *nchan)
+{ TRY(self && src);
+  if(nchan) *nchan=src->nchan;
+  if(h)     *h=src->h*2;
+  if(w)     TRY(*w=pipeline_get_output_width(self,src->w));
+  return 1;
+Error:
+  return 0;
+}
+
+static double f(double x) { return  0.5*(1.0-cos(2.0*M_PI*x)); }
+
+/**
+ * Same table as the CUDA backend's, left in host memory.
+ * \param[out] ilut  2*(ow+1) elements.  Interval encoded lookup.
+ * \param[out] norms 2*N+1 elements where N is inwidth padded to the alignment.
+ */
+static int pipeline_fill_lut(pipeline_t self, unsigned inwidth, unsigned *ilut, float *norms)
+{ int isok=1;
+  unsigned * __restrict__ lut=0;
+  // useful constants
+  const double        d = (1.0-inwidth/self->samples_per_scan)/2.0; // 0.5*(1 - duty)
+  const unsigned     ow = pipeline_get_output_width(self,inwidth);
+  const double        s = (1.0-2.0*d)/(double)inwidth;
+  const double        A = ow/(1.0-f(d));
+  const double      Afd = A*f(d);
+  const unsigned  halfw = inwidth/2;
+  const unsigned      N = self->alignment*CEIL(inwidth,self->alignment); // pad to aligned width
+  // alloc temporary space
+  NEW(unsigned ,lut  ,inwidth);
+  ZERO(unsigned,lut  ,inwidth);
+  ZERO(unsigned,ilut ,2*(ow+1));
+  ZERO(float   ,norms,2*N+1);
+
+  // compute lookup
+  for(unsigned i=0;i<inwidth;++i)
+  { double p0=d+s*i,
+           p1=d+s*(i+1);
+    double v0=A*f(p0)-Afd,
+           v1=A*f(p1)-Afd;
+
+    int j,k;
+    if(v0<0.0) v0=0.0;
+    if(v1<0.0) v1=0.0;
+    if(v0>v1) { double v=v0;v0=v1;v1=v; } //swap
+    j = (int) v0;
+    k = (int) v1;
+    TRY( (k-j)<2 ); // longest length should be 1, so shouldn't straddle more than two pixels
+    lut[i] = j + (i<halfw?0:ow);
+    if( (k-j)==0 )
+    { norms[i]   = (float)(v1-v0);
+      norms[i+N] = 0.0f;
+    } else { //k-j==1 -> k=1+j
+      norms[i]   = (float)(k-v0);
+      norms[i+N] = (float)(v1-k);
+    }
+  }
+
+  // interval encode lookup table on output side
+  { unsigned last=0;
+    for(unsigned i=0;i<halfw;++i)
+      if(last!=lut[i])
+        ilut[last=lut[i]]=i;
+    ilut[ow  ]=inwidth/2; // add elements to deal with discontinuity
+    ilut[ow+1]=inwidth; // subtract one to prevent reading off end
+    ilut+=2;
+    for(unsigned i=halfw;i<inwidth;++i)
+      if(last!=lut[i])
+        ilut[(last=lut[i])]=i;
+    ilut-=2;
+  }
+
+Finalize:
+  if(lut)   free(lut);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+/**
+ * The taps for output column \a c, in the order the CUDA warp_kernel reads them.
+ * \returns the number of taps.  Writes nothing if \a idx is NULL.
+ */
+static unsigned pipeline_column_taps(unsigned c, unsigned ow, unsigned inwidth, unsigned N,
+                                     const unsigned *ilut, const float *norms, int32_t *idx, float *wt, unsigned stride)
+{ const float *norms0=norms,
+              *norms1=norms+N;
+  unsigned n=0,j;
+#define PUSH(j_,w_) do{ if(idx) {idx[n*stride]=(int32_t)(j_); wt[n*stride]=(w_);} ++n; }while(0)
+  if(c<ow) // forward scan
+  { const unsigned j0=ilut[c],
+                   j1=ilut[c+1];
+    if(j0>0) PUSH(j0-1,norms1[j0-1]);
+    for(j=j0;j<j1;++j)
+      PUSH(j,norms0[j]);
+  } else   // backward scan
+  { const unsigned j1=ilut[c+1],
+                   j0=ilut[c+2];
+    for(j=j0;j<j1;++j)
+      PUSH(j,norms0[j]);
+    if(j1<inwidth) // norms1[inwidth] is zero. The CUDA kernel reads src[inwidth] anyway.
+      PUSH(j1,norms1[j1]);
+  }
+#undef PUSH
+  return n;
+}
+
+static int pipeline_make_taps(pipeline_t self, unsigned inwidth)
+{ unsigned *ilut=0;
+  float    *norms=0;
+  const unsigned ow=pipeline_get_output_width(self,inwidth),
+                  N=self->alignment*CEIL(inwidth,self->alignment);
+  pipeline_taps_t *t=&self->taps;
+  TRY(ow);
+  pipeline_free_taps(self);
+  NEW(unsigned,ilut ,2*(ow+1));
+  NEW(float   ,norms,2*N+1);
+  TRY(pipeline_fill_lut(self,inwidth,ilut,norms));
+
+  t->nblocks=2*ow/BLOCK_;
+  NEW(unsigned,t->offset,t->nblocks+1);
+  t->offset[0]=0;
+  for(unsigned b=0;b<t->nblocks;++b)
+  { unsigned n=0;
+    for(unsigned i=0;i<BLOCK_;++i)
+    { unsigned m=pipeline_column_taps(b*BLOCK_+i,ow,inwidth,N,ilut,norms,0,0,0);
+      n=(m>n)?m:n;
+    }
+    t->offset[b+1]=t->offset[b]+n;
+  }
+  NEW(int32_t,t->idx,BLOCK_*t->offset[t->nblocks]);
+  NEW(float  ,t->wt ,BLOCK_*t->offset[t->nblocks]);
+  ZERO(int32_t,t->idx,BLOCK_*t->offset[t->nblocks]); // padding reads column 0 with zero weight
+  ZERO(float  ,t->wt ,BLOCK_*t->offset[t->nblocks]);
+  for(unsigned b=0;b<t->nblocks;++b)
+    for(unsigned i=0;i<BLOCK_;++i)
+      pipeline_column_taps(b*BLOCK_+i,ow,inwidth,N,ilut,norms,
+                           t->idx+BLOCK_*t->offset[b]+i,t->wt+BLOCK_*t->offset[b]+i,BLOCK_);
+
+  for(unsigned i=0;i<self->nworkers;++i)
+  { pipeline_worker_t *w=self->workers+i;
+    if(w->row) free(w->row);
+    if(w->out) free(w->out);
+    w->out=0;
+    NEW(float,w->row,inwidth);
+    NEW(float,w->out,2*ow);
+  }
+  self->lut_width=inwidth;
+  self->ow=ow;
+  free(ilut);
+  free(norms);
+  return 1;
+Error:
+  if(ilut)  free(ilut);
+  if(norms) free(norms);
+  pipeline_free_taps(self);
+  return 0;
+}
+
+/**
+ * Reallocates the accumulator and splits rows across workers if there's a
+ * shape change.  Workers zero their own rows of a new accumulator so the
+ * pages land on their NUMA node.
+ */
+static int pipeline_alloc_tmp(pipeline_t self, const pipeline_image_t src)
+{ if(self->w==src->w && self->h==src->h*src->nchan && (self->tmp || self->every==1))
+    return 1;
+  pipeline_quiesce(self);
+  if(self->tmp)
+  { free(self->tmp);
+    self->tmp=0;
+  }
+  if(self->every>1)
+  { NEW(float,self->tmp,(size_t)2*self->ow*src->h*src->nchan);
+    self->fresh=1;
+  }
+  self->w=src->w;
+  self->h=src->h*src->nchan;
+  for(unsigned i=0;i<self->nworkers;++i) // split rows evenly
+  { self->workers[i].r0=(unsigned)(((size_t)self->h* i   )/self->nworkers);
+    self->workers[i].r1=(unsigned)(((size_t)self->h*(i+1))/self->nworkers);
+  }
+  return 1;
+Error:
+  return 0;
+}
+
+enum
+{ MODE_DIRECT,     ///< no frame averaging.  Straight to the destination.
+  MODE_ACCUMULATE, ///< add to the accumulator.  Nothing is emitted.
+  MODE_EMIT        ///< fold in and clear the accumulator, then emit.
+};
+
+/** The fused row pass.  See the notes at the top of the file. */
+template<typename Tsrc, typename Tdst, int MODE>
+static void process(pipeline_worker_t *w, const pipeline_frame_t *f)
+{ const pipeline_t self=w->self;
+  const pipeline_image_t_ *src=&f->src,
+                          *dst=&f->dst;
+  const unsigned ow=self->ow,
+                ow2=2*ow;
+  const float lo=lo_of<Tdst>(),
+              hi=hi_of<Tdst>();
+  for(unsigned r=w->r0;r<w->r1;++r)
+  { load_row<Tsrc>(w->row,((const Tsrc*)src->data)+(size_t)r*src->stride,src->w);
+    self->warp_row(&self->taps,w->out,w->row);
+    if(MODE==MODE_ACCUMULATE)
+    { add_row(self->tmp+(size_t)r*ow2,w->out,ow2);
+      continue;
+    }
+    if(MODE==MODE_EMIT)
+      fold_row(w->out,self->tmp+(size_t)r*ow2,ow2);
+    self->round_row(w->out,ow2,f->m,f->b,lo,hi);
+    { Tdst *out=((Tdst*)dst->data)+(size_t)r*2*dst->stride;
+      store_row<Tdst>(out,w->out,ow);                 // forward scan
+      store_row<Tdst>(out+dst->stride,w->out+ow,ow);  // backward scan
+    }
+  }
+}
+
+// generics
+
+/** Requires a macro \c CASE(T) to be defined where \c T is a type parameter.
+ *  Requires a macro \c FAIL to be defined that handles when an invalid \a type_id is used.
+ *  \param[in] type_id Must be a valid nd_type_id_t.
+ */
+#define TYPECASE(type_id) \
+switch(type_id) \
+{            \
+  case u8_id :CASE(uint8_t ); break; \
+  case u16_id:CASE(uint16_t); break; \
+  case u32_id:CASE(uint32_t); break; \
+  case u64_id:CASE(uint64_t); break; \
+  case i8_id :CASE(int8_t ); break; \
+  case i16_id:CASE(int16_t); break; \
+  case i32_id:CASE(int32_t); break; \
+  case i64_id:CASE(int64_t); break; \
+  case f32_id:CASE(float); break; \
+  case f64_id:CASE(double); break; \
+  default:   \
+    FAIL("Unsupported pixel type.");    \
+}
+
+/** Requires a macro \c CASE2(T1,T2) to be defined where \c T1 and \c T2 are
+ *  type parameters.
+ *  Requires a macro \c FAIL to be defined that handles when an invalid \a type_id is used.
+ *  \param[in] type_id Must be a valid nd_type_id_t.
+ *  \param[in] T       A type name.
+ */
+#define TYPECASE2(type_id,T) \
+switch(type_id) \
+{               \
+  case u8_id :CASE2(uint8_t,T); break;  \
+  case u16_id:CASE2(uint16_t,T); break; \
+  case u32_id:CASE2(uint32_t,T); break; \
+  case u64_id:CASE2(uint64_t,T); break; \
+  case i8_id :CASE2(int8_t,T); break;  \
+  case i16_id:CASE2(int16_t,T); break; \
+  case i32_id:CASE2(int32_t,T); break; \
+  case i64_id:CASE2(int64_t,T); break; \
+  case f32_id:CASE2(float,T); break; \
+  case f64_id:CASE2(double,T); break; \
+  default:      \
+    FAIL("Unsupported pixel type.");       \
+}
+
+static int isaligned(unsigned x, unsigned n) { return (x%n)==0; }
+int pipeline_submit(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src, int *emit)
+{ pipeline_frame_t *f;
+  TRY(self && emit);
+  TRY(self->submitted-self->retired<PIPELINE_MAX_IN_FLIGHT); // retire a frame first
+
+  TRY(isaligned(dst->w,ALIGN_));
+  TRY(dst->h==2*src->h);
+
+  if(src->w!=self->lut_width)
+  { pipeline_quiesce(self);
+    TRY(pipeline_make_taps(self,src->w));
+  }
+  TRY(dst->w==self->ow);
+  pipeline_image_conversion_params(dst,src,self->invert,&self->m,&self->b);
+  TRY(pipeline_alloc_tmp(self,src));
+
+  if(self->every>1) // frame averaging enabled
+  { *emit=((self->count+1)%self->every)==0;
+    self->count++;
+  } else
+    *emit=1;
+
+  f=self->frames+self->submitted%PIPELINE_MAX_IN_FLIGHT;
+  f->src=*src;
+  f->dst=*dst;
+  f->m=(self->every>1)?self->m*self->norm:self->m;
+  f->b=self->b;
+  f->fresh=self->fresh;
+  self->fresh=0;
+  if(!*emit)
+  {
+  #define CASE(T) f->job=process<T,float,MODE_ACCUMULATE>
+    { TYPECASE(src->type); }
+  #undef CASE
+  } else if(self->every>1)
+  {
+  #define CASE2(TSRC,TDST) f->job=process<TSRC,TDST,MODE_EMIT>
+  #define CASE(T)          TYPECASE2(src->type,T)
+    { TYPECASE(dst->type); }
+  #undef CASE
+  #undef CASE2
+  } else
+  {
+  #define CASE2(TSRC,TDST) f->job=process<TSRC,TDST,MODE_DIRECT>
+  #define CASE(T)          TYPECASE2(src->type,T)
+    { TYPECASE(dst->type); }
+  #undef CASE
+  #undef CASE2
+  }
+  Mutex_Lock(self->lock);
+  f->pending=self->nworkers;
+  self->submitted++;
+  Condition_Notify_All(self->wake);
+  Mutex_Unlock(self->lock);
+  return 1;
+Error:
+  return 0;
+}
+
+int pipeline_retire(pipeline_t self)
+{ TRY(self && self->retired!=self->submitted);
+  pipeline_wait_frame(self,self->retired++);
+  return 1;
+Error:
+  return 0;
+}
+
+int pipeline_exec(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src, int *emit)
+{ TRY(self && self->submitted==self->retired); // don't mix with pipeline_submit()
+  TRY(pipeline_submit(self,dst,src,emit));
+  TRY(pipeline_retire(self));
+  return 1;
+Error:
+  return 0;
+}
+
+#undef TYPECASE
+#undef TYPECASE2
@@ -1,6 +1,7 @@
 #include "pipeline.h"
 #include "pipeline-image.h"
 #include "frame.h"
+#include "chan.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -61,7 +62,7 @@ fetch::Frame_With_Interleaved_Planes* pipeline_format_frame(pipeline_image_t sel
   fetch::Frame_With_Interleaved_Planes ref(self->w,self->h,self->nchan,frametype[self->type]);
   ref.format(f);
   if(oldbytes<f->size_bytes())
-  { TRY(f=(fetch::Frame_With_Interleaved_Planes*)realloc(f,f->size_bytes()));
+  { TRY(f=(fetch::Frame_With_Interleaved_Planes*)Chan_Token_Buffer_Realloc(f,f->size_bytes()));
     ref.format(f);
   }
   return f;
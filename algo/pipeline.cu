@@ -48,6 +48,27 @@ struct pipeline_ctx_t
   unsigned w,h;         ///< source width and height (height is nrows*nchan)
 };
 
+/**
+ * Buffers for one frame in flight.
+ * Each frame in flight gets its own slot and stream, so the upload of one
+ * frame, the kernels for another and the download of a third can overlap.
+ * Kernels share the accumulator, so they are chained across streams with
+ * pipeline_t::warped and run in frame order.
+ */
+struct pipeline_slot_t
+{ void  * __restrict__ src,         ///< device buffer
+        * __restrict__ dst,         ///< device buffer
+        * __restrict__ hsrc,        ///< page-locked staging buffer for the upload
+        * __restrict__ hdst;        ///< page-locked staging buffer for the download
+  size_t       nbytes_src,
+               nbytes_dst;
+  cudaStream_t stream;
+  cudaEvent_t  ready;               ///< recorded after the download
+  void        *out;                 ///< where the output goes when the frame is retired
+  size_t       nbytes_out;
+  int          emit;
+};
+
 /**
  * The object that manages pipeline execution.
  */
@@ -62,9 +83,11 @@ typedef struct pipeline_t_
   unsigned       nbytes_tmp;
   float    norm,        ///< 1.0/the frame count as a float - set by launcher (eg. for ctx.every=4, this should be 0.25)
            m,b;         ///< slope and intercept for intensity scaling
-  void  * __restrict__ src,         ///< device buffer
-        * __restrict__ dst;         ///< device buffer
   float * __restrict__ tmp;         ///< device buffer
+  cudaEvent_t    warped;            ///< recorded after the kernels for the last submitted frame
+  pipeline_slot_t slots[PIPELINE_MAX_IN_FLIGHT];
+  unsigned       submitted,         ///< frame i uses slots[i%PIPELINE_MAX_IN_FLIGHT]
+                 retired;
 } *pipeline_t;
 
 //
@@ -160,20 +183,57 @@ Error:
   return NULL;
 }
 
+static void pipeline_free_slot(pipeline_slot_t *s)
+{ if(s->stream) CUWARN(cudaStreamSynchronize(s->stream));
+  if(s->src)    CUWARN(cudaFree(s->src));
+  if(s->dst)    CUWARN(cudaFree(s->dst));
+  if(s->hsrc)   CUWARN(cudaFreeHost(s->hsrc));
+  if(s->hdst)   CUWARN(cudaFreeHost(s->hdst));
+  if(s->ready)  CUWARN(cudaEventDestroy(s->ready));
+  if(s->stream) CUWARN(cudaStreamDestroy(s->stream));
+  ZERO(pipeline_slot_t,s,1);
+}
+
 void pipeline_free(pipeline_t *self)
 { if(self && *self)
   { void *ptrs[]={self[0]->ctx.ilut,
                   self[0]->ctx.lut_norms0,
-                  self[0]->src,
-                  self[0]->dst,
                   self[0]->tmp};
+    for(int i=0;i<countof(self[0]->slots);++i)
+      pipeline_free_slot(self[0]->slots+i);
     for(int i=0;i<countof(ptrs);++i)
       if(ptrs[i])
         CUWARN(cudaFree(ptrs[i]));
+    if(self[0]->warped)
+      CUWARN(cudaEventDestroy(self[0]->warped));
     free(*self); *self=NULL;
   }
 }
 
+/**
+ * Clears the accumulator in line with the kernels: the clear waits on
+ * pipeline_t::warped and is recorded as the new warped, so the next frame's
+ * kernels wait for it.  It goes on the stream of the slot the next frame
+ * will use, so it doesn't rely on the default stream's implicit sync.
+ */
+void pipeline_reset(pipeline_t self)
+{ cudaStream_t stream;
+  if(!self) return;
+  self->count=0;
+  if(!self->tmp)
+    return;
+  stream=self->slots[self->submitted%PIPELINE_MAX_IN_FLIGHT].stream; // 0 before the slot's first frame
+  if(self->warped)
+    CUWARN(cudaStreamWaitEvent(stream,self->warped,0));
+  CUWARN(cudaMemsetAsync(self->tmp,0,self->nbytes_tmp,stream));
+  if(self->warped)
+    CUWARN(cudaEventRecord(self->warped,stream));
+}
+
+pipeline_isa_t pipeline_get_isa(pipeline_t self)
+{ return PIPELINE_ISA_AUTO; // not a CPU backend
+}
+
 #define EPS (1e-3)
 static unsigned pipeline_get_output_width(pipeline_t self, const double inwidth)
 { const double d=1.0-inwidth/self->samples_per_scan; // 1 - duty
@@ -306,21 +366,58 @@ Error:
   goto Finalize;
 }
 
-static int pipeline_upload(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src)
-{ if(self->src && (self->ctx.w!=src->w || self->ctx.h!=src->h*src->nchan)) // if there's a shape change, realloc
-  { CUTRY(cudaFree(self->src)); self->src=0;
-    CUTRY(cudaFree(self->dst)); self->dst=0;
-    CUTRY(cudaFree(self->tmp)); self->tmp=0;
+/**
+ * Reallocates the accumulator if there's a shape change.
+ * Operations on the default stream wait for work in the other streams, so
+ * the kernels still in flight are done with the old one.
+ */
+static int pipeline_alloc_tmp(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src)
+{ if(self->tmp && (self->ctx.w!=src->w || self->ctx.h!=src->h*src->nchan))
+  { CUTRY(cudaFree(self->tmp)); self->tmp=0;
   }
-  dst->h++; // pad by a line
-  if(!self->src)
-  { CUTRY(cudaMalloc((void**)&self->src,pipeline_image_nbytes(src)+1024));
-    CUTRY(cudaMalloc((void**)&self->dst,pipeline_image_nbytes(dst)));
-    CUTRY(cudaMalloc((void**)&self->tmp,self->nbytes_tmp=pipeline_image_nelem(dst)*sizeof(float)));
-    CUTRY(cudaMemset(self->tmp,0,pipeline_image_nelem(dst)*sizeof(float)));
+  if(!self->tmp)
+  { dst->h++; // pad by a line
+    self->nbytes_tmp=pipeline_image_nelem(dst)*sizeof(float);
+    dst->h--; // restore original number of lines
+    CUTRY(cudaMalloc((void**)&self->tmp,self->nbytes_tmp));
+    CUTRY(cudaMemset(self->tmp,0,self->nbytes_tmp));
   }
-  CUTRY(cudaMemcpy(self->src,src->data,pipeline_image_nbytes(src),cudaMemcpyHostToDevice));
+  if(!self->warped)
+    CUTRY(cudaEventCreateWithFlags(&self->warped,cudaEventDisableTiming));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Reallocates a free slot's buffers if the frame size changed. */
+static int pipeline_alloc_slot(pipeline_slot_t *s, pipeline_image_t dst, const pipeline_image_t src)
+{ size_t nsrc,ndst;
+  nsrc=pipeline_image_nbytes(src);
+  dst->h++; // pad by a line
+  ndst=pipeline_image_nbytes(dst);
   dst->h--; // restore original number of lines
+  if(s->stream && s->nbytes_src==nsrc && s->nbytes_dst==ndst)
+    return 1;
+  pipeline_free_slot(s);
+  CUTRY(cudaMalloc((void**)&s->src,nsrc+1024));
+  CUTRY(cudaMalloc((void**)&s->dst,ndst));
+  CUTRY(cudaMallocHost((void**)&s->hsrc,nsrc));
+  CUTRY(cudaMallocHost((void**)&s->hdst,ndst));
+  CUTRY(cudaStreamCreate(&s->stream));
+  CUTRY(cudaEventCreateWithFlags(&s->ready,cudaEventDisableTiming));
+  s->nbytes_src=nsrc;
+  s->nbytes_dst=ndst;
+  return 1;
+Error:
+  pipeline_free_slot(s);
+  return 0;
+}
+
+/** Stages the source through page-locked memory so the copy runs asynchronously. */
+static int pipeline_upload(pipeline_t self, pipeline_slot_t *s, pipeline_image_t dst, const pipeline_image_t src)
+{ const size_t n=pipeline_image_nbytes(src);
+  memcpy(s->hsrc,src->data,n);
+  CUTRY(cudaMemcpyAsync(s->src,s->hsrc,n,cudaMemcpyHostToDevice,s->stream));
   self->ctx.w=src->w;
   self->ctx.h=src->h*src->nchan;
   self->ctx.istride=src->stride;
@@ -330,41 +427,29 @@ Error:
   return 0;
 }
 
-static int pipeline_download(pipeline_t self, pipeline_image_t dst)
-{ TRY(self->dst);
-  CUTRY(cudaMemcpy(dst->data,self->dst,pipeline_image_nbytes(dst),cudaMemcpyDeviceToHost));
+static int pipeline_download(pipeline_slot_t *s, pipeline_image_t dst)
+{ s->out=dst->data;
+  s->nbytes_out=pipeline_image_nbytes(dst);
+  CUTRY(cudaMemcpyAsync(s->hdst,s->dst,s->nbytes_out,cudaMemcpyDeviceToHost,s->stream));
   return 1;
 Error:
   return 0;
 }
 
-
 template<typename Tsrc, typename Tdst,unsigned BX,unsigned BY,unsigned WORK>
-static int launch(pipeline_t self, int *emit)
+static int launch(pipeline_t self, pipeline_slot_t *s)
 { unsigned ow=pipeline_get_output_width(self,self->ctx.w);
   dim3 threads(BX,BY),
        blocks(CEIL(2*ow,BX*WORK),CEIL(self->ctx.h,BY));      // for the cast from tmp to dst
-  TRY(emit);
-#if 1
-  if(self->every>1) // frame averaging enabled
-  { if( ((self->count+1)%self->every)==0 )
-    { *emit=1;
-      warp_kernel<Tsrc,BX,BY,WORK><<<blocks,threads>>>(self->ctx,(Tsrc*)self->src,self->tmp);
-      cast_kernel<Tdst,BX,BY,WORK><<<blocks,threads>>>((Tdst*)self->dst,self->tmp,self->ctx.ostride*2,self->m*self->norm,self->b);
-    } else
-    { *emit=0;
-      warp_kernel<Tsrc,BX,BY,WORK><<<blocks,threads>>>(self->ctx,(Tsrc*)self->src,self->tmp);
-    }
-    self->count++;
-  } else            // frame averaging disabled
-#endif
-  { if(emit) *emit=1;
-    warp_kernel<Tsrc,BX,BY,WORK><<<blocks,threads>>>(self->ctx,(Tsrc*)self->src,self->tmp);
-    cast_kernel<Tdst,BX,BY,WORK><<<blocks,threads>>>((Tdst*)self->dst,self->tmp,self->ctx.ostride*2,self->m,self->b);
-    CUTRY(cudaGetLastError());
+  const float m=(self->every>1)?self->m*self->norm:self->m;
+  CUTRY(cudaStreamWaitEvent(s->stream,self->warped,0));      // the previous frame's kernels
+  warp_kernel<Tsrc,BX,BY,WORK><<<blocks,threads,0,s->stream>>>(self->ctx,(Tsrc*)s->src,self->tmp);
+  if(s->emit)
+  { cast_kernel<Tdst,BX,BY,WORK><<<blocks,threads,0,s->stream>>>((Tdst*)s->dst,self->tmp,self->ctx.ostride*2,m,self->b);
+    CUTRY(cudaMemsetAsync(self->tmp,0,self->nbytes_tmp,s->stream));
   }
-  if(*emit)
-    CUTRY(cudaMemset(self->tmp,0,self->nbytes_tmp));
+  CUTRY(cudaGetLastError());
+  CUTRY(cudaEventRecord(self->warped,s->stream));
   return 1;
 Error:
   return 0;
@@ -418,8 +503,10 @@ switch(type_id) \
 }
 
 int isaligned(unsigned x, unsigned n) { return (x%n)==0; }
-int pipeline_exec(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src, int *emit)
-{ TRY(emit);
+int pipeline_submit(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src, int *emit)
+{ pipeline_slot_t *s;
+  TRY(self && emit);
+  TRY(self->submitted-self->retired<PIPELINE_MAX_IN_FLIGHT); // retire a frame first
 
   TRY(isaligned(src->w,BX_));
   TRY(isaligned(src->h,BY_));
@@ -436,15 +523,49 @@ int pipeline_exec(pipeline_t self, pipeline_image_t dst, const pipeline_image_t
     TRY(pipeline_fill_lut(self,src->w));
   }
   pipeline_image_conversion_params(dst,src,self->invert,&self->m,&self->b);
-  TRY(pipeline_upload(self,dst,src)); // updates context size and stride as well
+  TRY(pipeline_alloc_tmp(self,dst,src));
+  s=self->slots+self->submitted%PIPELINE_MAX_IN_FLIGHT;
+  TRY(pipeline_alloc_slot(s,dst,src));
+
+  if(self->every>1) // frame averaging enabled
+  { *emit=((self->count+1)%self->every)==0;
+    self->count++;
+  } else
+    *emit=1;
+  s->emit=*emit;
+
+  TRY(pipeline_upload(self,s,dst,src)); // updates context size and stride as well
 // launch kernel
-  #define CASE2(TSRC,TDST) launch<TSRC,TDST,BX_,BY_,WORK_>(self,emit)
+  #define CASE2(TSRC,TDST) TRY((launch<TSRC,TDST,BX_,BY_,WORK_>(self,s)))
   #define CASE(T)          TYPECASE2(src->type,T)
     { TYPECASE(dst->type); }
   #undef CASE
   #undef CASE2
   if(*emit)
-    TRY(pipeline_download(self,dst));
+    TRY(pipeline_download(s,dst));
+  CUTRY(cudaEventRecord(s->ready,s->stream));
+  self->submitted++;
+  return 1;
+Error:
+  return 0;
+}
+
+int pipeline_retire(pipeline_t self)
+{ pipeline_slot_t *s;
+  TRY(self && self->retired!=self->submitted);
+  s=self->slots+self->retired++%PIPELINE_MAX_IN_FLIGHT;
+  CUTRY(cudaEventSynchronize(s->ready));
+  if(s->emit)
+    memcpy(s->out,s->hdst,s->nbytes_out);
+  return 1;
+Error:
+  return 0;
+}
+
+int pipeline_exec(pipeline_t self, pipeline_image_t dst, const pipeline_image_t src, int *emit)
+{ TRY(self && self->submitted==self->retired); // don't mix with pipeline_submit()
+  TRY(pipeline_submit(self,dst,src,emit));
+  TRY(pipeline_retire(self));
   return 1;
 Error:
   return 0;
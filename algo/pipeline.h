@@ -6,21 +6,49 @@ extern "C" {
 typedef struct pipeline_t_       *pipeline_t;
 typedef struct pipeline_image_t_ *pipeline_image_t;
 
+#define PIPELINE_MAX_IN_FLIGHT (3) ///< the most frames pipeline_submit() will queue
+
+/** Instruction sets for the CPU backend (pipeline-cpu.cpp).  The CUDA
+    backend (pipeline.cu) ignores this.  Link one backend or the other.
+*/
+typedef enum pipeline_isa_t_
+{ PIPELINE_ISA_AUTO=0,   ///< the best one the processor supports
+  PIPELINE_ISA_SCALAR,
+  PIPELINE_ISA_AVX2,
+  PIPELINE_ISA_AVX512
+} pipeline_isa_t;
+
 typedef struct pipeline_param_t_
 { unsigned frame_average_count;
   unsigned pixel_average_count;
   unsigned invert_intensity;
   unsigned scan_rate_Hz,
            sample_rate_MHz;
+  pipeline_isa_t isa;    ///< CPU backend only.  Falls back to the best available if the processor doesn't support it.
+  unsigned nthreads;     ///< CPU backend only.  Rows are split across this many threads.  0 uses one per processor.
 } pipeline_param_t;
 
 pipeline_t pipeline_make           (const pipeline_param_t *params);
 void       pipeline_free           (pipeline_t *ctx);
+void       pipeline_reset          (pipeline_t ctx); // drops any partial frame average.  Keeps the lookup tables and buffers.
+pipeline_isa_t pipeline_get_isa    (pipeline_t ctx); // the kernels in use.  PIPELINE_ISA_AUTO for the CUDA backend.
 int        pipeline_get_output_dims(pipeline_t ctx,
                                     const pipeline_image_t src,
                                     unsigned *w, unsigned *h, unsigned *nchan);
 int        pipeline_exec           (pipeline_t ctx, pipeline_image_t dst, const pipeline_image_t src, int *emit);
 
+/** Asynchronous execution.
+    pipeline_submit() queues a frame and returns.  \a emit is set right away.
+    Frames finish in order.  pipeline_retire() waits for the oldest queued
+    frame; once it returns, that frame's \a dst holds the output (if it
+    emits) and its \a src buffer may be reused.  Up to
+    PIPELINE_MAX_IN_FLIGHT frames may be queued.  The image descriptors are
+    copied, but the pixel buffers must stay put till the frame is retired.
+    pipeline_exec() is a submit and a retire.  Don't call it with frames in flight.
+*/
+int        pipeline_submit         (pipeline_t ctx, pipeline_image_t dst, const pipeline_image_t src, int *emit);
+int        pipeline_retire         (pipeline_t ctx);
+
 pipeline_image_t pipeline_make_empty_image();
 pipeline_image_t pipeline_make_dst_image(pipeline_image_t dst, const pipeline_t ctx, const pipeline_image_t src); // maybe allocs the pipeline_image_t struct, does not allocate the buffer for intensity data.
 void             pipeline_free_image      (pipeline_image_t *self);
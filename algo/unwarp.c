@@ -1,10 +1,13 @@
 #pragma warning(disable:4244) // conversion, possible loss of data
 
 #include "unwarp.h"
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include "config.h"
+#include "thread.h"
 
 #define ASRT(expr) \
   if(!(expr))                                    \
@@ -32,16 +35,27 @@ void mx(float *arg, float v)
 { *arg = (v>*arg)?v:*arg; 
 }
 
-static
-size_t bytesof(const Array *a)
-{ static const int Bpp[] = {1,2,3,4,1,2,3,4,4,8};
-  return a->size*Bpp[a->type];
-}
-
 static int nearest(float x) 
 { return floorf(x+0.5f); //round 
 }
 
+/** Bytes per pixel.  0 for an unknown type. */
+static size_t pixel_bytes(Value_Type type)
+{ switch(type)
+  { case   UINT8_TYPE: return sizeof(uint8 );
+    case  UINT16_TYPE: return sizeof(uint16);
+    case  UINT32_TYPE: return sizeof(uint32);
+    case  UINT64_TYPE: return sizeof(uint64);
+    case    INT8_TYPE: return sizeof(int8  );
+    case   INT16_TYPE: return sizeof(int16 );
+    case   INT32_TYPE: return sizeof(int32 );
+    case   INT64_TYPE: return sizeof(int64 );
+    case FLOAT32_TYPE: return sizeof(float );
+    case FLOAT64_TYPE: return sizeof(double);
+  }
+  return 0;
+}
+
 int compute_map(float *xs, int w, float duty)
 {
   int wout;
@@ -92,71 +106,243 @@ void unwarp_get_dims_ip(Dimn_Type *dims, float duty)
 }
 
 
-#define UNWARPLOOP(Tin,Tout) \
-    for(iz=0;iz<in->dims[2];++iz)                                      \
-    { Tin  *iplane = ((Tin*)  in->data) + countof_plane_in *iz;        \
-      Tout *oplane = ((Tout*)out->data) + countof_plane_out*iz;        \
-      for(iy=0;iy<in->dims[1];++iy)                                    \
-      { Tin  *irow = iplane + countof_row_in *iy;                      \
-        Tout *orow = oplane + countof_row_out*iy;                      \
-        for(i=0;i<w;++i)                                               \
-        { int j = nearest(xs[i]);                                      \
-          orow[j] += irow[i]/norm[j]; /*norm here to avoid overflows*/ \
-        }                                                              \
-      }                                                                \
-    }
+/*
+ * Tables
+ *
+ * map() is monotonic, so each output column j is the average of a
+ * contiguous run of input columns: [start[j],end[j]).  The runs
+ * only depend on the input width and the duty, so they're computed once and
+ * kept in a small cache.  Tables in use are reference counted; when every
+ * cache slot is busy, a private table is built and freed after use.
+ */
 
-#define UNWARP_LOOPS(Tout) \
-  switch(in->type)                                           \
-  {                                                          \
-    case   UINT8_TYPE: UNWARPLOOP(uint8  ,Tout);break;       \
-    case  UINT16_TYPE: UNWARPLOOP(uint16 ,Tout);break;       \
-    case  UINT32_TYPE: UNWARPLOOP(uint32 ,Tout);break;       \
-    case  UINT64_TYPE: UNWARPLOOP(uint64 ,Tout);break;       \
-    case    INT8_TYPE: UNWARPLOOP(int8   ,Tout);break;       \
-    case   INT16_TYPE: UNWARPLOOP(int16  ,Tout);break;       \
-    case   INT32_TYPE: UNWARPLOOP(int32  ,Tout);break;       \
-    case   INT64_TYPE: UNWARPLOOP(int64  ,Tout);break;       \
-    case FLOAT32_TYPE: UNWARPLOOP(float  ,Tout);break;       \
-    case FLOAT64_TYPE: UNWARPLOOP(double ,Tout);break;       \
-    default:                                                 \
-      return 0;                                              \
-  }
+typedef struct _unwarp_table
+{ int    w,wout;
+  float  duty;
+  int   *start,    // wout elements
+        *end;      // wout elements.  Same as start for columns no input lands on.
+  double*rnorm;    // wout elements.  1/(end-start).
+  int    refs;
+  int    cached;
+} unwarp_table_t;
 
+#define UNWARP_CACHE_SIZE (4)
+static Mutex          g_tables_lock = MUTEX_INITIALIZER;
+static unwarp_table_t g_tables[UNWARP_CACHE_SIZE]; // start==NULL is an empty slot
+static unsigned       g_tables_next = 0;           // where eviction starts looking
 
-int unwarp_cpu(Array* out, Array* in, float duty)
-{ float *xs,*norm;
-  int w = in->dims[0];
-  memset(out->data,0,bytesof(out));
-  ASRT( xs=(float*)malloc(2*sizeof(float)*w) ); // alloc for xs and norm
-  norm = xs + w;
-  compute_map(xs,w,duty);
-  compute_norm(norm,xs,w);
-  { Dimn_Type iy,iz,i;
-    size_t countof_plane_in  =  in->dims[0]* in->dims[1],
-           countof_row_in    =  in->dims[0],
-           countof_plane_out = out->dims[0]*out->dims[1],
-           countof_row_out   = out->dims[0];
-    switch(out->type)
-    { 
-      case   UINT8_TYPE: UNWARP_LOOPS(uint8);  break;
-      case  UINT16_TYPE: UNWARP_LOOPS(uint16); break;
-      case  UINT32_TYPE: UNWARP_LOOPS(uint32); break;
-      case  UINT64_TYPE: UNWARP_LOOPS(uint64); break;
-      case    INT8_TYPE: UNWARP_LOOPS(int8);   break;
-      case   INT16_TYPE: UNWARP_LOOPS(int16);  break;
-      case   INT32_TYPE: UNWARP_LOOPS(int32);  break;
-      case   INT64_TYPE: UNWARP_LOOPS(int64);  break;
-      case FLOAT32_TYPE: UNWARP_LOOPS(float);  break;
-      case FLOAT64_TYPE: UNWARP_LOOPS(double); break;
-      default:
-        return 0;
-    }  
-  }
-        
+static void table_clear(unwarp_table_t *t)
+{ if(t->start) free(t->start);
+  if(t->end)   free(t->end);
+  if(t->rnorm) free(t->rnorm);
+  t->start=t->end=0;
+  t->rnorm=0;
+}
+
+static int table_fill(unwarp_table_t *t, int w, float duty)
+{ float *xs=0;
+  int i,j;
+  ASRT( xs=(float*)malloc(sizeof(float)*w) );
+  t->w    = w;
+  t->duty = duty;
+  t->wout = compute_map(xs,w,duty);
+  ASRT( t->start=(int*)   calloc(t->wout,sizeof(int)) );
+  ASRT( t->end  =(int*)   calloc(t->wout,sizeof(int)) );
+  ASRT( t->rnorm=(double*)calloc(t->wout,sizeof(double)) );
+  for(i=0;i<w;++i)
+  { j = nearest(xs[i]);
+    if(j==t->wout) j=t->wout-1; // xs[i] can round up to wout-0.5
+    ASRT( 0<=j && j<t->wout );
+    if(t->start[j]==t->end[j])
+      t->start[j]=t->end[j]=i;
+    ASRT( t->end[j]==i ); // runs are contiguous
+    t->end[j]++;
+  }
+  for(j=0;j<t->wout;++j)
+    if(t->end[j]>t->start[j])
+      t->rnorm[j]=1.0/(t->end[j]-t->start[j]);
   free(xs);
   return 1;
 Error:
+  if(xs) free(xs);
+  table_clear(t);
   return 0;
 }
 
+static unwarp_table_t* table_acquire(int w, float duty)
+{ unwarp_table_t *t=0;
+  unsigned i;
+  Mutex_Lock(&g_tables_lock);
+  for(i=0;i<UNWARP_CACHE_SIZE;++i)
+    if(g_tables[i].start && g_tables[i].w==w && g_tables[i].duty==duty)
+    { t=g_tables+i;
+      break;
+    }
+  if(!t)
+  { for(i=0;i<UNWARP_CACHE_SIZE;++i)
+    { unwarp_table_t *c = g_tables+(g_tables_next+i)%UNWARP_CACHE_SIZE;
+      if(!c->refs)
+      { t=c;
+        g_tables_next=(unsigned)(c-g_tables+1)%UNWARP_CACHE_SIZE;
+        break;
+      }
+    }
+    if(t)
+    { table_clear(t);
+      t->cached=1;
+    } else
+      t=(unwarp_table_t*)calloc(1,sizeof(*t));
+    if(t && !table_fill(t,w,duty))
+    { if(!t->cached) free(t);
+      t=0;
+    }
+  }
+  if(t)
+    t->refs++;
+  Mutex_Unlock(&g_tables_lock);
+  return t;
+}
+
+static void table_release(unwarp_table_t *t)
+{ Mutex_Lock(&g_tables_lock);
+  if(--t->refs==0 && !t->cached)
+  { table_clear(t);
+    free(t);
+  }
+  Mutex_Unlock(&g_tables_lock);
+}
+
+/*
+ * Rows
+ *
+ * Inputs for an output column are contiguous, so a run's sum is the
+ * difference of two entries in the row's prefix sum.  That needs no gather,
+ * scatter or per-run branching.  Integer rows are summed in 64-bit integers,
+ * so the sums are exact; floating point rows in double.  Rows are split
+ * across threads.
+ */
+
+typedef struct _unwarp_job
+{ const unwarp_table_t *t;
+  Array  *out, *in;
+  size_t  r0,r1;   // rows [r0,r1)
+  void   *prefix;  // w+1 elements, 64 bits each
+  double *acc;     // wout elements
+  Thread *thread;
+  int     ok;
+} unwarp_job_t;
+
+#define PREFIX(T,TSUM) \
+  { const T *irow = ((const T*)job->in->data) + r*t->w; \
+    TSUM *p = (TSUM*)job->prefix, s = 0;                 \
+    p[0] = 0;                                            \
+    for(i=0;i<t->w;++i)                                  \
+      p[i+1] = (s += irow[i]);                           \
+    for(j=0;j<t->wout;++j)                               \
+      acc[j] = (double)(p[t->end[j]]-p[t->start[j]])*t->rnorm[j]; \
+  }
+#define PREFIX_I(T) PREFIX(T,int64)
+#define PREFIX_U(T) PREFIX(T,uint64)
+#define PREFIX_F(T) PREFIX(T,double)
+
+#define STOREROW(T) \
+  { T *orow = ((T*)job->out->data) + r*t->wout;          \
+    for(j=0;j<t->wout;++j)                               \
+      orow[j] = (T)acc[j];                               \
+  }
+
+#define TYPECASE(type,CASE_I,CASE_U,CASE_F) \
+  switch(type)                          \
+  { case   UINT8_TYPE: CASE_I(uint8 ); break; \
+    case  UINT16_TYPE: CASE_I(uint16); break; \
+    case  UINT32_TYPE: CASE_I(uint32); break; \
+    case  UINT64_TYPE: CASE_U(uint64); break; \
+    case    INT8_TYPE: CASE_I(int8  ); break; \
+    case   INT16_TYPE: CASE_I(int16 ); break; \
+    case   INT32_TYPE: CASE_I(int32 ); break; \
+    case   INT64_TYPE: CASE_I(int64 ); break; \
+    case FLOAT32_TYPE: CASE_F(float ); break; \
+    case FLOAT64_TYPE: CASE_F(double); break; \
+    default: goto Error;                      \
+  }
+
+static void* unwarp_rows(void *arg)
+{ unwarp_job_t *job = (unwarp_job_t*)arg;
+  const unwarp_table_t *t = job->t;
+  double * const acc = job->acc;
+  size_t r;
+  int i,j;
+  for(r=job->r0;r<job->r1;++r)
+  { TYPECASE(job->in->type,PREFIX_I,PREFIX_U,PREFIX_F);
+    TYPECASE(job->out->type,STOREROW,STOREROW,STOREROW);
+  }
+  job->ok=1;
+  return job;
+Error:
+  job->ok=0;
+  return job;
+}
+
+#undef PREFIX
+#undef PREFIX_I
+#undef PREFIX_U
+#undef PREFIX_F
+#undef STOREROW
+#undef TYPECASE
+
+/**
+ * Unwarps every row of \a in into \a out.
+ * Output rows are \c unwarp_get_dims() wide.  Every output pixel is
+ * overwritten.  \a out may be \a in if its pixels are no bigger than the
+ * input's; that runs on one thread, since each row is read before the
+ * output rows that overlap it are written.
+ */
+int unwarp_cpu(Array* out, Array* in, float duty)
+{ unwarp_table_t *t=0;
+  unwarp_job_t   *jobs=0;
+  unsigned i,n=0;
+  size_t nrows;
+  int ok=1;
+  ASRT( t=table_acquire(in->dims[0],duty) );
+  ASRT( out->dims[0]==t->wout );
+  nrows = in->size/in->dims[0];
+  ASRT( out->size>=nrows*t->wout );
+  if(out->data==in->data)
+  { ASRT( pixel_bytes(out->type) && pixel_bytes(out->type)<=pixel_bytes(in->type) );
+    n=1;
+  } else
+  { n=Thread_Processor_Count();
+    if(n>nrows/16) n=(unsigned)(nrows/16);
+    if(n<1) n=1;
+  }
+  ASRT( jobs=(unwarp_job_t*)calloc(n,sizeof(*jobs)) );
+  for(i=0;i<n;++i)
+  { jobs[i].t   = t;
+    jobs[i].in  = in;
+    jobs[i].out = out;
+    jobs[i].r0  = (nrows* i   )/n;
+    jobs[i].r1  = (nrows*(i+1))/n;
+    ASRT( jobs[i].acc=(double*)malloc(sizeof(double)*(t->w+1+t->wout)) );
+    jobs[i].prefix = jobs[i].acc+t->wout;
+  }
+  for(i=1;i<n;++i)
+    ASRT( jobs[i].thread=Thread_Alloc(unwarp_rows,jobs+i) );
+  unwarp_rows(jobs);       // the caller does the first block
+Finalize:
+  if(jobs)
+  { for(i=0;i<n;++i)
+    { if(jobs[i].thread)
+      { Thread_Join(jobs[i].thread);
+        Thread_Free(jobs[i].thread);
+      }
+      ok &= jobs[i].ok;
+      if(jobs[i].acc) free(jobs[i].acc);
+    }
+    free(jobs);
+  }
+  if(t) table_release(t);
+  return ok;
+Error:
+  ok=0;
+  goto Finalize;
+}
@@ -70,15 +70,25 @@ extern "C" void compute_norm(float *norm, float *xs, int w);
 }
 
 ///// Utils
-//static
-//size_t bytesof(const Array *a)
-//{ static const int Bpp[] = {1,2,3,4,1,2,3,4,4,8};
-//  return a->size*Bpp[a->type];
-//}
+static
+size_t bytesof_pixel(const Array *a)
+{ switch(a->type)
+  { case   UINT8_TYPE: return sizeof(uint8 );
+    case  UINT16_TYPE: return sizeof(uint16);
+    case  UINT32_TYPE: return sizeof(uint32);
+    case  UINT64_TYPE: return sizeof(uint64);
+    case    INT8_TYPE: return sizeof(int8  );
+    case   INT16_TYPE: return sizeof(int16 );
+    case   INT32_TYPE: return sizeof(int32 );
+    case   INT64_TYPE: return sizeof(int64 );
+    case FLOAT32_TYPE: return sizeof(float );
+    case FLOAT64_TYPE: return sizeof(double);
+  }
+  return 0;
+}
 static
 size_t bytesof_row(const Array *a)
-{ static const int Bpp[] = {1,2,3,4,1,2,3,4,4,8};
-  return a->dims[0]*Bpp[a->type];
+{ return a->dims[0]*bytesof_pixel(a);
 }
 
 ///// row-wise lut kernel
@@ -108,6 +118,7 @@ __global__ void rowwise_lut_kernel(
 
   for(uint i=0;i<width_in;++i)
   { uint j = nearest(lut[i]);
+    if(j>=width_out) j=width_out-1; // the map can round up to width_out
     rout[j] += rin[i]/norm[j];
   }
 }
@@ -0,0 +1,355 @@
+/** \file
+    Throughput and latency benchmark for the \ref Chan queue layer.
+
+    Only depends on chan.c, fifo.c and thread.c, so it builds anywhere those
+    do.  On Linux, from the repository root (config.h comes from the build
+    directory):
+    \code
+    cc -O2 -I. -I<build> apps/chanbench.c chan.c fifo.c thread.c -lpthread -o chanbench
+    \endcode
+
+    Every message carries the time it was pushed in its first 8 bytes.
+    Consumers use that to compute the handoff latency.  For the zero-copy
+    modes the payload is never touched, so GB/s is the rate at which
+    buffers of that size change hands.  For the copy mode it's a real
+    memcpy rate.
+
+    Usage:
+    \verbatim
+    chanbench [-n <messages>] [-p <max producers>] [-c <max consumers>] [-q <queue length>]
+    \endverbatim
+
+    Modes:
+    \verbatim
+    next    Chan_Next() on both ends.
+    copy    Chan_Next_Copy() on both ends.
+    try     Chan_Next_Try() on both ends, spinning with Thread_Yield().
+    peek    Chan_Next() plus one thread hammering Chan_Peek_Try().
+    expand  Expand-on-full.  Producers finish before the consumers start.
+    bcast   Broadcast.  Every consumer gets every message via Chan_Next_Borrow().
+            msgs counts deliveries, i.e. messages times consumers.
+    batch   Chan_Next_N() on both ends, up to BATCH messages per call.
+    \endverbatim
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "thread.h"
+#include "chan.h"
+
+#define countof(e) (sizeof(e)/sizeof(*(e)))
+
+#define TRY(e) do{if(!(e)){fprintf(stderr,"%s(%d): Expression evaluated as false."ENDL"\t%s"ENDL,__FILE__,__LINE__,#e); goto Error;}}while(0)
+
+typedef enum _mode
+{ MODE_NEXT=0,
+  MODE_COPY,
+  MODE_TRY,
+  MODE_PEEK,
+  MODE_EXPAND,
+  MODE_BCAST,
+  MODE_BATCH,
+  MODE_MAX
+} bench_mode_t;
+
+static const char *mode_names[] = {"next","copy","try","peek","expand","bcast","batch"};
+
+#define BATCH 8                // messages per Chan_Next_N() in the batch mode
+
+static const size_t sizes[] = // 16 bytes is an agent request, 8 MB is a big frame
+{ 16, 256, 4<<10, 64<<10, 1<<20, 8<<20 };
+
+typedef struct _bench
+{ bench_mode_t    mode;
+  size_t          nbytes;
+  size_t          nmessages;   // total across all producers
+  Chan           *q;
+  volatile size_t nreceived;   // used by the try mode to know when to stop
+  volatile size_t done;        // tells the peeker to stop
+  volatile size_t npeeks;
+} bench_t;
+
+typedef struct _worker
+{ bench_t *b;
+  Chan    *q;                  // opened reader or writer
+  size_t   n;                  // producer: messages to send
+  double  *latency;            // consumer: one entry per message received
+  size_t   nlatency;
+} worker_t;
+
+static void stamp(void *buf)
+{ double t = Clock_Seconds();
+  memcpy(buf,&t,sizeof(t));
+}
+
+static double age(void *buf)
+{ double t;
+  memcpy(&t,buf,sizeof(t));
+  return Clock_Seconds()-t;
+}
+
+static void* batch_producer(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  void     *bufs[BATCH] = {0};
+  size_t    i, j, n, k, moved;
+  for(j=0;j<BATCH;++j)
+    TRY(bufs[j] = Chan_Token_Buffer_Alloc(w->q));
+  for(i=0;i<w->n;i+=n)
+  { n = (w->n-i<BATCH)?(w->n-i):BATCH;
+    for(j=0;j<n;++j)
+      stamp(bufs[j]);
+    for(k=0;k<n;k+=moved)
+      TRY(CHAN_SUCCESS(Chan_Next_N(w->q,bufs+k,n-k,b->nbytes,&moved)));
+  }
+Finalize:
+  Chan_Close(w->q);
+  for(j=0;j<BATCH;++j)
+    Chan_Token_Buffer_Free(bufs[j]);
+  return NULL;
+Error:
+  goto Finalize;
+}
+
+static void* batch_consumer(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  void     *bufs[BATCH] = {0};
+  size_t    j, moved;
+  for(j=0;j<BATCH;++j)
+    TRY(bufs[j] = Chan_Token_Buffer_Alloc(w->q));
+  while(CHAN_SUCCESS(Chan_Next_N(w->q,bufs,BATCH,b->nbytes,&moved)))
+    for(j=0;j<moved;++j)
+      w->latency[w->nlatency++] = age(bufs[j]);
+Finalize:
+  Chan_Close(w->q);
+  for(j=0;j<BATCH;++j)
+    Chan_Token_Buffer_Free(bufs[j]);
+  return NULL;
+Error:
+  goto Finalize;
+}
+
+static void* producer(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  void     *buf;
+  size_t    i;
+  if(b->mode==MODE_BATCH)
+    return batch_producer(arg);
+  buf = Chan_Token_Buffer_Alloc(w->q);
+  for(i=0;i<w->n;++i)
+  { stamp(buf);
+    switch(b->mode)
+    { case MODE_COPY:
+        TRY(CHAN_SUCCESS(Chan_Next_Copy(w->q,buf,b->nbytes)));
+        break;
+      case MODE_TRY:
+        while(CHAN_FAILURE(Chan_Next_Try(w->q,&buf,b->nbytes)))
+          Thread_Yield();
+        break;
+      default:
+        TRY(CHAN_SUCCESS(Chan_Next(w->q,&buf,b->nbytes)));
+    }
+  }
+Finalize:
+  Chan_Close(w->q);
+  Chan_Token_Buffer_Free(buf);
+  return NULL;
+Error:
+  goto Finalize;
+}
+
+static void* consumer(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  void     *buf, *msg;
+  if(b->mode==MODE_BATCH)
+    return batch_consumer(arg);
+  buf = Chan_Token_Buffer_Alloc(w->q);
+  while(1)
+  { switch(b->mode)
+    { case MODE_BCAST:
+        if(CHAN_FAILURE(Chan_Next_Borrow(w->q,&msg,(unsigned)-1)))
+          goto Finalize;
+        w->latency[w->nlatency++] = age(msg);
+        Chan_Release(w->q,msg);
+        continue;
+      case MODE_COPY:
+        if(CHAN_FAILURE(Chan_Next_Copy(w->q,buf,b->nbytes)))
+          goto Finalize;
+        break;
+      case MODE_TRY:
+        if(CHAN_FAILURE(Chan_Next_Try(w->q,&buf,b->nbytes)))
+        { if(Atomic_Load_Acquire(&b->nreceived)>=b->nmessages)
+            goto Finalize;
+          Thread_Yield();
+          continue;
+        }
+        Atomic_Add(&b->nreceived,1);
+        break;
+      default:
+        if(CHAN_FAILURE(Chan_Next(w->q,&buf,b->nbytes)))
+          goto Finalize;
+    }
+    w->latency[w->nlatency++] = age(buf);
+  }
+Finalize:
+  Chan_Close(w->q);
+  Chan_Token_Buffer_Free(buf);
+  return NULL;
+}
+
+static void* peeker(void *arg)
+{ bench_t *b = (bench_t*)arg;
+  Chan    *q = Chan_Open(b->q,CHAN_PEEK);
+  void  *buf = Chan_Token_Buffer_Alloc(q);
+  size_t   n = 0;
+  while(!Atomic_Load_Acquire(&b->done))
+  { if(CHAN_SUCCESS(Chan_Peek_Try(q,&buf,b->nbytes)))
+      ++n;
+    else
+      Thread_Yield();
+  }
+  b->npeeks = n;
+  Chan_Close(q);
+  Chan_Token_Buffer_Free(buf);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{ double x = *(const double*)a,
+         y = *(const double*)b;
+  return (x>y)-(x<y);
+}
+
+static double percentile(double *sorted, size_t n, double p)
+{ if(!n) return 0.0;
+  return sorted[(size_t)(p*(n-1))];
+}
+
+/** Runs one configuration and prints one line of results.
+    \returns 0 on success, 1 on error.
+*/
+static int run(bench_mode_t mode, size_t nbytes, size_t nmessages, unsigned np, unsigned nc, size_t qlen)
+{ bench_t   b;
+  worker_t *ws=0;
+  Thread  **ts=0, *tpeek=0;
+  double   *all=0, t0, dt;
+  size_t    i, nall=0;
+  unsigned  nw = np+nc;
+
+  memset(&b,0,sizeof(b));
+  b.mode      = mode;
+  b.nbytes    = nbytes;
+  b.nmessages = nmessages - nmessages%np; // so every producer sends the same number
+  TRY(b.q = Chan_Alloc(mode==MODE_EXPAND?2:qlen,nbytes));
+  if(mode==MODE_EXPAND)
+    Chan_Set_Expand_On_Full(b.q,1);
+  if(mode==MODE_BCAST)
+    Chan_Set_Broadcast(b.q,1);
+  TRY(ws = (worker_t*)calloc(nw,sizeof(worker_t)));
+  TRY(ts = (Thread**)calloc(nw,sizeof(Thread*)));
+
+  // Open every reference up front so no consumer sees the writer count
+  // drop to zero before the last producer has started.
+  for(i=0;i<nw;++i)
+  { ws[i].b = &b;
+    if(i<np)
+    { TRY(ws[i].q = Chan_Open(b.q,CHAN_WRITE));
+      ws[i].n = b.nmessages/np;
+    } else
+    { TRY(ws[i].q = Chan_Open(b.q,CHAN_READ));
+      TRY(ws[i].latency = (double*)malloc(b.nmessages*sizeof(double)));
+    }
+  }
+
+  t0 = Clock_Seconds();
+  if(mode==MODE_EXPAND)
+  { for(i=0;i<np;++i) ts[i] = Thread_Alloc(producer,ws+i);
+    for(i=0;i<np;++i) Thread_Join(ts[i]);
+    for(i=np;i<nw;++i) ts[i] = Thread_Alloc(consumer,ws+i);
+  } else
+  { if(mode==MODE_PEEK)
+      tpeek = Thread_Alloc(peeker,&b);
+    for(i=0;i<nw;++i) ts[i] = Thread_Alloc(i<np?producer:consumer,ws+i);
+  }
+  for(i=(mode==MODE_EXPAND)?np:0;i<nw;++i)
+    Thread_Join(ts[i]);
+  dt = Clock_Seconds()-t0;
+  if(tpeek)
+  { Atomic_Store_Release(&b.done,1);
+    Thread_Join(tpeek);
+    Thread_Free(tpeek);
+  }
+
+  for(i=np;i<nw;++i) nall += ws[i].nlatency;
+  TRY(all = (double*)malloc((nall?nall:1)*sizeof(double)));
+  for(nall=0,i=np;i<nw;++i)
+  { memcpy(all+nall,ws[i].latency,ws[i].nlatency*sizeof(double));
+    nall += ws[i].nlatency;
+  }
+  TRY(nall==b.nmessages*(mode==MODE_BCAST?nc:1));
+  qsort(all,nall,sizeof(double),cmp_double);
+
+  printf("%-6s %9u %3u %3u %9u %12.0f %9.3f %10.2f %10.2f %10.2f",
+         mode_names[mode],(unsigned)nbytes,np,nc,(unsigned)nall,
+         nall/dt, nall*(double)nbytes/dt*1e-9,
+         1e6*percentile(all,nall,0.5),
+         1e6*percentile(all,nall,0.99),
+         1e6*percentile(all,nall,0.999));
+  if(mode==MODE_PEEK)
+    printf(" %12.0f peeks/s",b.npeeks/dt);
+  printf(ENDL);
+
+  for(i=0;i<nw;++i) Thread_Free(ts[i]);
+  for(i=0;i<nw;++i) free(ws[i].latency);
+  free(ws); free(ts); free(all);
+  Chan_Close(b.q);
+  return 0;
+Error:
+  return 1;
+}
+
+static void usage(const char *name)
+{ fprintf(stderr,"Usage: %s [-n <messages>] [-p <max producers>] [-c <max consumers>] [-q <queue length>]"ENDL,name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{ size_t   nmessages = 100000,
+           qlen      = 16,
+           budget    = (size_t)1<<31; // caps bytes moved per run so big frames finish
+  unsigned maxp=2, maxc=2, np, nc;
+  int      i, m;
+  size_t   s;
+
+  for(i=1;i<argc;++i)
+  { if(i+1>=argc || argv[i][0]!='-') usage(argv[0]);
+    switch(argv[i][1])
+    { case 'n': nmessages = strtoul(argv[++i],0,10); break;
+      case 'p': maxp      = strtoul(argv[++i],0,10); break;
+      case 'c': maxc      = strtoul(argv[++i],0,10); break;
+      case 'q': qlen      = strtoul(argv[++i],0,10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(!nmessages || !maxp || !maxc || !qlen) usage(argv[0]);
+
+  printf("%-6s %9s %3s %3s %9s %12s %9s %10s %10s %10s"ENDL,
+         "mode","bytes","P","C","msgs","msgs/s","GB/s","p50(us)","p99(us)","p999(us)");
+  for(m=0;m<MODE_MAX;++m)
+    for(s=0;s<countof(sizes);++s)
+      for(np=1;np<=maxp;np*=2)
+        for(nc=1;nc<=maxc;nc*=2)
+        { size_t n = nmessages,
+                 cap = (m==MODE_EXPAND)?budget/8:budget; // expand holds everything at once
+          if(n*sizes[s]>cap)
+            n = cap/sizes[s];
+          if(n<np) n=np;
+          if(run((bench_mode_t)m,sizes[s],n,np,nc,qlen))
+            return 1;
+        }
+  return 0;
+}
@@ -0,0 +1,181 @@
+/** \file
+    Contention benchmark for Mutex and Condition.
+
+    Only depends on thread.c.  Build it twice on Linux to compare the futex
+    implementation with the pthread one (config.h comes from the build
+    directory):
+    \code
+    cc -O2 -I. -I<build> apps/mutexbench.c thread.c -lpthread -o mutexbench
+    cc -O2 -I. -I<build> -DTHREAD_NO_FUTEX apps/mutexbench.c thread.c -lpthread -o mutexbench-pthread
+    \endcode
+
+    Usage:
+    \verbatim
+    mutexbench [-n <iterations per thread>] [-t <max threads>] [-w <work per lock>]
+    \endverbatim
+
+    Tests:
+    \verbatim
+    lock      Every thread locks, bumps a shared counter, spins for <work>
+              iterations and unlocks.  ns/op is wall time per lock/unlock
+              pair across all threads.
+    pingpong  Two threads take turns through a Condition, the way a Chan
+              reader and writer do when the queue runs empty.  ns/op is
+              the time per handoff.
+    notify    Condition_Notify() with nobody waiting, as after every push to
+              a Chan whose reader is busy.
+    \endverbatim
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "thread.h"
+
+#define TRY(e) do{if(!(e)){fprintf(stderr,"%s(%d): Expression evaluated as false."ENDL"\t%s"ENDL,__FILE__,__LINE__,#e); goto Error;}}while(0)
+
+typedef struct _bench
+{ Mutex           lock;
+  Condition       cv;
+  size_t          niter;       // per thread
+  size_t          nwork;
+  volatile size_t counter;     // protected by lock
+  volatile size_t turn;        // pingpong: whose turn it is.  Protected by lock.
+} bench_t;
+
+typedef struct _worker
+{ bench_t *b;
+  size_t   id;
+} worker_t;
+
+static void spin(size_t n)
+{ volatile size_t i;
+  for(i=0;i<n;++i) {}
+}
+
+static void* locker(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  size_t    i;
+  for(i=0;i<b->niter;++i)
+  { Mutex_Lock(&b->lock);
+    ++b->counter;
+    spin(b->nwork);
+    Mutex_Unlock(&b->lock);
+  }
+  return NULL;
+}
+
+static void* ponger(void *arg)
+{ worker_t *w = (worker_t*)arg;
+  bench_t  *b = w->b;
+  size_t    i;
+  Mutex_Lock(&b->lock);
+  for(i=0;i<b->niter;++i)
+  { while(b->turn!=w->id)
+      Condition_Wait(&b->cv,&b->lock);
+    b->turn = !w->id;
+    ++b->counter;
+    Condition_Notify(&b->cv);
+  }
+  Mutex_Unlock(&b->lock);
+  return NULL;
+}
+
+static void init(bench_t *b, size_t niter, size_t nwork)
+{ memset(b,0,sizeof(*b));
+  b->lock  = MUTEX_INITIALIZER_INSTANCE;
+  Condition_Initialize(&b->cv);
+  b->niter = niter;
+  b->nwork = nwork;
+}
+
+/** Runs \a proc on \a nthreads threads.
+    \returns the wall time in seconds, or a negative number on error.
+*/
+static double run(bench_t *b, ThreadProc proc, unsigned nthreads)
+{ worker_t *ws=0;
+  Thread  **ts=0;
+  double    t0, dt;
+  unsigned  i;
+  TRY(ws = (worker_t*)calloc(nthreads,sizeof(worker_t)));
+  TRY(ts = (Thread**)calloc(nthreads,sizeof(Thread*)));
+  t0 = Clock_Seconds();
+  for(i=0;i<nthreads;++i)
+  { ws[i].b  = b;
+    ws[i].id = i;
+    ts[i] = Thread_Alloc(proc,ws+i);
+  }
+  for(i=0;i<nthreads;++i)
+  { Thread_Join(ts[i]);
+    Thread_Free(ts[i]);
+  }
+  dt = Clock_Seconds()-t0;
+  free(ws); free(ts);
+  return dt;
+Error:
+  free(ws); free(ts);
+  return -1.0;
+}
+
+static void report(const char *name, unsigned nthreads, size_t nwork, size_t nops, double dt)
+{ printf("%-9s %3u %6u %10u %12.0f %9.1f"ENDL,
+         name,nthreads,(unsigned)nwork,(unsigned)nops,nops/dt,1e9*dt/nops);
+}
+
+static void usage(const char *name)
+{ fprintf(stderr,"Usage: %s [-n <iterations per thread>] [-t <max threads>] [-w <work per lock>]"ENDL,name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{ bench_t  b;
+  size_t   niter = 1000000,
+           nwork = 0,
+           works[2], i;
+  unsigned maxt = 8, nt;
+  double   dt, t0;
+  int      a;
+
+  for(a=1;a<argc;++a)
+  { if(a+1>=argc || argv[a][0]!='-') usage(argv[0]);
+    switch(argv[a][1])
+    { case 'n': niter = strtoul(argv[++a],0,10); break;
+      case 't': maxt  = strtoul(argv[++a],0,10); break;
+      case 'w': nwork = strtoul(argv[++a],0,10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(!niter || !maxt) usage(argv[0]);
+  works[0] = 0;
+  works[1] = nwork?nwork:100; // roughly a Fifo push
+
+#ifdef USE_FUTEX
+  printf("# futex Mutex/Condition"ENDL);
+#else
+  printf("# pthread Mutex/Condition"ENDL);
+#endif
+  printf("%-9s %3s %6s %10s %12s %9s"ENDL,"test","T","work","ops","ops/s","ns/op");
+
+  for(i=0;i<2;++i)
+    for(nt=1;nt<=maxt;nt*=2)
+    { init(&b,niter/nt,works[i]);
+      TRY((dt=run(&b,locker,nt))>=0.0);
+      TRY(b.counter==b.niter*nt);
+      report("lock",nt,works[i],b.counter,dt);
+    }
+
+  init(&b,niter/10,0);
+  TRY((dt=run(&b,ponger,2))>=0.0);
+  TRY(b.counter==2*b.niter);
+  report("pingpong",2,0,b.counter,dt);
+
+  init(&b,niter,0);
+  t0 = Clock_Seconds();
+  for(i=0;i<niter;++i)
+    Condition_Notify(&b.cv);
+  report("notify",1,0,niter,Clock_Seconds()-t0);
+  return 0;
+Error:
+  return 1;
+}
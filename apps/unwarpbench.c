@@ -0,0 +1,608 @@
+/** \file
+    Conformance and throughput harness for the resonant scan unwarps.
+
+    Makes synthetic resonant scan frames for every pixel type, runs them
+    through each unwarp that's linked in and compares the result with a
+    double precision reference.  Reports the largest per-pixel error along
+    with frames/s and GB/s.
+
+    Backends:
+    \verbatim
+    pipeline    The LUT warp in algo/pipeline.h.  The CPU backend is run once
+                for each instruction set the processor supports.  Built
+                with UNWARPBENCH_CUDA, this is the CUDA backend instead.
+    unwarp_cpu  The cosine map unwarp in algo/unwarp.c.
+    unwarp_gpu  The cosine map unwarp in algo/unwarp.cu.  Only when built
+                with UNWARPBENCH_CUDA.
+    \endverbatim
+
+    On Linux, from the repository root (config.h comes from the build
+    directory, array.h from mylib):
+    \code
+    c++ -O2 -c algo/pipeline-cpu.cpp -I. -I<build>
+    cc  -O2 -c apps/unwarpbench.c algo/pipeline.c algo/unwarp.c thread.c -I. -Ialgo -I<build> -I<mylib>
+    c++ unwarpbench.o pipeline-cpu.o pipeline.o unwarp.o thread.o -lpthread -o unwarpbench
+    \endcode
+    For the CUDA build compile with -DUNWARPBENCH_CUDA and link pipeline.cu
+    and unwarp.cu instead of pipeline-cpu.cpp.
+
+    Usage:
+    \verbatim
+    unwarpbench [-w <width>] [-r <rows>] [-c <channels>] [-d <duty>] [-s <downsample>]
+                [-a <frames averaged>] [-t <type>] [-n <frames timed>] [-p <threads>]
+    \endverbatim
+    Each of -w, -d, -s and -t picks one value in place of the default
+    sweep.  Types are named u8 through f64.  Widths that give no output
+    for a duty and downsample factor are skipped.
+
+    The pipeline reference replays the interval encoded lookup table the
+    way the CUDA warp kernel reads it, in double.  The pipeline rounds every
+    output type to a whole number, like the CUDA cast_kernel, and is allowed
+    to be off by one where it rounds in single precision.  It's checked
+    after pipeline_reset() drops a partial average that's still in flight,
+    and again on the last frame out of the timed run, which keeps the queue
+    full.  The unwarp reference averages the input columns that land on each
+    output column.  Integer outputs may be off by one there too.  Floating
+    point outputs are allowed 1e-4 of the largest output.
+
+    unwarp_cpu is also run in place (isa "inplc") for each output type and
+    has to match its out of place result exactly.  Output types with wider
+    pixels than the input's have to be refused.  Those print unwarp_cpu's
+    assertion message.
+
+    GB/s counts the bytes read plus the bytes written.  The exit code is
+    non-zero if anything is out of tolerance.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include "config.h"
+#include "thread.h"
+#include "pipeline.h"
+#include "pipeline-image.h"
+#include "unwarp.h"
+
+#define countof(e) (sizeof(e)/sizeof(*(e)))
+
+#define TRY(e) do{if(!(e)){fprintf(stderr,"%s(%d): Expression evaluated as false."ENDL"\t%s"ENDL,__FILE__,__LINE__,#e); goto Error;}}while(0)
+
+int compute_map(float *xs, int w, float duty); // unwarp.c
+
+#define SAMPLE_RATE_MHZ (125)
+#define ALIGN           (256) // pipeline output rows are padded to this
+#define NTYPES          (10)  // pipeline_type_id and Value_Type agree on the order
+
+static const char    *type_names[NTYPES] = {"u8","u16","u32","u64","i8","i16","i32","i64","f32","f64"};
+static const unsigned type_bytes[NTYPES] = {1,2,4,8,1,2,4,8,4,8};
+static const double   type_lo[NTYPES]    = {0,0,0,0,-128,-32768,-2147483648.0,-9223372036854775808.0,-1e300,-1e300};
+static const double   type_hi[NTYPES]    = {255,65535,4294967295.0,18446744073709551615.0,127,32767,2147483647.0,9223372036854775807.0,1e300,1e300};
+
+static const unsigned widths[] = {1024,4096,14208};
+static const float    duties[] = {0.6f,0.75f,0.9f};
+static const unsigned dses[]   = {1,2,4};
+static const char    *isa_names[] = {"cuda","scalar","avx2","avx512"};
+
+typedef struct _frame_params
+{ unsigned w,rows,nchan,type,ds,every,ntimed,nthreads;
+  float    duty;
+} frame_params_t;
+
+typedef struct _result
+{ double maxerr,tol,dt;
+  size_t nframes,nbytes;  // timed frames, bytes per frame
+} result_t;
+
+//
+// --- PIXELS ---
+//
+
+static int is_float(unsigned type) { return type>=f32_id; }
+
+static double get(const void *data, unsigned type, size_t i)
+{ switch(type)
+  { case u8_id:  return ((const unsigned char*)     data)[i];
+    case u16_id: return ((const unsigned short*)    data)[i];
+    case u32_id: return ((const unsigned int*)      data)[i];
+    case u64_id: return (double)((const unsigned long long*)data)[i];
+    case i8_id:  return ((const signed char*)       data)[i];
+    case i16_id: return ((const short*)             data)[i];
+    case i32_id: return ((const int*)               data)[i];
+    case i64_id: return (double)((const long long*) data)[i];
+    case f32_id: return ((const float*)             data)[i];
+    case f64_id: return ((const double*)            data)[i];
+  }
+  return 0.0;
+}
+
+static void put(void *data, unsigned type, size_t i, double v)
+{ switch(type)
+  { case u8_id:  ((unsigned char*)     data)[i]=(unsigned char)     v; break;
+    case u16_id: ((unsigned short*)    data)[i]=(unsigned short)    v; break;
+    case u32_id: ((unsigned int*)      data)[i]=(unsigned int)      v; break;
+    case u64_id: ((unsigned long long*)data)[i]=(unsigned long long)v; break;
+    case i8_id:  ((signed char*)       data)[i]=(signed char)       v; break;
+    case i16_id: ((short*)             data)[i]=(short)             v; break;
+    case i32_id: ((int*)               data)[i]=(int)               v; break;
+    case i64_id: ((long long*)         data)[i]=(long long)         v; break;
+    case f32_id: ((float*)             data)[i]=(float)             v; break;
+    case f64_id: ((double*)            data)[i]=                    v; break;
+  }
+}
+
+static double cosine(double x) { return 0.5*(1.0-cos(2.0*M_PI*x)); }
+
+/** A line of stripes seen through a resonant scanner.
+    Sample \a i of a line sits at phase d+(1-2d)(i+0.5)/w of the mirror's
+    period, where d=(1-duty)/2, so the stripes bunch up at the turnarounds.
+    Pixels span at most 4096 values so integer types hold them exactly as
+    a float.
+*/
+static void make_frame(void *data, const frame_params_t *p, unsigned k)
+{ const double d=0.5*(1.0-p->duty),
+               lo=(type_lo[p->type]<-2048.0)?-2048.0:type_lo[p->type],
+               hi=(type_hi[p->type]>lo+4095.0)?lo+4095.0:type_hi[p->type];
+  size_t r,i,n=0;
+  for(r=0;r<(size_t)p->rows*p->nchan;++r)
+    for(i=0;i<p->w;++i,++n)
+    { const double x=cosine(d+(1.0-2.0*d)*(i+0.5)/p->w),
+                   v=0.5+0.4*sin(2.0*M_PI*(8.0*x+r/37.0+k/5.0))+0.1*(rand()/(double)RAND_MAX-0.5);
+      put(data,p->type,n,is_float(p->type)?lo+(hi-lo)*v:floor(lo+(hi-lo)*v+0.5));
+    }
+}
+
+//
+// --- PIPELINE REFERENCE ---
+//
+
+typedef struct _lut
+{ unsigned  ow,N;
+  unsigned *ilut;  // 2*(ow+1)
+  double   *norms; // 2*N+1
+} lut_t;
+
+static void lut_free(lut_t *t)
+{ if(t->ilut)  free(t->ilut);
+  if(t->norms) free(t->norms);
+  memset(t,0,sizeof(*t));
+}
+
+/** Same table as pipeline_fill_lut(), kept in double. */
+static int lut_make(lut_t *t, unsigned inwidth, double samples_per_scan, unsigned ds)
+{ const double d0=1.0-inwidth/samples_per_scan,
+               amplitude=inwidth*cos(M_PI*d0)/(M_PI*(1.0-d0)),
+               d=d0/2.0,
+               s=(1.0-2.0*d)/inwidth;
+  const unsigned halfw=inwidth/2;
+  unsigned *lut=0,i,last=0;
+  double A,Afd;
+  memset(t,0,sizeof(*t));
+  t->ow=ALIGN*(unsigned)(amplitude/ds/ALIGN);
+  t->N =ALIGN*((inwidth+ALIGN-1)/ALIGN);
+  if(!(0<t->ow && t->ow<inwidth))
+    return 0; // no output
+  A  =t->ow/(1.0-cosine(d));
+  Afd=A*cosine(d);
+  TRY(lut     =(unsigned*)calloc(inwidth,sizeof(unsigned)));
+  TRY(t->ilut =(unsigned*)calloc(2*(t->ow+1),sizeof(unsigned)));
+  TRY(t->norms=(double*)  calloc(2*t->N+1,sizeof(double)));
+  for(i=0;i<inwidth;++i)
+  { double v0=A*cosine(d+s*i)-Afd,
+           v1=A*cosine(d+s*(i+1))-Afd;
+    int j,k;
+    if(v0<0.0) v0=0.0;
+    if(v1<0.0) v1=0.0;
+    if(v0>v1) { double v=v0;v0=v1;v1=v; }
+    j=(int)v0;
+    k=(int)v1;
+    TRY(k-j<2);
+    lut[i]=j+(i<halfw?0:t->ow);
+    t->norms[i]     =(k==j)?v1-v0:k-v0;
+    t->norms[i+t->N]=(k==j)?0.0  :v1-k;
+  }
+  for(i=0;i<halfw;++i)
+    if(last!=lut[i])
+      t->ilut[last=lut[i]]=i;
+  t->ilut[t->ow  ]=inwidth/2;
+  t->ilut[t->ow+1]=inwidth;
+  for(i=halfw;i<inwidth;++i)
+    if(last!=lut[i])
+      t->ilut[2+(last=lut[i])]=i;
+  free(lut);
+  return 1;
+Error:
+  if(lut) free(lut);
+  lut_free(t);
+  return 0;
+}
+
+/** Adds the warp of every row of \a src to \a acc.  Reads the table the way
+    the CUDA warp_kernel does.  \a acc has 2*ow columns per input row.
+*/
+static void lut_warp(const lut_t *t, double *acc, const void *src, const frame_params_t *p)
+{ const double *n0=t->norms,
+               *n1=t->norms+t->N;
+  size_t r;
+  unsigned c,j;
+  for(r=0;r<(size_t)p->rows*p->nchan;++r,acc+=2*t->ow)
+  { const size_t o=r*p->w;
+    for(c=0;c<2*t->ow;++c)
+    { double v=0.0;
+      if(c<t->ow)
+      { const unsigned j0=t->ilut[c],j1=t->ilut[c+1];
+        if(j0>0) v+=n1[j0-1]*get(src,p->type,o+j0-1);
+        for(j=j0;j<j1;++j) v+=n0[j]*get(src,p->type,o+j);
+      } else
+      { const unsigned j1=t->ilut[c+1],j0=t->ilut[c+2];
+        for(j=j0;j<j1;++j) v+=n0[j]*get(src,p->type,o+j);
+        if(j1<p->w) v+=n1[j1]*get(src,p->type,o+j1);
+      }
+      acc[c]+=v;
+    }
+  }
+}
+
+/** Largest difference between a pipeline output and \a acc, the reference
+    sum of \a nsum frames, after the same scaling, rounding and clamping.
+*/
+static double pipeline_maxerr(const void *out, const double *acc, size_t n, unsigned nsum, float m, float b, unsigned type)
+{ double maxerr=0.0;
+  size_t i;
+  for(i=0;i<n;++i)
+  { double v=floor(acc[i]*m/nsum+b+0.5),e;
+    v=(v<type_lo[type])?type_lo[type]:(v>type_hi[type])?type_hi[type]:v;
+    e=fabs(get(out,type,i)-v);
+    maxerr=(e>maxerr)?e:maxerr;
+  }
+  return maxerr;
+}
+
+//
+// --- BACKENDS ---
+//
+
+static int run_pipeline(result_t *res, const frame_params_t *p, pipeline_isa_t isa, int *skip)
+{ pipeline_param_t params;
+  pipeline_t ctx=0;
+  struct pipeline_image_t_ src;
+  pipeline_image_t dst[PIPELINE_MAX_IN_FLIGHT]={0};
+  void   *srcdata=0,*dstdata[PIPELINE_MAX_IN_FLIGHT]={0};
+  double *acc=0,t0,e;
+  lut_t   lut={0};
+  size_t  i,nout=0;
+  float   m,b;
+  unsigned k,ow;
+  int emit=0,ok=0;
+
+  memset(&params,0,sizeof(params));
+  params.frame_average_count=p->every;
+  params.pixel_average_count=p->ds;
+  params.sample_rate_MHz=SAMPLE_RATE_MHZ;
+  params.scan_rate_Hz=(unsigned)(SAMPLE_RATE_MHZ*1e6*p->duty/p->w+0.5);
+  params.isa=isa;
+  params.nthreads=p->nthreads;
+  *skip=0;
+  if(!lut_make(&lut,p->w,SAMPLE_RATE_MHZ*1e6/params.scan_rate_Hz,p->ds))
+  { *skip=1; // no output for this width
+    return 1;
+  }
+  memset(&src,0,sizeof(src));
+  src.w=src.stride=p->w;
+  src.h=p->rows;
+  src.nchan=p->nchan;
+  src.type=(pipeline_type_id)p->type;
+  TRY(ctx=pipeline_make(&params));
+  TRY(pipeline_get_output_dims(ctx,&src,&ow,0,0));
+  TRY(ow==lut.ow);
+  TRY(srcdata=malloc((size_t)p->w*p->rows*p->nchan*type_bytes[p->type]));
+  src.data=srcdata;
+  for(k=0;k<PIPELINE_MAX_IN_FLIGHT;++k)
+  { TRY(dst[k]=pipeline_make_dst_image(0,ctx,&src));
+    TRY(dstdata[k]=malloc(pipeline_image_nbytes(dst[k])));
+    pipeline_image_set_data(dst[k],dstdata[k]);
+  }
+  nout=pipeline_image_nelem(dst[0]);
+  TRY(acc=(double*)calloc(nout,sizeof(double)));
+  pipeline_image_conversion_params(dst[0],&src,0,&m,&b);
+
+  // a partial average, still in flight, for pipeline_reset() to drop
+  if(p->every>1)
+  { make_frame(srcdata,p,p->every);
+    for(k=0;k<p->every-1 && k<PIPELINE_MAX_IN_FLIGHT;++k)
+    { TRY(pipeline_submit(ctx,dst[k],&src,&emit));
+      TRY(!emit);
+    }
+    pipeline_reset(ctx);
+    for(;k>0;--k)
+      TRY(pipeline_retire(ctx));
+  }
+
+  // conformance: one averaged frame
+  for(k=0;k<p->every;++k)
+  { make_frame(srcdata,p,k);
+    lut_warp(&lut,acc,srcdata,p);
+    TRY(pipeline_exec(ctx,dst[0],&src,&emit));
+  }
+  TRY(emit);
+  res->tol=1.0;
+  res->maxerr=pipeline_maxerr(dstdata[0],acc,nout,p->every,m,b,p->type);
+
+  // throughput: keep the queue full
+  res->nframes=(size_t)p->ntimed*p->every;
+  res->nbytes=(size_t)p->w*p->rows*p->nchan*type_bytes[p->type]
+             +pipeline_image_nbytes(dst[0])/p->every;
+  t0=Clock_Seconds();
+  for(i=0;i<res->nframes;++i)
+  { if(i>=PIPELINE_MAX_IN_FLIGHT)
+      TRY(pipeline_retire(ctx));
+    TRY(pipeline_submit(ctx,dst[i%PIPELINE_MAX_IN_FLIGHT],&src,&emit));
+  }
+  for(i=(res->nframes<PIPELINE_MAX_IN_FLIGHT)?res->nframes:PIPELINE_MAX_IN_FLIGHT;i>0;--i)
+    TRY(pipeline_retire(ctx));
+  res->dt=Clock_Seconds()-t0;
+
+  // The timed frames all repeat the last conformance frame, so the last
+  // one out of the queue is that frame's warp.
+  memset(acc,0,nout*sizeof(double));
+  lut_warp(&lut,acc,srcdata,p);
+  e=pipeline_maxerr(dstdata[(res->nframes-1)%PIPELINE_MAX_IN_FLIGHT],acc,nout,1,m,b,p->type);
+  res->maxerr=(e>res->maxerr)?e:res->maxerr;
+  ok=1;
+Error:
+  pipeline_free(&ctx);
+  for(k=0;k<PIPELINE_MAX_IN_FLIGHT;++k)
+  { pipeline_free_image(dst+k);
+    if(dstdata[k]) free(dstdata[k]);
+  }
+  if(srcdata) free(srcdata);
+  if(acc)     free(acc);
+  lut_free(&lut);
+  return ok;
+}
+
+typedef int (*unwarp_fn)(Array *out, Array *in, float duty);
+
+static int run_unwarp(result_t *res, const frame_params_t *p, unwarp_fn unwarp)
+{ Dimn_Type idims[3],odims[3];
+  Array   in,out;
+  float  *xs=0;
+  double *sum=0,*cnt=0,t0;
+  size_t  r,i,nout;
+  int     ok=0,j;
+
+  idims[0]=odims[0]=p->w;
+  idims[1]=odims[1]=p->rows;
+  idims[2]=odims[2]=p->nchan;
+  unwarp_get_dims_ip(odims,p->duty);
+  memset(&in, 0,sizeof(in));
+  memset(&out,0,sizeof(out));
+  in.type =out.type =(Value_Type)p->type;
+  in.ndims=out.ndims=3;
+  in.dims =idims;
+  out.dims=odims;
+  in.size =(Size_Type)idims[0]*p->rows*p->nchan;
+  out.size=(Size_Type)odims[0]*p->rows*p->nchan;
+  nout=(size_t)out.size;
+  TRY(in.data =malloc((size_t)in.size*type_bytes[p->type]));
+  TRY(out.data=malloc(nout*type_bytes[p->type]));
+  TRY(xs =(float*) malloc(p->w*sizeof(float)));
+  TRY(sum=(double*)malloc(odims[0]*sizeof(double)));
+  TRY(cnt=(double*)malloc(odims[0]*sizeof(double)));
+  TRY(compute_map(xs,p->w,p->duty)==odims[0]);
+
+  make_frame(in.data,p,0);
+  TRY(unwarp(&out,&in,p->duty));
+  res->maxerr=0.0;
+  res->tol=is_float(p->type)?0.0:1.0;
+  for(r=0;r<(size_t)p->rows*p->nchan;++r)
+  { memset(sum,0,odims[0]*sizeof(double));
+    memset(cnt,0,odims[0]*sizeof(double));
+    for(i=0;i<p->w;++i)
+    { j=(int)floorf(xs[i]+0.5f);
+      if(j==odims[0]) j=odims[0]-1;
+      sum[j]+=get(in.data,p->type,r*p->w+i);
+      cnt[j]+=1.0;
+    }
+    for(j=0;j<odims[0];++j)
+    { double v=cnt[j]?sum[j]/cnt[j]:0.0,e;
+      if(!is_float(p->type))
+        v=(v<0.0)?ceil(v):floor(v); // the cast truncates
+      else
+        res->tol=(fabs(v)>res->tol)?fabs(v):res->tol;
+      e=fabs(get(out.data,p->type,r*odims[0]+j)-v);
+      res->maxerr=(e>res->maxerr)?e:res->maxerr;
+    }
+  }
+  if(is_float(p->type))
+    res->tol*=1e-4;
+
+  res->nframes=p->ntimed;
+  res->nbytes=(size_t)(in.size+out.size)*type_bytes[p->type];
+  t0=Clock_Seconds();
+  for(i=0;i<res->nframes;++i)
+    TRY(unwarp(&out,&in,p->duty));
+  res->dt=Clock_Seconds()-t0;
+  ok=1;
+Error:
+  if(in.data)  free(in.data);
+  if(out.data) free(out.data);
+  if(xs)  free(xs);
+  if(sum) free(sum);
+  if(cnt) free(cnt);
+  return ok;
+}
+
+/** unwarp_cpu() with \a out over \a in, for every output type.  Each in
+    place result has to match the out of place one exactly.  Output pixels
+    wider than the input's have to be refused, with the input untouched.
+    A pair that breaks either rule makes maxerr infinite.  The timed runs
+    are in place with the output type the same as the input's.
+*/
+static int run_unwarp_inplace(result_t *res, const frame_params_t *p)
+{ Dimn_Type idims[3],odims[3];
+  Array   in,out;
+  void   *frame=0,*buf=0,*ref=0;
+  size_t  nbytes,i;
+  unsigned ot;
+  double  t0,e;
+  int     ok=0;
+
+  idims[0]=odims[0]=p->w;
+  idims[1]=odims[1]=p->rows;
+  idims[2]=odims[2]=p->nchan;
+  unwarp_get_dims_ip(odims,p->duty);
+  memset(&in, 0,sizeof(in));
+  memset(&out,0,sizeof(out));
+  in.type =(Value_Type)p->type;
+  in.ndims=out.ndims=3;
+  in.dims =idims;
+  out.dims=odims;
+  in.size =(Size_Type)idims[0]*p->rows*p->nchan;
+  out.size=(Size_Type)odims[0]*p->rows*p->nchan;
+  nbytes=(size_t)in.size*type_bytes[p->type];
+  TRY(frame=malloc(nbytes));
+  TRY(buf  =malloc(nbytes));
+  TRY(ref  =malloc((size_t)out.size*8));
+  make_frame(frame,p,0);
+  res->maxerr=0.0;
+  res->tol=0.0;
+  for(ot=0;ot<NTYPES;++ot)
+  { out.type=(Value_Type)ot;
+    in.data =frame;
+    out.data=ref;
+    TRY(unwarp_cpu(&out,&in,p->duty));
+    memcpy(buf,frame,nbytes);
+    in.data=out.data=buf;
+    if(type_bytes[ot]>type_bytes[p->type])
+    { if(unwarp_cpu(&out,&in,p->duty) || memcmp(buf,frame,nbytes))
+        res->maxerr=HUGE_VAL; // widened in place
+      continue;
+    }
+    if(!unwarp_cpu(&out,&in,p->duty))
+    { res->maxerr=HUGE_VAL; // refused a legal pair
+      continue;
+    }
+    for(i=0;i<(size_t)out.size;++i)
+    { e=fabs(get(buf,ot,i)-get(ref,ot,i));
+      res->maxerr=(e>res->maxerr)?e:res->maxerr;
+    }
+  }
+
+  out.type=in.type;
+  in.data=out.data=buf;
+  res->nframes=p->ntimed;
+  res->nbytes=(size_t)(in.size+out.size)*type_bytes[p->type];
+  memcpy(buf,frame,nbytes);
+  t0=Clock_Seconds();
+  for(i=0;i<res->nframes;++i)
+    TRY(unwarp_cpu(&out,&in,p->duty)); // later runs unwarp the last output again.  Same work.
+  res->dt=Clock_Seconds()-t0;
+  ok=1;
+Error:
+  if(frame) free(frame);
+  if(buf)   free(buf);
+  if(ref)   free(ref);
+  return ok;
+}
+
+//
+// --- MAIN ---
+//
+
+static int report(const char *backend, const char *isa, const frame_params_t *p, const result_t *res)
+{ const int pass=res->maxerr<=res->tol;
+  printf("%-10s %-6s %-3s %5u %4.2f %2u %9.3g %9.3g %8.1f %6.2f %s"ENDL,
+         backend,isa,type_names[p->type],p->w,p->duty,p->ds,res->maxerr,res->tol,
+         res->nframes/res->dt,1e-9*res->nbytes*res->nframes/res->dt,pass?"ok":"FAIL");
+  return pass;
+}
+
+static void usage(const char *name)
+{ fprintf(stderr,"Usage: %s [-w <width>] [-r <rows>] [-c <channels>] [-d <duty>] [-s <downsample>]"ENDL
+                 "       [-a <frames averaged>] [-t <type>] [-n <frames timed>] [-p <threads>]"ENDL,name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{ frame_params_t p;
+  result_t res;
+  pipeline_param_t params;
+  pipeline_t ctx;
+  pipeline_isa_t best,isa;
+  unsigned w=0,ds=0,type=NTYPES,iw,id,is,it,nfail=0;
+  float duty=0.0f;
+  int a,skip;
+
+  memset(&p,0,sizeof(p));
+  p.rows=256;
+  p.nchan=2;
+  p.every=1;
+  p.ntimed=10;
+  for(a=1;a<argc;++a)
+  { if(a+1>=argc || argv[a][0]!='-') usage(argv[0]);
+    switch(argv[a][1])
+    { case 'w': w       = strtoul(argv[++a],0,10); break;
+      case 'r': p.rows  = strtoul(argv[++a],0,10); break;
+      case 'c': p.nchan = strtoul(argv[++a],0,10); break;
+      case 'd': duty    = (float)atof(argv[++a]);  break;
+      case 's': ds      = strtoul(argv[++a],0,10); break;
+      case 'a': p.every = strtoul(argv[++a],0,10); break;
+      case 'n': p.ntimed= strtoul(argv[++a],0,10); break;
+      case 'p': p.nthreads=strtoul(argv[++a],0,10); break;
+      case 't':
+        for(type=0;type<NTYPES && strcmp(argv[a+1],type_names[type]);++type) {}
+        if(type==NTYPES) usage(argv[0]);
+        ++a;
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  if(!p.rows || !p.nchan || !p.every || !p.ntimed) usage(argv[0]);
+  if(duty!=0.0f && (duty<=0.5f || duty>1.0f)) usage(argv[0]);
+
+  memset(&params,0,sizeof(params));
+  params.scan_rate_Hz=7920;
+  params.sample_rate_MHz=SAMPLE_RATE_MHZ;
+  TRY(ctx=pipeline_make(&params));
+  best=pipeline_get_isa(ctx);
+  pipeline_free(&ctx);
+
+  printf("%-10s %-6s %-3s %5s %4s %2s %9s %9s %8s %6s"ENDL,
+         "backend","isa","pix","w","duty","ds","maxerr","tol","frames/s","GB/s");
+  for(it=0;it<NTYPES;++it)
+  { if(type<NTYPES && it!=type) continue;
+    for(iw=0;iw<countof(widths);++iw)
+    { if(w && iw) break;
+      for(id=0;id<countof(duties);++id)
+      { if(duty!=0.0f && id) break;
+        p.type=it;
+        p.w   =w?w:widths[iw];
+        p.duty=(duty!=0.0f)?duty:duties[id];
+        for(is=0;is<countof(dses);++is)
+        { if(ds && is) break;
+          p.ds=ds?ds:dses[is];
+          for(isa=(best==PIPELINE_ISA_AUTO)?PIPELINE_ISA_AUTO:PIPELINE_ISA_SCALAR;isa<=best;isa=(pipeline_isa_t)(isa+1))
+          { TRY(run_pipeline(&res,&p,isa,&skip));
+            if(!skip)
+              nfail+=!report("pipeline",isa_names[isa],&p,&res);
+          }
+        }
+        p.ds=1;
+        TRY(run_unwarp(&res,&p,unwarp_cpu));
+        nfail+=!report("unwarp_cpu","-",&p,&res);
+        TRY(run_unwarp_inplace(&res,&p));
+        nfail+=!report("unwarp_cpu","inplc",&p,&res);
+#ifdef UNWARPBENCH_CUDA
+        TRY(run_unwarp(&res,&p,unwarp_gpu));
+        nfail+=!report("unwarp_gpu","-",&p,&res);
+#endif
+      }
+    }
+  }
+  if(nfail)
+    printf("%u out of tolerance"ENDL,nfail);
+  return nfail!=0;
+Error:
+  return 2;
+}
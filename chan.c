@@ -5,8 +5,13 @@
 #include "chan.h"
 #include "fifo.h"
 
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#endif
+
 #define SUCCESS (0) 
 #define FAILURE (1)
+#define BYPASS  (2) // the lock-free path can't handle the request; take the lock
 
 #define DEBUG_CHAN
 
@@ -64,6 +69,9 @@ void chan_breakme() {}
 
 typedef uint32_t u32;
 
+struct _chan;
+struct _chan_waiter;
+
 typedef struct
 { Fifo *fifo;  
 
@@ -71,28 +79,69 @@ typedef struct
   u32 nreaders;
   u32 nwriters;
   u32 expand_on_full;
+  u32 refill;           // expand-on-full: the fifo could use spare buffers.  See chan_refill_spares().
+  u32 overwrite_on_full;
   u32 flush;
   
   Mutex              lock;
-  Condition          notfull;  //predicate: not full  || expand_on_full
+  Condition          notfull;  //predicate: not full  || expand_on_full || overwrite_on_full
   Condition          notempty; //predicate: not empty || no writers 
   Condition          changedRefCount; //predicate: refcount != n
   Condition          haveWriter; //predicate: nwriters>0
   Condition          haveReader; //predicate: nreaders>0
 
   void              *workspace;  // Token buffer used for copy operations.
+
+  // Single-reader/single-writer fast path.  See chan_push_fast().
+  volatile size_t    fast;       // 1 iff the lock-free path is enabled.  Only written under lock.
+  volatile size_t    in_push,    // set while a lock-free push is touching the fifo
+                     in_pop;     // set while a lock-free pop  is touching the fifo
+  volatile size_t    nwait_push, // number of fast-path writers sleeping on notfull
+                     nwait_pop;  // number of fast-path readers sleeping on notempty
+  volatile size_t    nwait_peek; // number of peekers and borrowers sleeping on notempty.  See chan_notify_readers().
+
+  // Counters for Chan_Get_Stats().  Only touched under the lock or from
+  // inside a lock-free push/pop (while in_push/in_pop is set), so they need
+  // no atomics of their own.  Readers of the counters turn the fast path
+  // off first (see chan_fast_disable__locked()).
+  ChanStats          stats;
+
+  // Chan_Peek_Borrow().  Only touched under the lock.  The lock-free pop
+  // also reads pinned; see chan_unpin__locked().
+  void * volatile    pinned;     // the borrowed buffer or NULL
+  u32                nborrows;   // outstanding borrows of pinned
+  u32                detached;   // 1 iff a pop took pinned off the queue.  We own it till it's released.
+  void              *spare;      // handed to a pop in place of pinned
+
+  // Broadcast mode.  See chan_bcast_oldest__locked().
+  u32                broadcast;
+  u32                nheld;      // outstanding Chan_Next_Borrow()s on a broadcast queue
+  size_t             seq;        // sequence number of the message at the fifo's read point
+  struct _chan     **readers;    // open CHAN_READ references.  nreaders of them.
+  size_t             readers_cap;
+
+  // Chan_Wait_Any() callers waiting on this queue.  Each one also counts
+  // in nwait_pop so lock-free pushes come through the lock to wake them.
+  struct _chan_waiter **waiters;
+  size_t             nwaiters,
+                     waiters_cap;
 } __chan_t;
 
 typedef struct _chan
 { 
   __chan_t *q;
   ChanMode  mode;
+
+  // Chan_Next_Borrow() state.  Belongs to this reference.
+  size_t    cursor;  // broadcast: sequence number of the next message to read
+  void     *held;    // the borrowed message or NULL
+  void     *token;   // not broadcast: borrowed messages get popped into this
 } chan_t;
 
-__chan_t* chan_alloc(size_t buffer_count, size_t buffer_size_bytes)
+__chan_t* chan_alloc(size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator)
 { __chan_t *c=0;
   Fifo *fifo;
-  if(fifo=Fifo_Alloc(buffer_count,buffer_size_bytes))
+  if(fifo=Fifo_Alloc_With(buffer_count,buffer_size_bytes,allocator))
   { Chan_Assert(c=(__chan_t*)calloc(1,sizeof(__chan_t)));
     c->fifo = fifo;
     c->lock = MUTEX_INITIALIZER_INSTANCE;
@@ -111,24 +160,259 @@ void chan_destroy(__chan_t* c)
 { //precondition - called when the last reference is released
   //             - nobody should be waiting
   Fifo_Free_Token_Buffer(c->workspace);
+  Fifo_Free_Token_Buffer(c->spare);
+  if(c->detached)
+    Fifo_Free_Token_Buffer(c->pinned);
+  free(c->readers);
+  free(c->waiters);
   Fifo_Free(c->fifo);
   free(c);
 }
 
-Chan* Chan_Alloc( size_t buffer_count, size_t buffer_size_bytes)
+static Chan* chan_alloc_handle( size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator)
 { chan_t   *c=0;
   __chan_t *q=0;
-  if(q=chan_alloc(buffer_count,buffer_size_bytes))
-  { Chan_Assert(c=(chan_t*)malloc(sizeof(chan_t)));
+  if(q=chan_alloc(buffer_count,buffer_size_bytes,allocator))
+  { Chan_Assert(c=(chan_t*)calloc(1,sizeof(chan_t)));
     c->q = q;
     c->mode = CHAN_NONE;
   }
   return (Chan*)c;
 }
 
-inline
+Chan* Chan_Alloc( size_t buffer_count, size_t buffer_size_bytes)
+{ return chan_alloc_handle(buffer_count,buffer_size_bytes,NULL);
+}
+
+Chan* Chan_Alloc_With( size_t buffer_count, size_t buffer_size_bytes, const ChanAllocator *allocator)
+{ FifoAllocator a;
+  if(!allocator)
+    return chan_alloc_handle(buffer_count,buffer_size_bytes,NULL);
+  a.alignment     = allocator->alignment;
+  a.reserve_bytes = allocator->reserve_bytes;
+  a.flags         = ((allocator->flags&CHAN_ALLOC_HUGE_PAGES)?FIFO_ALLOC_HUGE_PAGES:0)
+                  | ((allocator->flags&CHAN_ALLOC_LOCK)      ?FIFO_ALLOC_LOCK      :0)
+                  | ((allocator->flags&CHAN_ALLOC_PREFAULT)  ?FIFO_ALLOC_PREFAULT  :0);
+  return chan_alloc_handle(buffer_count,buffer_size_bytes,&a);
+}
+
+// The copy gets the same allocator
 Chan *Chan_Alloc_Copy( Chan *chan)
-{ return Chan_Alloc(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan));
+{ FifoAllocator a;
+  Fifo_Get_Allocator(((chan_t*)chan)->q->fifo,&a);
+  return chan_alloc_handle(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan),&a);
+}
+
+// -------------------------------
+// Single-reader/single-writer mode
+// -------------------------------
+//
+// When a channel has exactly one reader and one writer (the common case for
+// the acquisition pipeline) and is not set to expand or overwrite on full,
+// Chan_Next() and friends bypass the lock and use the lock-free
+// Fifo_Push_Try_SPSC() and Fifo_Pop_Try_SPSC().  The lock is only taken to
+// sleep when the queue is full (or empty) and to wake a sleeper on the other
+// side.
+//
+// Anything else that touches the fifo (copies, peeks, resizes, expansion,
+// changes in the number of readers or writers) takes the lock and calls
+// chan_fast_disable__locked() first.  That turns the fast path off and waits
+// for any in-flight lock-free operation to finish.  chan_fast_update__locked()
+// turns it back on if the channel is still eligible.
+
+// must be called from inside a lock
+static void chan_fast_disable__locked(__chan_t *q)
+{ Atomic_Exchange(&q->fast,0); // full barrier: pairs with the in_push/in_pop exchange in the fast path
+  while(Atomic_Load_Acquire(&q->in_push) || Atomic_Load_Acquire(&q->in_pop))
+    Thread_Yield();
+}
+
+// must be called from inside a lock
+static void chan_fast_update__locked(__chan_t *q)
+{ if(q->nreaders==1 && q->nwriters==1 && !q->expand_on_full && !q->overwrite_on_full && !q->broadcast)
+    Atomic_Exchange(&q->fast,1);
+  else if(Atomic_Load_Acquire(&q->fast))
+  { chan_fast_disable__locked(q);
+    // fast-path sleepers need to go back through the locked path
+    Condition_Notify_All(&q->notfull);
+    Condition_Notify_All(&q->notempty);
+  }
+}
+
+// Sleep on the locked path.  Callers bump nwait (nwait_push or nwait_pop)
+// before testing their predicate so a lock-free push or pop on the other
+// side knows to wake them.  The fast path may have been turned back on while
+// the lock was released, so it gets turned off again before returning.
+// Time spent asleep is added to *blocked.
+// must be called from inside a lock
+static int chan_wait__locked(__chan_t *q, Condition *c, unsigned timeout_ms, double *blocked)
+{ double t0 = Clock_Seconds();
+  int ok = Condition_Timed_Wait(c,&q->lock,timeout_ms);
+  *blocked += Clock_Seconds()-t0;
+  chan_fast_disable__locked(q);
+  return ok;
+}
+
+// Call after a successful push.  Only the pushing side writes the peak.
+static void chan_stats_pushed(__chan_t *q)
+{ size_t n = Fifo_Count(q->fifo);
+  ++q->stats.npush;
+  if(n>q->stats.peak_occupancy)
+    q->stats.peak_occupancy=n;
+}
+
+// A pop (or an overwriting push) took the borrowed buffer off the queue.
+// Borrowers are still reading it, so the caller gets a spare instead and the
+// original is set aside till Chan_Release().  Poppers want the contents
+// (copy=1).  Writers don't.
+// must be called from inside a lock
+static void chan_unpin__locked(__chan_t *q, void **pbuf, int copy)
+{ void *t;
+  if(!q->pinned || *pbuf!=q->pinned)
+    return;
+  t = q->spare?q->spare:Fifo_Alloc_Token_Buffer(q->fifo);
+  q->spare = NULL;
+  Fifo_Resize_Token_Buffer(q->fifo,&t);
+  if(copy)
+  { memcpy(t,*pbuf,Fifo_Buffer_Size_Bytes(q->fifo));
+    ++q->stats.nborrow_copies;
+  }
+  *pbuf = t;
+  q->detached = 1;
+}
+
+// Fifo_Resize() reallocs the buffers in the ring, which would pull a borrowed
+// buffer out from under its borrowers.  Growing waits for them to finish.
+// must be called from inside a lock
+static void chan_resize__locked(__chan_t *q, size_t nbytes)
+{ double blocked=0.0;
+  while((q->pinned || q->nheld) && nbytes>Fifo_Buffer_Size_Bytes(q->fifo))
+    chan_wait__locked(q,&q->notfull,(unsigned)-1,&blocked);
+  Fifo_Resize(q->fifo,nbytes);
+}
+
+// ---------------
+// Chan_Wait_Any()
+// ---------------
+//
+// A waiter lives on the Chan_Wait_Any() caller's stack and is registered
+// with every queue it's waiting on.  Anything that could make a queue ready
+// (a push or the last writer closing) signals the registered waiters while
+// holding the queue's lock.  Lock order is queue, then waiter.
+
+typedef struct _chan_waiter
+{ Mutex     lock;
+  Condition cv;
+  int       signaled;
+} chan_waiter_t;
+
+// must be called from inside a lock
+static void chan_signal_waiters__locked(__chan_t *q)
+{ size_t i;
+  for(i=0;i<q->nwaiters;++i)
+  { chan_waiter_t *w = q->waiters[i];
+    Mutex_Lock(&w->lock);
+    w->signaled = 1;
+    Condition_Notify(&w->cv);
+    Mutex_Unlock(&w->lock);
+  }
+}
+
+// ---------
+// Broadcast
+// ---------
+//
+// In broadcast mode every reader gets every message.  Each read reference
+// keeps its own cursor (a sequence number) and the fifo's read point trails
+// the slowest reader.  A message is recycled once every reader has moved
+// past it and released it.  Messages are numbered from q->seq, the message
+// at the fifo's read point, so reader r's next message is
+// Fifo_At(q->fifo,r->cursor-q->seq).
+//
+// With no readers open nothing is recycled, just like the normal mode.
+
+// Sequence number of the oldest message some reader still needs.
+// must be called from inside a lock
+static size_t chan_bcast_oldest__locked(__chan_t *q)
+{ size_t i,oldest = q->seq+Fifo_Count(q->fifo);
+  if(!q->nreaders)
+    return q->seq;
+  for(i=0;i<q->nreaders;++i)
+  { chan_t *r = q->readers[i];
+    size_t need = r->held?r->cursor-1:r->cursor;
+    if(need<oldest)
+      oldest = need;
+  }
+  return oldest;
+}
+
+// Recycle messages every reader is done with.  Called when a reader
+// releases or closes.  Writers get notified either way: a lossy writer may
+// be waiting for the oldest message to be released even if it can't be
+// recycled yet, and resizes wait for borrows.
+// must be called from inside a lock
+static void chan_bcast_trim__locked(__chan_t *q)
+{ size_t n = chan_bcast_oldest__locked(q)-q->seq;
+  Fifo_Drop(q->fifo,n);
+  q->seq += n;
+  Condition_Notify_All(&q->notfull);
+}
+
+// Overwrite-on-full for broadcast queues.  Drops the oldest message if no
+// reader is holding it.  Readers that hadn't gotten to it skip it.
+// Returns 1 if there's room now, 0 if the writer has to wait.
+// must be called from inside a lock
+static int chan_bcast_drop__locked(__chan_t *q)
+{ size_t i;
+  for(i=0;i<q->nreaders;++i)
+    if(q->readers[i]->held && q->readers[i]->cursor-1==q->seq)
+      return 0;
+  for(i=0;i<q->nreaders;++i)
+    if(q->readers[i]->cursor==q->seq)
+      ++q->readers[i]->cursor;
+  Fifo_Drop(q->fifo,1);
+  ++q->seq;
+  ++q->stats.ndropped;
+  return 1;
+}
+
+// Waits for the message at self's cursor and sets *pbuf to it, in place.
+// must be called from inside a lock
+static unsigned int chan_bcast_next__locked(chan_t *self, void **pbuf, unsigned timeout_ms)
+{ __chan_t *q = self->q;
+  int ok=1;
+  while(ok && timeout_ms && self->cursor==q->seq+Fifo_Count(q->fifo) && !(q->nwriters==0 && q->flush))
+    ok=chan_wait__locked(q,&q->notempty,timeout_ms,&q->stats.pop_blocked_s);
+  if(self->cursor==q->seq+Fifo_Count(q->fifo))
+    return FAILURE;
+  *pbuf = Fifo_At(q->fifo,self->cursor-q->seq);
+  ++self->cursor;
+  return SUCCESS;
+}
+
+// must be called from inside a lock
+static void chan_add_reader__locked(__chan_t *q, chan_t *r)
+{ if(q->nreaders>=q->readers_cap)
+  { q->readers_cap = q->readers_cap?2*q->readers_cap:4;
+    Chan_Assert(q->readers=(chan_t**)realloc(q->readers,q->readers_cap*sizeof(chan_t*)));
+  }
+  q->readers[q->nreaders] = r; // caller increments nreaders
+  r->cursor = q->seq;
+}
+
+// must be called from inside a lock
+static void chan_remove_reader__locked(__chan_t *q, chan_t *r)
+{ size_t i;
+  for(i=0;i<q->nreaders;++i)
+    if(q->readers[i]==r)
+    { q->readers[i] = q->readers[q->nreaders-1]; // caller decrements nreaders
+      q->readers[q->nreaders-1] = r;
+      break;
+    }
+  if(q->broadcast && r->held)
+  { r->held = NULL;
+    --q->nheld;
+  }
 }
 
 // must be called from inside a lock
@@ -137,6 +421,7 @@ chan_t* incref(chan_t *c)
   ++(c->q->ref_count);
   goto_if_not(n=malloc(sizeof(chan_t)),ErrorAlloc);
   memcpy(n,c,sizeof(chan_t));
+  n->held = n->token = NULL; // borrow state isn't shared
   DEBUG_SHOW_REFS;
   Condition_Notify_All(&c->q->changedRefCount);
   return n;
@@ -179,6 +464,7 @@ Chan* Chan_Open( Chan *self, ChanMode mode)
   n->mode = mode;
   switch(mode)
   { case CHAN_READ:      
+      chan_add_reader__locked(n->q,n);
       ++(n->q->nreaders);
       if(Fifo_Is_Empty(n->q->fifo))
         n->q->flush=0;
@@ -195,6 +481,7 @@ Chan* Chan_Open( Chan *self, ChanMode mode)
       CHAN_ERR__INVALID_MODE;
       break;
   }
+  chan_fast_update__locked(n->q);
 ErrorIncref: 
   //n will be null if there's an error.
   //The error should already be reported.
@@ -215,9 +502,12 @@ int Chan_Close( Chan *self_ )
   { __chan_t *q = self->q;
     switch(self->mode)
     { case CHAN_READ:  
+        chan_remove_reader__locked(q,self);
         Chan_Assert( (--(q->nreaders))>=0 );
         if(q->nreaders==0)
           q->flush=0;
+        if(q->broadcast)
+          chan_bcast_trim__locked(q);
         break;
       case CHAN_WRITE:
         Chan_Assert( (--(q->nwriters))>=0 );
@@ -227,10 +517,14 @@ int Chan_Close( Chan *self_ )
           q->flush=1;
         break;
     }
+    chan_fast_update__locked(q);
   }
   if(notify)
-    Condition_Notify_All(&self->q->notempty);
+  { Condition_Notify_All(&self->q->notempty);
+    chan_signal_waiters__locked(self->q);
+  }
   Mutex_Unlock(&self->q->lock);
+  Fifo_Free_Token_Buffer(self->token);
   decref(&self);
   return SUCCESS;
 }
@@ -270,10 +564,63 @@ void Chan_Wait_For_Have_Reader(Chan* self_)
   Mutex_Unlock(&q->lock);
 }
 
+/** Allocates the buffers for the next expansion without holding the lock,
+    so a push to a full expand-on-full queue only has to move pointers.
+    Only one thread refills at a time: the one that clears q->refill.
+*/
+static void chan_refill_spares(__chan_t *q)
+{ size_t n=0, sz=0;
+  void *buf;
+  Mutex_Lock(&q->lock);
+  if(q->refill && q->expand_on_full)
+  { n  = Fifo_Spares_Needed(q->fifo);
+    sz = Fifo_Buffer_Size_Bytes(q->fifo);
+  }
+  q->refill=0;
+  Mutex_Unlock(&q->lock);
+  while(n--)
+  { buf = Fifo_Alloc_Token_Buffer(q->fifo);
+    Mutex_Lock(&q->lock);   // one at a time so nobody waits on the whole batch
+    Fifo_Add_Spare(q->fifo,buf,sz);
+    Mutex_Unlock(&q->lock);
+  }
+}
+
 void Chan_Set_Expand_On_Full( Chan* self_, int expand_on_full)
 { chan_t *self = (chan_t*)self_;  
+  Mutex_Lock(&self->q->lock);
+  chan_fast_disable__locked(self->q); // Fifo_Expand() reallocates the ring
   self->q->expand_on_full=expand_on_full;
+  self->q->refill=expand_on_full;
+  chan_fast_update__locked(self->q);
+  Mutex_Unlock(&self->q->lock);
   if(expand_on_full)
+  { Condition_Notify_All(&self->q->notfull);
+    chan_refill_spares(self->q);
+  }
+}
+
+void Chan_Set_Broadcast( Chan* self_, int broadcast)
+{ __chan_t *q = ((chan_t*)self_)->q;
+  size_t i;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q);
+  Chan_Assert(q->nheld==0);
+  q->broadcast=broadcast;
+  for(i=0;i<q->nreaders;++i)
+    q->readers[i]->cursor = q->seq;
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
+}
+
+void Chan_Set_Overwrite_On_Full( Chan* self_, int overwrite_on_full)
+{ chan_t *self = (chan_t*)self_;  
+  Mutex_Lock(&self->q->lock);
+  chan_fast_disable__locked(self->q); // overwriting moves the reader's cursor
+  self->q->overwrite_on_full=overwrite_on_full;
+  chan_fast_update__locked(self->q);
+  Mutex_Unlock(&self->q->lock);
+  if(overwrite_on_full)
     Condition_Notify_All(&self->q->notfull);
 }
 
@@ -281,14 +628,33 @@ void Chan_Set_Expand_On_Full( Chan* self_, int expand_on_full)
 // Next
 // ----
 
-unsigned int chan_push__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
-{ 
-  while(Fifo_Is_Full(q->fifo) && q->expand_on_full==0)
-    if(!Condition_Timed_Wait(&q->notfull,&q->lock,timeout_ms))
-      return FAILURE; // timeout
-  if(FIFO_SUCCESS(Fifo_Push(q->fifo,pbuf,sz,q->expand_on_full)))
-    return SUCCESS;
-  return FAILURE;
+/** Pushes *pbuf.  If src isn't NULL, copies sz bytes from src into *pbuf
+    first, once there's room.  Copying any earlier would race other writers
+    sharing q->workspace while this one waits.
+*/
+unsigned int chan_push__locked(__chan_t *q, void **pbuf, size_t sz, const void *src, unsigned timeout_ms)
+{ int ok=1;
+  if(sz>Fifo_Buffer_Size_Bytes(q->fifo))
+    chan_resize__locked(q,sz); // so Fifo_Push() doesn't have to
+  Atomic_Add(&q->nwait_push,1);
+  while(ok && Fifo_Is_Full(q->fifo) && q->expand_on_full==0)
+  { if(q->overwrite_on_full && (!q->broadcast || chan_bcast_drop__locked(q)))
+      break;
+    ok=chan_wait__locked(q,&q->notfull,timeout_ms,&q->stats.push_blocked_s);
+  }
+  Atomic_Add(&q->nwait_push,(size_t)-1);
+  if(!ok)
+    return FAILURE; // timeout
+  if(q->expand_on_full && Fifo_Is_Full(q->fifo))
+    q->refill=1; // Fifo_Push() is about to use up the spares
+  if(src)
+  { Fifo_Resize_Token_Buffer(q->fifo,pbuf);
+    memcpy(*pbuf,src,sz);
+  }
+  if(FIFO_FAILURE(Fifo_Push(q->fifo,pbuf,sz,q->expand_on_full))) // the oldest message was overwritten
+    ++q->stats.ndropped;
+  chan_unpin__locked(q,pbuf,0); // an overwritten or recycled broadcast slot might hold a pinned buffer
+  return SUCCESS;
 }
 
 inline int _pop_bypass_wait(__chan_t *q)
@@ -298,12 +664,18 @@ inline int _pop_bypass_wait(__chan_t *q)
 
 unsigned int chan_pop__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
 { //int starved;
-  while(Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q))
-    if(!Condition_Timed_Wait(&q->notempty,&q->lock,timeout_ms))
-      return FAILURE; //timeout
+  int ok=1;
+  Atomic_Add(&q->nwait_pop,1);
+  while(ok && Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q))
+    ok=chan_wait__locked(q,&q->notempty,timeout_ms,&q->stats.pop_blocked_s);
+  Atomic_Add(&q->nwait_pop,(size_t)-1);
+  if(!ok)
+    return FAILURE; //timeout
   //starved = Fifo_Is_Empty(q->fifo) && q->nwriters==0;
   if(FIFO_SUCCESS(Fifo_Pop(q->fifo,pbuf,sz)))
+  { chan_unpin__locked(q,pbuf,1);
     return SUCCESS;
+  }
   return FAILURE;
 }
 
@@ -314,74 +686,304 @@ inline int _peek_bypass_wait(__chan_t *q)
 
 unsigned int chan_peek__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
 { //int starved;
+  Atomic_Add(&q->nwait_pop,1);
+  Atomic_Add(&q->nwait_peek,1);
   while(Fifo_Is_Empty(q->fifo) && !_peek_bypass_wait(q))
-    Condition_Wait(&q->notempty,&q->lock); //ingore timeout on peek
+    chan_wait__locked(q,&q->notempty,(unsigned)-1,&q->stats.pop_blocked_s); //ingore timeout on peek
+  Atomic_Add(&q->nwait_peek,(size_t)-1);
+  Atomic_Add(&q->nwait_pop,(size_t)-1);
   //starved = Fifo_Is_Empty(q->fifo) && q->nwriters==0;
   if(FIFO_SUCCESS(Fifo_Peek(q->fifo,pbuf,sz)))
     return SUCCESS;
   return FAILURE;
 }
 
+/** Wakes readers after a push.  Peekers and borrowers sleep on notempty
+    too, but don't take the message.  A single notify could land on one of
+    them and leave a popper asleep, so everybody gets woken when there are
+    any.  On a broadcast queue every reader wants every message anyway.
+*/
+static void chan_notify_readers(__chan_t *q, int all)
+{ if(all || q->broadcast || Atomic_Load_Acquire(&q->nwait_peek))
+    Condition_Notify_All(&q->notempty);
+  else
+    Condition_Notify(&q->notempty);
+}
+
+/** Lock-free push for channels with one reader and one writer.
+    \returns SUCCESS or FAILURE just like chan_push(), or BYPASS if the
+              request has to go through the locked path.
+*/
+static unsigned int chan_push_fast(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
+{ unsigned int sts;
+  while(1)
+  { Atomic_Exchange(&q->in_push,1);  // full barrier: pairs with chan_fast_disable__locked()
+    if(!Atomic_Load_Acquire(&q->fast) || sz>Fifo_Buffer_Size_Bytes(q->fifo)) // disabled or needs a resize
+    { Atomic_Store_Release(&q->in_push,0);
+      return BYPASS;
+    }
+    sts = Fifo_Push_Try_SPSC(q->fifo,pbuf,sz);
+    if(FIFO_SUCCESS(sts))  chan_stats_pushed(q);
+    else if(timeout_ms==0) ++q->stats.ntry_push_fail;
+    Atomic_Exchange(&q->in_push,0);  // full barrier: publish head before looking for sleepers
+    if(FIFO_SUCCESS(sts))
+    { if(Atomic_Load_Acquire(&q->nwait_pop))
+      { Mutex_Lock(&q->lock);
+        chan_notify_readers(q,0);
+        chan_signal_waiters__locked(q);
+        Mutex_Unlock(&q->lock);
+      }
+      return SUCCESS;
+    }
+    if(timeout_ms==0)
+      return FAILURE;
+    // Full.  Sleep till the reader makes room or the fast path gets turned off.
+    Mutex_Lock(&q->lock);
+    Atomic_Add(&q->nwait_push,1);
+    { double t0 = Clock_Seconds();
+      int ok = 1;
+      while(ok && Fifo_Is_Full(q->fifo) && Atomic_Load_Acquire(&q->fast))
+        ok = Condition_Timed_Wait(&q->notfull,&q->lock,timeout_ms);
+      q->stats.push_blocked_s += Clock_Seconds()-t0;
+      Atomic_Add(&q->nwait_push,(size_t)-1);
+      Mutex_Unlock(&q->lock);
+      if(!ok)
+        return FAILURE; // timeout
+    }
+  }
+}
+
+/** Lock-free pop for channels with one reader and one writer.
+    \returns SUCCESS or FAILURE just like chan_pop(), or BYPASS if the
+              request has to go through the locked path.
+*/
+static unsigned int chan_pop_fast(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
+{ unsigned int sts;
+  while(1)
+  { Atomic_Exchange(&q->in_pop,1);   // full barrier: pairs with chan_fast_disable__locked()
+    if(!Atomic_Load_Acquire(&q->fast))
+    { Atomic_Store_Release(&q->in_pop,0);
+      return BYPASS;
+    }
+    sts = Fifo_Pop_Try_SPSC(q->fifo,pbuf,sz);
+    if(FIFO_SUCCESS(sts))  ++q->stats.npop;
+    else if(timeout_ms==0) ++q->stats.ntry_pop_fail;
+    Atomic_Exchange(&q->in_pop,0);   // full barrier: publish tail before looking for sleepers
+    if(FIFO_SUCCESS(sts))
+    { if(*pbuf==q->pinned || Atomic_Load_Acquire(&q->nwait_push))
+      { Mutex_Lock(&q->lock);
+        chan_unpin__locked(q,pbuf,1); // rechecks: the borrow may have been released already
+        Condition_Notify(&q->notfull);
+        Mutex_Unlock(&q->lock);
+      }
+      return SUCCESS;
+    }
+    if(timeout_ms==0)
+      return FAILURE;
+    // Empty.  Sleep till the writer pushes or the fast path gets turned off
+    // (e.g. the writer closed, in which case the locked path handles the flush).
+    Mutex_Lock(&q->lock);
+    Atomic_Add(&q->nwait_pop,1);
+    { double t0 = Clock_Seconds();
+      int ok = 1;
+      while(ok && Fifo_Is_Empty(q->fifo) && Atomic_Load_Acquire(&q->fast))
+        ok = Condition_Timed_Wait(&q->notempty,&q->lock,timeout_ms);
+      q->stats.pop_blocked_s += Clock_Seconds()-t0;
+      Atomic_Add(&q->nwait_pop,(size_t)-1);
+      Mutex_Unlock(&q->lock);
+      if(!ok)
+        return FAILURE; // timeout
+    }
+  }
+}
+
 unsigned int chan_push(chan_t *self, void **pbuf, size_t sz, int copy, unsigned timeout_ms)
 { // TO SELF: use timeout=0 for try 
   // precondition: this should be a "Write" mode channel
+  if(!copy)
+  { unsigned int sts = chan_push_fast(self->q,pbuf,sz,timeout_ms);
+    if(sts!=BYPASS)
+      return sts;
+  }
   Mutex_Lock(&self->q->lock);
+  chan_fast_disable__locked(self->q);
   { __chan_t *q = self->q;
     if(timeout_ms==0)
-      goto_if(Fifo_Is_Full(q->fifo),NoPush);
+      goto_if(Fifo_Is_Full(q->fifo) && !q->overwrite_on_full,NoPush);
     if(copy)
-    { Fifo_Resize(q->fifo,sz);
-      Fifo_Resize_Token_Buffer(q->fifo,&q->workspace);
-      memcpy(q->workspace,*pbuf,sz);
-      goto_if(CHAN_FAILURE(chan_push__locked(q,&q->workspace,sz,timeout_ms)),NoPush);
+    { chan_resize__locked(q,sz);
+      goto_if(CHAN_FAILURE(chan_push__locked(q,&q->workspace,sz,*pbuf,timeout_ms)),NoPush);
     } else
     {
-      goto_if(CHAN_FAILURE(chan_push__locked(q,pbuf,sz,timeout_ms)),NoPush);
+      goto_if(CHAN_FAILURE(chan_push__locked(q,pbuf,sz,NULL,timeout_ms)),NoPush);
     }
   }
+  chan_stats_pushed(self->q);
+  chan_fast_update__locked(self->q);
+  chan_signal_waiters__locked(self->q);
   Mutex_Unlock(&self->q->lock);
-  Condition_Notify(&self->q->notempty);
+  chan_notify_readers(self->q,0);
+  if(self->q->refill)
+    chan_refill_spares(self->q);
   return SUCCESS;
 NoPush:
+  if(timeout_ms==0)
+    ++self->q->stats.ntry_push_fail;
+  chan_fast_update__locked(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
 
+// Broadcast readers share the queue's buffers, so a pop is a borrow, a copy
+// and a release.  Use Chan_Next_Borrow() to skip the copy.
+static unsigned int chan_bcast_pop(chan_t *self, void **pbuf, size_t sz, int copy, unsigned timeout_ms)
+{ void *src;
+  size_t n;
+  if(CHAN_FAILURE(Chan_Next_Borrow((Chan*)self,&src,timeout_ms)))
+    return FAILURE;
+  n = Fifo_Buffer_Size_Bytes(self->q->fifo); // resizes wait for the release
+  if(copy)
+    memcpy(*pbuf,src,(sz<n)?sz:n);
+  else
+  { if(sz<n)
+      Chan_Assert(*pbuf = Fifo_Realloc_Token_Buffer(*pbuf,n));
+    memcpy(*pbuf,src,n);
+  }
+  Chan_Release((Chan*)self,src);
+  return SUCCESS;
+}
+
 unsigned int chan_pop(chan_t *self, void **pbuf, size_t sz, int copy, unsigned timeout_ms)
 { 
+  if(self->q->broadcast)
+    return chan_bcast_pop(self,pbuf,sz,copy,timeout_ms);
+  if(!copy)
+  { unsigned int sts = chan_pop_fast(self->q,pbuf,sz,timeout_ms);
+    if(sts!=BYPASS)
+      return sts;
+  }
   Mutex_Lock(&self->q->lock);
+  chan_fast_disable__locked(self->q);
   { __chan_t *q = self->q;
     if(timeout_ms==0)
       goto_if(Fifo_Is_Empty(q->fifo),NoPop);
     if(copy)
-    { Fifo_Resize(q->fifo,sz);
+    { chan_resize__locked(q,sz);
       Fifo_Resize_Token_Buffer(q->fifo,&q->workspace);
       goto_if(CHAN_FAILURE(chan_pop__locked(q,&q->workspace,sz,timeout_ms)),NoPop);
       memcpy(*pbuf,q->workspace,sz);
     } else
       goto_if(CHAN_FAILURE(chan_pop__locked(q,pbuf,sz,timeout_ms)),NoPop);
   }            
+  ++self->q->stats.npop;
+  chan_fast_update__locked(self->q);
   Condition_Notify(&self->q->notfull);
   Mutex_Unlock(&self->q->lock);
   return SUCCESS;
 NoPop:
+  if(timeout_ms==0)
+    ++self->q->stats.ntry_pop_fail;
+  chan_fast_update__locked(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
 
+/** Pushes up to n messages under one lock.
+    Only waits for room for the first one.  After that, it stops as soon as
+    the queue is full.  Readers get one wakeup for the whole batch.
+    When copy is set, bufs points to n messages of sz bytes laid end to end.
+    Otherwise it's an array of n token buffers.
+*/
+static unsigned int chan_push_n(chan_t *self, void *bufs, size_t n, size_t sz, int copy, size_t *nmoved)
+{ __chan_t *q = self->q;
+  size_t i;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q);
+  if(copy)
+    chan_resize__locked(q,sz);
+  for(i=0;i<n;++i)
+  { if(i && Fifo_Is_Full(q->fifo) && !q->expand_on_full && !q->overwrite_on_full)
+      break;
+    if(copy)
+    { if(CHAN_FAILURE(chan_push__locked(q,&q->workspace,sz,(char*)bufs+i*sz,i?0:(unsigned)-1)))
+        break;
+    } else if(CHAN_FAILURE(chan_push__locked(q,(void**)bufs+i,sz,NULL,i?0:(unsigned)-1)))
+      break;
+    chan_stats_pushed(q);
+  }
+  chan_fast_update__locked(q);
+  if(i)
+    chan_signal_waiters__locked(q);
+  Mutex_Unlock(&q->lock);
+  if(i)
+    chan_notify_readers(q,i>1);
+  if(q->refill)
+    chan_refill_spares(q);
+  if(nmoved)
+    *nmoved=i;
+  return i?SUCCESS:FAILURE;
+}
+
+/** Pops up to n messages under one lock.
+    Only waits for the first one.  Writers get one wakeup for the whole batch.
+    Broadcast readers fall back to one borrow per message.
+*/
+static unsigned int chan_pop_n(chan_t *self, void *bufs, size_t n, size_t sz, int copy, size_t *nmoved)
+{ __chan_t *q = self->q;
+  size_t i;
+  if(q->broadcast)
+  { for(i=0;i<n;++i)
+    { void *dst = copy?(char*)bufs+i*sz:NULL;
+      if(CHAN_FAILURE(chan_bcast_pop(self,copy?&dst:(void**)bufs+i,sz,copy,i?0:(unsigned)-1)))
+        break;
+    }
+    goto Done;
+  }
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q);
+  if(copy)
+  { chan_resize__locked(q,sz);
+    Fifo_Resize_Token_Buffer(q->fifo,&q->workspace);
+  }
+  for(i=0;i<n;++i)
+  { if(i && Fifo_Is_Empty(q->fifo))
+      break;
+    if(copy)
+    { if(CHAN_FAILURE(chan_pop__locked(q,&q->workspace,sz,i?0:(unsigned)-1)))
+        break;
+      memcpy((char*)bufs+i*sz,q->workspace,sz);
+    } else if(CHAN_FAILURE(chan_pop__locked(q,(void**)bufs+i,sz,i?0:(unsigned)-1)))
+      break;
+    ++q->stats.npop;
+  }
+  chan_fast_update__locked(q);
+  if(i>1)
+    Condition_Notify_All(&q->notfull);
+  else if(i)
+    Condition_Notify(&q->notfull);
+  Mutex_Unlock(&q->lock);
+Done:
+  if(nmoved)
+    *nmoved=i;
+  return i?SUCCESS:FAILURE;
+}
+
 unsigned int chan_peek(chan_t *self, void **pbuf, size_t sz, unsigned timeout_ms)
 { 
   Mutex_Lock(&self->q->lock);
+  chan_fast_disable__locked(self->q); // the reader could otherwise pop the buffer out from under the copy
   { __chan_t *q = self->q;
     if(timeout_ms==0)
       goto_if(Fifo_Is_Empty(q->fifo),NoPeek);
     goto_if(Fifo_Is_Empty(q->fifo) && q->nwriters==0,NoPeek); // possibly avoid the resize/copy
     goto_if(CHAN_FAILURE(chan_peek__locked(q,pbuf,sz,timeout_ms)),NoPeek);
   }
+  chan_fast_update__locked(self->q);
   Mutex_Unlock(&self->q->lock);
   // no size change so no notify
   return SUCCESS;
 NoPeek:
+  chan_fast_update__locked(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
@@ -446,6 +1048,116 @@ unsigned int Chan_Next_Timed( Chan *self_, void **pbuf, size_t sz, unsigned time
   return FAILURE;
 }
 
+unsigned int Chan_Next_N( Chan *self_, void **pbufs, size_t n, size_t sz, size_t *nmoved )
+{ chan_t *self = (chan_t*)self_;
+  switch(self->mode)
+  { case CHAN_READ:  return chan_pop_n (self,pbufs,n,sz,0,nmoved); break;
+    case CHAN_WRITE: return chan_push_n(self,pbufs,n,sz,0,nmoved); break;
+    default:
+      CHAN_ERR__INVALID_MODE;
+      break;
+  }
+  return FAILURE;
+}
+
+unsigned int Chan_Next_Copy_N( Chan *self_, void *bufs, size_t n, size_t sz, size_t *nmoved )
+{ chan_t *self = (chan_t*)self_;
+  switch(self->mode)
+  { case CHAN_READ:  return chan_pop_n (self,bufs,n,sz,1,nmoved); break;
+    case CHAN_WRITE: return chan_push_n(self,bufs,n,sz,1,nmoved); break;
+    default:
+      CHAN_ERR__INVALID_MODE;
+      break;
+  }
+  return FAILURE;
+}
+
+// ----
+// Wait
+// ----
+
+// 1 if a Chan_Next() on self would find a message.  2 if it would fail
+// because the queue is drained and closed.  0 if it would wait.
+// must be called from inside a lock
+static int chan_ready__locked(chan_t *self)
+{ __chan_t *q = self->q;
+  int empty = q->broadcast?(self->cursor==q->seq+Fifo_Count(q->fifo)):Fifo_Is_Empty(q->fifo);
+  if(!empty)
+    return 1;
+  return (q->nwriters==0 && q->flush)?2:0;
+}
+
+// Registers w with self's queue and reports chan_ready__locked().
+static int chan_waiter_add(chan_t *self, chan_waiter_t *w)
+{ __chan_t *q = self->q;
+  int ready;
+  Mutex_Lock(&q->lock);
+  if(q->nwaiters>=q->waiters_cap)
+  { q->waiters_cap = q->waiters_cap?2*q->waiters_cap:4;
+    Chan_Assert(q->waiters=(chan_waiter_t**)realloc(q->waiters,q->waiters_cap*sizeof(chan_waiter_t*)));
+  }
+  q->waiters[q->nwaiters++] = w;
+  Atomic_Add(&q->nwait_pop,1); // full barrier: pairs with the nwait_pop check in chan_push_fast()
+  ready = chan_ready__locked(self);
+  Mutex_Unlock(&q->lock);
+  return ready;
+}
+
+static void chan_waiter_remove(chan_t *self, chan_waiter_t *w)
+{ __chan_t *q = self->q;
+  size_t i;
+  Mutex_Lock(&q->lock);
+  for(i=0;i<q->nwaiters;++i)
+    if(q->waiters[i]==w)
+    { q->waiters[i] = q->waiters[--q->nwaiters];
+      break;
+    }
+  Atomic_Add(&q->nwait_pop,(size_t)-1);
+  Mutex_Unlock(&q->lock);
+}
+
+unsigned int Chan_Wait_Any( Chan **readers, size_t n, unsigned timeout_ms, size_t *ready )
+{ chan_waiter_t w;
+  size_t k,nreg,ndone,
+         start = n?(*ready+1)%n:0; // so a busy reader can't starve the others
+  int ok=1,sts=0;
+  double t0 = Clock_Seconds(), // the timeout covers every pass, not each one
+         elapsed_ms;
+  return_val_if(n==0,FAILURE);
+  w.lock = MUTEX_INITIALIZER_INSTANCE;
+  Condition_Initialize(&w.cv);
+  while(1)
+  { w.signaled = 0;
+    for(ndone=nreg=0;nreg<n;)
+    { sts = chan_waiter_add((chan_t*)readers[(start+nreg++)%n],&w);
+      if(sts==1) break;
+      if(sts==2) ++ndone;
+    }
+    if(sts!=1 && ndone<n)
+    { Mutex_Lock(&w.lock);
+      while(ok && !w.signaled)
+      { if(timeout_ms==(unsigned)-1)
+        { Condition_Wait(&w.cv,&w.lock);
+          continue;
+        }
+        elapsed_ms = 1000.0*(Clock_Seconds()-t0);
+        if(elapsed_ms>=timeout_ms)
+          ok = 0;
+        else
+          Condition_Timed_Wait(&w.cv,&w.lock,(unsigned)(timeout_ms-elapsed_ms));
+      }
+      Mutex_Unlock(&w.lock);
+    }
+    for(k=0;k<nreg;++k)
+      chan_waiter_remove((chan_t*)readers[(start+k)%n],&w);
+    if(sts==1)
+    { *ready = (start+nreg-1)%n;
+      return SUCCESS;
+    }
+    if(!ok || ndone==n)
+      return FAILURE; // timeout, or nothing left to read
+  }
+}
 
 // ----
 // Peek
@@ -468,6 +1180,87 @@ unsigned int Chan_Peek_Timed ( Chan *self_, void **pbuf, size_t sz, unsigned tim
   return chan_peek(self,pbuf,sz,timeout_ms);
 }
 
+// ------
+// Borrow
+// ------
+
+unsigned int Chan_Peek_Borrow( Chan *self_, void **pbuf, unsigned timeout_ms )
+{ __chan_t *q = ((chan_t*)self_)->q;
+  int ok=1;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q); // the reader could otherwise pop the newest buffer while we pin it
+  if(!q->pinned)
+  { Atomic_Add(&q->nwait_pop,1);
+    Atomic_Add(&q->nwait_peek,1);
+    while(ok && Fifo_Is_Empty(q->fifo) && !_peek_bypass_wait(q) && !q->pinned)
+      ok=chan_wait__locked(q,&q->notempty,timeout_ms,&q->stats.pop_blocked_s);
+    Atomic_Add(&q->nwait_peek,(size_t)-1);
+    Atomic_Add(&q->nwait_pop,(size_t)-1);
+    if(!q->pinned)
+      q->pinned = Fifo_Newest(q->fifo);
+    goto_if_not(q->pinned,NoBorrow);
+  }
+  ++q->nborrows;
+  *pbuf = q->pinned;
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
+  return SUCCESS;
+NoBorrow:
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
+  return FAILURE;
+}
+
+unsigned int Chan_Next_Borrow( Chan *self_, void **pbuf, unsigned timeout_ms )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t  *q = self->q;
+  unsigned int sts;
+  Chan_Assert(self->mode==CHAN_READ && !self->held);
+  if(!q->broadcast) // pop into a buffer this reference keeps
+  { if(!self->token)
+      self->token = Fifo_Alloc_Token_Buffer(q->fifo);
+    if(CHAN_FAILURE(chan_pop(self,&self->token,Chan_Buffer_Size_Bytes(self_),0,timeout_ms)))
+      return FAILURE;
+    *pbuf = self->held = self->token;
+    return SUCCESS;
+  }
+  Mutex_Lock(&q->lock);
+  if(CHAN_SUCCESS(sts=chan_bcast_next__locked(self,pbuf,timeout_ms)))
+  { self->held = *pbuf;
+    ++q->nheld;
+    ++q->stats.npop;
+  } else if(timeout_ms==0)
+    ++q->stats.ntry_pop_fail;
+  Mutex_Unlock(&q->lock);
+  return sts;
+}
+
+void Chan_Release( Chan *self_, void *buf )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t  *q = self->q;
+  if(self->held && buf==self->held) // from Chan_Next_Borrow()
+  { self->held = NULL;
+    if(!q->broadcast)
+      return;
+    Mutex_Lock(&q->lock);
+    --q->nheld;
+    chan_bcast_trim__locked(q);
+    Mutex_Unlock(&q->lock);
+    return;
+  }
+  Mutex_Lock(&q->lock);
+  Chan_Assert(buf && buf==q->pinned && q->nborrows>0);
+  if(--q->nborrows==0)
+  { if(q->detached) // keep it around for the next unpin
+    { Fifo_Free_Token_Buffer(q->spare);
+      q->spare    = q->pinned;
+      q->detached = 0;
+    }
+    q->pinned = NULL;
+    Condition_Notify_All(&q->notfull); // resizes wait on borrows
+  }
+  Mutex_Unlock(&q->lock);
+}
 
 // -----------------
 // Memory management
@@ -482,8 +1275,13 @@ int Chan_Is_Empty( Chan *self )
 { return Fifo_Is_Empty( FIFO(self) );
 }
 
-inline void Chan_Resize( Chan* self, size_t nbytes)
-{ Fifo_Resize( FIFO(self),nbytes );
+void Chan_Resize( Chan* self, size_t nbytes)
+{ __chan_t *q = ((chan_t*)self)->q;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q); // reallocs every buffer in the ring
+  chan_resize__locked(q,nbytes);
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
 }
 
 
@@ -503,6 +1301,10 @@ void Chan_Token_Buffer_Free( void *buf )
 { Fifo_Free_Token_Buffer(buf);
 }
 
+void* Chan_Token_Buffer_Realloc( void *buf, size_t nbytes )
+{ return Fifo_Realloc_Token_Buffer(buf,nbytes);
+}
+
 inline
 size_t Chan_Buffer_Size_Bytes( Chan *self )
 { return Fifo_Buffer_Size_Bytes(FIFO(self));
@@ -513,6 +1315,45 @@ size_t Chan_Buffer_Count( Chan *self )
 { return Fifo_Buffer_Count(FIFO(self));
 } 
 
+// ----------
+// Statistics
+// ----------
+
+void Chan_Get_Stats( Chan *self, ChanStats *stats )
+{ __chan_t *q = ((chan_t*)self)->q;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q); // waits out any lock-free push/pop so the counters agree with each other
+  *stats = q->stats;
+  stats->occupancy = Fifo_Count(q->fifo);
+  stats->capacity  = Fifo_Buffer_Count(q->fifo);
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
+}
+
+char* Chan_Format_Stats( Chan *self, char *buf, size_t n )
+{ ChanStats s;
+  Chan_Get_Stats(self,&s);
+  snprintf(buf,n,
+           "\tQueue: %u of %u buffers in use (peak %u)."ENDL
+           "\t%u pushed, %u popped, %u failed pushes."ENDL
+           "\tReader waited %.3f s.  Writer waited %.3f s."ENDL,
+           (unsigned)s.occupancy,(unsigned)s.capacity,(unsigned)s.peak_occupancy,
+           (unsigned)s.npush,(unsigned)s.npop,(unsigned)s.ntry_push_fail,
+           s.pop_blocked_s,s.push_blocked_s);
+  if(n)
+    buf[n-1]='\0'; // _snprintf doesn't always terminate
+  return buf;
+}
+
+void Chan_Reset_Stats( Chan *self )
+{ __chan_t *q = ((chan_t*)self)->q;
+  Mutex_Lock(&q->lock);
+  chan_fast_disable__locked(q); // the lock-free path writes the counters too
+  memset(&q->stats,0,sizeof(q->stats));
+  chan_fast_update__locked(q);
+  Mutex_Unlock(&q->lock);
+}
+
 inline Chan* Chan_Id( Chan *self )
 { return ((chan_t*)self)->q;
 }
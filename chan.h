@@ -99,7 +99,10 @@ typedef enum _chan_mode
   CHAN_MODE_MAX,
 } ChanMode;
 
+typedef struct _chan_allocator ChanAllocator;
+
        Chan  *Chan_Alloc      ( size_t buffer_count, size_t buffer_size_bytes);
+       Chan  *Chan_Alloc_With ( size_t buffer_count, size_t buffer_size_bytes, const ChanAllocator *allocator); ///< See \ref mem.  allocator==NULL is the same as Chan_Alloc().
 extern Chan  *Chan_Alloc_Copy ( Chan *chan);
        Chan  *Chan_Open       ( Chan *self, ChanMode mode);                                   // does ref counting and access type
        int    Chan_Close      ( Chan *self);                                                  // does ref counting
@@ -110,7 +113,9 @@ unsigned Chan_Get_Ref_Count         ( Chan* self);
 void     Chan_Wait_For_Ref_Count    ( Chan* self, size_t n);
 void     Chan_Wait_For_Writer_Count ( Chan* self,size_t n);
 void     Chan_Wait_For_Have_Reader  ( Chan* self);
-void     Chan_Set_Expand_On_Full    ( Chan* self, int  expand_on_full);                           // default: no expand
+void     Chan_Set_Expand_On_Full    ( Chan* self, int  expand_on_full);                           // default: no expand.  Buffers for the next expansion get allocated outside the lock.
+void     Chan_Set_Overwrite_On_Full ( Chan* self, int  overwrite_on_full);                        // default: no overwrite.  See \ref lossy.
+void     Chan_Set_Broadcast         ( Chan* self, int  broadcast);                                // default: readers split messages.  See \ref broadcast.
 
 /** \file
     \section next Next Functions
@@ -126,11 +131,36 @@ void     Chan_Set_Expand_On_Full    ( Chan* self, int  expand_on_full);
     \verbatim
       *    Overflow                       Underflow
     =====  ============================   ===================
-    -      Waits or expands.              Fails if no sources, otherwise waits.
-    Copy   Waits or expands.              Fails if no sources, otherwise waits.
-    Try    Fails immediately              Fails immediately.
+    -      Waits, expands or overwrites.  Fails if no sources, otherwise waits.
+    Copy   Waits, expands or overwrites.  Fails if no sources, otherwise waits.
+    Try    Fails or overwrites.           Fails immediately.
     Timed  Waits.  Fails after timeout.   Fails immediately if no sources, otherwise waits till timeout.
     \endverbatim
+
+    \subsection lossy Lossy queues
+
+    By default a full queue makes writers wait, so a slow reader eventually
+    stalls everything upstream of it.  That's right for data on its way to
+    disk, but not for taps that only feed a display or a monitor.  After
+    Chan_Set_Overwrite_On_Full(), a push to a full queue drops the oldest
+    message instead of waiting.  Readers always see the newest messages.
+    Drops are counted in ChanStats::ndropped.
+
+    Expand-on-full takes precedence if both are set.  Lossy queues don't
+    use the lock-free single-reader/single-writer path.
+
+    \subsection batch Batches
+
+    Chan_Next_N() and Chan_Next_Copy_N() move up to <n> messages while
+    holding the lock once, and wake the other side once.  That's what
+    matters for small, frequent messages like per-line metadata, where
+    locking costs more than the copy.  They wait (like Chan_Next()) only
+    for the first message.  After that, they stop early if the queue fills
+    up (or runs dry).  <nmoved> gets the number actually moved.  They fail
+    only when nothing moved.
+
+    Chan_Next_N() takes an array of <n> token buffers.  Chan_Next_Copy_N()
+    takes <n> messages of <sz> bytes each, laid end to end.
 */
 
 unsigned int Chan_Next         ( Chan *self,  void **pbuf, size_t sz); ///< Push or pop next item.  May block the calling thread.
@@ -138,6 +168,33 @@ unsigned int Chan_Next_Copy    ( Chan *self,  void  *buf,  size_t sz); ///< Push
 unsigned int Chan_Next_Try     ( Chan *self,  void **pbuf, size_t sz); ///< Push (or pop), but never block.  If the queue is full (or empty) immediately return failure.
 unsigned int Chan_Next_Copy_Try( Chan *self_, void  *buf,  size_t sz); ///< Same as Chan_Next_Try(), but pushes or pops a copy.  Will not block.
 unsigned int Chan_Next_Timed   ( Chan *self,  void **pbuf, size_t sz,   unsigned timeout_ms); ///< Just like Chan_Next(), but any waiting is limited by the timeout.
+unsigned int Chan_Next_N       ( Chan *self,  void **pbufs, size_t n, size_t sz, size_t *nmoved); ///< Push or pop up to n items under one lock.  See \ref batch.
+unsigned int Chan_Next_Copy_N  ( Chan *self,  void  *bufs,  size_t n, size_t sz, size_t *nmoved); ///< Push or pop copies of up to n items.  See \ref batch.
+
+/** \file
+    \section wait Waiting on several queues
+
+    Chan_Wait_Any() waits till one of several read-mode references has a
+    message, so a thread with many inputs can take messages as they arrive
+    instead of blocking on each input in turn:
+    \code
+    { size_t i=0;
+      void *msg;
+      while( CHAN_SUCCESS( Chan_Wait_Any(inputs,n,(unsigned)-1,&i) ))
+        if( CHAN_SUCCESS( Chan_Next_Borrow(inputs[i],&msg,0) ))
+        { dosomething(i,msg);
+          Chan_Release(inputs[i],msg);
+        }
+    }
+    \endcode
+    \a ready is in/out.  The search starts after the reader it names, so one
+    busy input can't starve the others; start it at 0.
+    Chan_Wait_Any() fails on timeout or once every input is drained and has
+    no writers left (i.e. every Chan_Next() would fail).  If other readers
+    share a queue, they may take the message first, so follow up with one
+    of the non-blocking reads as above.
+*/
+unsigned int Chan_Wait_Any   ( Chan **readers, size_t n, unsigned timeout_ms, size_t *ready); ///< On success, *ready is the index of a reader with a message.
 
 /** \file
     \section peek Peek Functions
@@ -155,6 +212,67 @@ unsigned int Chan_Peek       ( Chan *self, void **pbuf, size_t sz);
 unsigned int Chan_Peek_Try   ( Chan *self, void **pbuf, size_t sz);
 unsigned int Chan_Peek_Timed ( Chan *self, void **pbuf, size_t sz, unsigned timeout_ms);
 
+/** \file
+    \section borrow Borrowing
+
+    Chan_Peek() copies a whole message.  For big frames that are only going
+    to be looked at (e.g. for display), Chan_Peek_Borrow() hands out the
+    newest message on the queue in place instead.  The buffer is pinned till
+    every borrow of it is returned with Chan_Release():
+
+    \code
+    { void *frame;
+      if(CHAN_SUCCESS( Chan_Peek_Borrow(q,&frame,10) ))
+      { show(frame);            // read only!
+        Chan_Release(q,frame);
+      }
+    }
+    \endcode
+
+    Borrowing doesn't slow down the writers.  If a reader pops a pinned
+    buffer, the reader gets a copy and the original is kept aside till it's
+    released, so that copy is the only one made.  Chan_Resize() and pushes
+    that have to resize the queue wait for outstanding borrows, so don't
+    resize a queue while holding a borrow on it.
+
+    While a borrow is outstanding, further borrows share the same buffer
+    even if newer messages have arrived.  Borrows should be short.
+*/
+unsigned int Chan_Peek_Borrow( Chan *self, void **pbuf, unsigned timeout_ms); ///< Borrow the newest message.  Waits till the timeout if the queue is empty.  *pbuf must not be written.
+unsigned int Chan_Next_Borrow( Chan *self, void **pbuf, unsigned timeout_ms); ///< Read-mode only.  Borrow the next message.  Like Chan_Next_Timed().  See \ref broadcast.
+void         Chan_Release    ( Chan *self, void  *buf);                       ///< Return a buffer from Chan_Peek_Borrow() or Chan_Next_Borrow().
+
+/** \file
+    \section broadcast Broadcast
+
+    Normally readers of a \ref Chan split the messages between them; each
+    message goes to one reader.  After Chan_Set_Broadcast(), every reader
+    gets every message.  Each reader has its own place in the queue and a
+    buffer is recycled only after every reader has read and released it.
+    The slowest reader sets the pace for the writers, unless the queue is
+    also set to overwrite on full (\ref lossy), in which case readers that
+    fall behind skip messages.  A message a reader is holding is never
+    overwritten.
+
+    Readers share the queue's buffers, so the zero-copy way to read is:
+    \code
+    { void *frame;
+      Chan *input = Chan_Open(q,CHAN_READ);
+      while( CHAN_SUCCESS( Chan_Next_Borrow(input,&frame,(unsigned)-1) ))
+      { dosomething(frame);     // read only!
+        Chan_Release(input,frame);
+      }
+      Chan_Close(input);
+    }
+    \endcode
+    Chan_Next_Borrow() also works on normal queues, so a reader written
+    this way doesn't have to care.  Chan_Next() and friends still work on
+    broadcast readers but they copy.
+
+    A reader opened after messages were pushed starts with the oldest message
+    still on the queue.  Set broadcast mode before the queue is in use.
+*/
+
 /** \file
     \section mem Memory management
 
@@ -180,8 +298,29 @@ unsigned int Chan_Peek_Timed ( Chan *self, void **pbuf, size_t sz, unsigned time
       if(data) Chan_Token_Buffer_Free(data);  // remember to free the data!
     }
     \endcode
-    
+
+    \subsection alloc Allocators
+
+    By default, buffers come from malloc().  Chan_Alloc_With() takes a
+    \ref ChanAllocator that can ask for aligned buffers (64 bytes for vector
+    loads, 4 KiB pages or 2 MiB huge pages), huge-page backing, buffers
+    pinned in memory, and pre-faulting so the first frames of an acquisition
+    don't stall on page faults.  \c reserve_bytes sets aside address space
+    for each buffer so Chan_Resize() can grow buffers in place.
+
+    Buffers travel between queues, so anything that might hold a queue's
+    buffer must release it with Chan_Token_Buffer_Free() and resize it with
+    Chan_Token_Buffer_Realloc(), never free() or realloc().
 */ 
+struct _chan_allocator
+{ size_t   alignment;      ///< bytes, a power of two.  0 leaves it up to malloc().
+  size_t   reserve_bytes;  ///< address space reserved per buffer for growing in place.  0 for none.
+  unsigned flags;          ///< CHAN_ALLOC_* flags
+};
+
+#define CHAN_ALLOC_HUGE_PAGES (1) ///< Use huge (large) pages when the OS allows it.  Otherwise falls back to normal pages.
+#define CHAN_ALLOC_LOCK       (2) ///< Pin buffers in physical memory.
+#define CHAN_ALLOC_PREFAULT   (4) ///< Touch every page when a buffer is allocated.
 
 int         Chan_Is_Full                    ( Chan *self);
 int         Chan_Is_Empty                   ( Chan *self);
@@ -190,9 +329,47 @@ extern void Chan_Resize                     ( Chan *self, size_t nbytes);
 void*       Chan_Token_Buffer_Alloc         ( Chan *self);
 void*       Chan_Token_Buffer_Alloc_And_Copy( Chan *self, void *src);
 void        Chan_Token_Buffer_Free          ( void *buf );
+void*       Chan_Token_Buffer_Realloc       ( void *buf, size_t nbytes);   ///< Keeps the buffer's allocator.  \returns NULL on failure.
 extern size_t Chan_Buffer_Size_Bytes        ( Chan *self);
 extern size_t Chan_Buffer_Count             ( Chan *self);
 
+/** \file
+    \section stats Statistics
+
+    Each queue keeps a few counters that are useful for sizing queues and
+    for finding the slow stage in a network of threads.  A stage whose input
+    queue sits near \c capacity while its writers accumulate blocked time
+    is the bottleneck.
+
+    Counters are shared by all references to the same queue.  They are
+    cumulative since Chan_Alloc() or the last Chan_Reset_Stats().
+    Chan_Get_Stats() may be called at any time.  It briefly takes the
+    queue's lock, so the counters in one snapshot are consistent with each
+    other.
+
+    Chan_Format_Stats() writes a short report to \a buf (up to \a n bytes)
+    and returns \a buf.  It's meant for logging when a push fails.  If the
+    queue is full but its reader has hardly waited, the bottleneck is the
+    next stage downstream.
+*/
+typedef struct _chan_stats
+{ size_t npush;             ///< successful pushes
+  size_t npop;              ///< successful pops
+  size_t ntry_push_fail;    ///< Chan_Next_Try() or Chan_Next_Copy_Try() pushes that failed because the queue was full
+  size_t ntry_pop_fail;     ///< Chan_Next_Try() or Chan_Next_Copy_Try() pops that failed because the queue was empty
+  size_t occupancy;         ///< messages on the queue when the snapshot was taken
+  size_t peak_occupancy;    ///< largest occupancy seen after a push
+  size_t capacity;          ///< Chan_Buffer_Count() when the snapshot was taken
+  double push_blocked_s;    ///< total time writers spent waiting on a full queue (seconds)
+  double pop_blocked_s;     ///< total time readers and peekers spent waiting on an empty queue (seconds)
+  size_t nborrow_copies;    ///< pops that got a copy because the buffer was borrowed.  See Chan_Peek_Borrow().
+  size_t ndropped;          ///< messages overwritten by pushes to a full queue.  See Chan_Set_Overwrite_On_Full().
+} ChanStats;
+
+void        Chan_Get_Stats                  ( Chan *self, ChanStats *stats);
+void        Chan_Reset_Stats                ( Chan *self);
+char*       Chan_Format_Stats               ( Chan *self, char *buf, size_t n);
+
 
 #define CHAN_SUCCESS(expr) ((expr)==0)
 #define CHAN_FAILURE(expr) (!CHAN_SUCCESS(expr))
@@ -257,6 +257,8 @@ ESCAN:
     {
       scanner._set_config(cfg->mutable_scanner3d());
       pipeline._set_config(cfg->mutable_pipeline());
+      trip_detect._set_config(cfg->mutable_trip_detect());
+      surface_finder._set_config(cfg->mutable_surface_find());
       vibratome_._set_config(cfg->mutable_vibratome());
       fov_.update(_config->fov());
       surface_probe_._set_config(cfg->mutable_surface_probe());
@@ -265,6 +267,10 @@ ESCAN:
 
       pipeline.set_scan_rate_Hz(_config->scanner3d().scanner2d().frequency_hz());
       pipeline.set_sample_rate_MHz(scanner.get2d()->_digitizer.sample_rate_MHz());
+
+      // workers that read config snapshots per frame
+      trip_detect.publish_config();
+      surface_finder.publish_config();
     }
 
     void Microscope::_set_config( const Config& cfg )
@@ -297,7 +303,13 @@ ESCAN:
       IDevice *cur;
       cur = &scanner;
       cur =  pipeline.apply(cur);
-      cur =  trip_detect.apply(cur);
+      // One trip detector can look at frames as they leave the pipeline
+      // without being a stage.  Replicas need a stage of their own.
+      if(trip_detect.replicas()>1)
+      { pipeline.unobserve(&trip_detect);
+        cur =  trip_detect.apply(cur);
+      } else
+        pipeline.observe(&trip_detect,0,IDevice::OBSERVE_THREAD);
       _end_of_pipeline=cur;
       return cur;
     }
@@ -339,7 +351,8 @@ ESCAN:
     { int sts = 1;
       transaction_lock();
       sts &= pipeline._agent->run();
-      sts &= trip_detect._agent->run();
+      if(_end_of_pipeline==&trip_detect)
+        sts &= trip_detect._agent->run();
       transaction_unlock();
       return (sts!=1); // returns 1 on fail and 0 on success
     }
@@ -348,7 +361,8 @@ ESCAN:
     { int sts = 1;
       transaction_lock();
       sts &= pipeline._agent->stop();
-      sts &= trip_detect._agent->stop();
+      if(_end_of_pipeline==&trip_detect)
+        sts &= trip_detect._agent->stop();
       transaction_unlock();
       return (sts!=1); // returns 1 on fail and 0 on success
     }
@@ -110,7 +110,7 @@ namespace fetch
           if(n)
             memcpy(nbytes+1,sizes,sizeof(size_t)*n);
 
-          _alloc_qs(&_out,nout,nbuf,nbytes);
+          _alloc_qs(&_out,nout,nbuf,nbytes,&FRAME_QUEUE_ALLOCATOR);
 
           if(sizes)  free(sizes);
           if(nbytes) free(nbytes);
@@ -1,7 +1,14 @@
 #include "fifo.h"
+#include "thread.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 //////////////////////////////////////////////////////////////////////
 //  Logging    ///////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
@@ -45,6 +52,9 @@ void fifo_breakme() {}
 #define IS_POW2_OR_ZERO(v) ( ((v) & ((v) - 1)) ==  0  )
 #define IS_POW2(v)         (!((v) & ((v) - 1)) && (v) )
 #define MOD_UNSIGNED_POW2(n,d)   ( (n) & ((d)-1) )
+#define ALIGN_UP(n,a)            ( ((n)+(a)-1) & ~((size_t)(a)-1) )
+#define MIN(a,b)                 (((a)<(b))?(a):(b))
+#define MAX(a,b)                 (((a)<(b))?(b):(a))
 
 void *Fifo_Malloc( size_t nelem, const char *msg )
 { void *item = malloc( nelem );
@@ -173,6 +183,239 @@ void vector_PVOID_dump( vector_PVOID *self, char* filename )
   fifo_warning("Wrote %s\r\n",filename);                              
 }
 
+//////////////////////////////////////////////////////////////////////
+//  Buffers    ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+//
+// Every token buffer carries a header (a block_t) just in front of the
+// address handed out, recording how it was allocated.  That's all
+// Fifo_Free_Token_Buffer() and friends need to release or grow it, so
+// there's no shared table and no lock.  Aligned buffers keep the header in
+// the padding in front of the data, so the data stays exactly aligned.
+
+#define MALLOC_ALIGNMENT (2*sizeof(void*))   // what malloc() already guarantees
+#define HUGE_PAGE_BYTES  ((size_t)2<<20)
+#define BLOCK_MAGIC      ((size_t)0xF1F0B10Cu)
+
+typedef struct _block
+{ size_t        magic;     // BLOCK_MAGIC.  Catches buffers that didn't come from a Fifo.
+  void         *base;      // address to hand back to free() or the OS
+  size_t        nbytes;    // usable bytes at the data
+  size_t        reserved;  // bytes at the data that can be used without moving.  Mapped blocks only.
+  size_t        mapped;    // bytes mapped at base.  0 for heap blocks.
+  int           large;     // win32 large pages: committed all at once
+  FifoAllocator allocator; // all zero for plain malloc()
+} block_t;
+
+#define BLOCK_HEADER_BYTES ALIGN_UP(sizeof(block_t),MALLOC_ALIGNMENT)
+#define BLOCK_DATA(b)      ((char*)(b)+BLOCK_HEADER_BYTES)
+
+static int block_is_plain(const FifoAllocator *a)
+{ return !a || (a->alignment<=MALLOC_ALIGNMENT && a->reserve_bytes==0 && a->flags==0);
+}
+
+static size_t block_alignment(const FifoAllocator *a)
+{ return (a && a->alignment>MALLOC_ALIGNMENT)?a->alignment:MALLOC_ALIGNMENT;
+}
+
+static block_t* block_of(void *data)
+{ block_t *b = (block_t*)((char*)data-BLOCK_HEADER_BYTES);
+  if(b->magic!=BLOCK_MAGIC)
+    fifo_error("Not a Fifo token buffer: %p\n",data);
+  return b;
+}
+
+static size_t os_page_size(void)
+{ static size_t page = 0;
+  if(!page)
+  {
+#ifdef _MSC_VER
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    page = info.dwPageSize;
+#else
+    page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+  }
+  return page;
+}
+
+// Makes data[beg,end) usable: commits, pins and pre-faults as requested.
+static void block_touch(block_t *b, size_t beg, size_t end)
+{ static int warned = 0;
+  char  *data = BLOCK_DATA(b);
+  size_t i, page = os_page_size();
+  if(end<=beg) return;
+#ifdef _MSC_VER
+  if(b->mapped && !b->large)
+    if(!VirtualAlloc(data+beg,end-beg,MEM_COMMIT,PAGE_READWRITE))
+      fifo_error("Could not commit memory.\n\tFifo buffer (%u bytes)\n",(unsigned)(end-beg));
+#endif
+  if(b->allocator.flags&FIFO_ALLOC_PREFAULT)
+    for(i=beg;i<end;i+=page)
+      ((volatile char*)data)[i] = 0;
+  if(b->allocator.flags&FIFO_ALLOC_LOCK)
+  {
+#ifdef _MSC_VER
+    if(!VirtualLock(data+beg,end-beg) && !warned)
+#else
+    if(mlock(data+beg,end-beg) && !warned)
+#endif
+    { warned = 1;
+      fifo_warning("Warning: Could not lock Fifo buffers in memory.  Check the locked memory limit.\n");
+    }
+  }
+}
+
+/** Maps a block.  The data starts \c lead bytes past a page (or huge page)
+    boundary, which leaves room for the header on the same page as the
+    first bytes of data.  Fills in \a b.
+    \returns the data, or NULL on failure.
+*/
+static char* block_map(block_t *b, size_t align, size_t nbytes)
+{ size_t page = os_page_size(),
+         unit = page,
+         lead = ALIGN_UP(BLOCK_HEADER_BYTES,align),
+         want = MAX(MAX(nbytes,b->allocator.reserve_bytes),1),
+         start,span;
+  int    huge = (b->allocator.flags&FIFO_ALLOC_HUGE_PAGES)!=0;
+  char  *data;
+  if(huge) unit = HUGE_PAGE_BYTES;
+  start = MAX(align,unit);                     // alignment of the mapping
+  span  = ALIGN_UP(lead+want,unit);
+  b->mapped = span + ((start>page)?start:0);
+#ifdef _MSC_VER
+  if(huge)
+  { size_t large = GetLargePageMinimum();
+    if(large)                                      // large pages can't be reserved and committed separately
+    { size_t n = ALIGN_UP(lead+want,large);
+      if(b->base=VirtualAlloc(NULL,n,MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES,PAGE_READWRITE))
+      { b->mapped   = n;
+        b->large    = 1;
+        b->reserved = n-lead;
+        return (char*)b->base+lead;
+      }                                            // usually missing SeLockMemoryPrivilege.  Fall back.
+    }
+  }
+  if(!(b->base=VirtualAlloc(NULL,b->mapped,MEM_RESERVE,PAGE_READWRITE)))
+    return NULL;
+  data = (char*)ALIGN_UP((size_t)b->base,start)+lead;
+  if(!VirtualAlloc(data-BLOCK_HEADER_BYTES,BLOCK_HEADER_BYTES,MEM_COMMIT,PAGE_READWRITE))
+  { VirtualFree(b->base,0,MEM_RELEASE);
+    return NULL;
+  }
+#else
+  b->base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if(huge)
+    b->base = mmap(NULL,b->mapped,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0); // reserves up front.  Without that a fault can SIGBUS.
+#endif
+  if(b->base==MAP_FAILED)                          // no hugetlbfs pages configured.  Fall back.
+  { b->base = mmap(NULL,b->mapped,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(b->base==MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if(huge)
+      madvise(b->base,b->mapped,MADV_HUGEPAGE);    // transparent huge pages
+#endif
+  }
+  data = (char*)ALIGN_UP((size_t)b->base,start)+lead;
+#endif
+  b->reserved = span-lead;
+  return data;
+}
+
+static void block_release(block_t *h)
+{ block_t b = *h; // h lives inside the block
+  if(b.mapped)
+  {
+#ifdef _MSC_VER
+    VirtualFree(b.base,0,MEM_RELEASE);
+#else
+    munmap(b.base,b.mapped);
+#endif
+  } else
+  { if(b.allocator.flags&FIFO_ALLOC_LOCK)
+#ifdef _MSC_VER
+      VirtualUnlock(BLOCK_DATA(h),b.nbytes);
+#else
+      munlock(BLOCK_DATA(h),b.nbytes);
+#endif
+    free(b.base);
+  }
+}
+
+/** \returns NULL on failure. */
+static void* block_alloc(const FifoAllocator *a, size_t nbytes)
+{ block_t b, *h;
+  char *data;
+  size_t align = block_alignment(a);
+  memset(&b,0,sizeof(b));
+  b.magic = BLOCK_MAGIC;
+  if(a) b.allocator = *a;
+  if(block_is_plain(a))
+  { if(!(b.base=malloc(BLOCK_HEADER_BYTES+nbytes)))
+      return NULL;
+    data = (char*)b.base+BLOCK_HEADER_BYTES;
+  } else if(align>=os_page_size() || a->reserve_bytes || (a->flags&FIFO_ALLOC_HUGE_PAGES))
+  { if(!(data=block_map(&b,align,nbytes)))
+      return NULL;
+  } else
+  { if(!(b.base=malloc(BLOCK_HEADER_BYTES+nbytes+align-1)))
+      return NULL;
+    data = (char*)ALIGN_UP((size_t)b.base+BLOCK_HEADER_BYTES,align);
+  }
+  b.nbytes = nbytes;
+  h = (block_t*)(data-BLOCK_HEADER_BYTES);
+  *h = b;
+  block_touch(h,0,nbytes);
+  return data;
+}
+
+/** Grows (or shrinks) \a buf to \a nbytes, preserving contents.
+
+    Mapped buffers grow in place when they have the reserve for it.
+    Otherwise the new buffer comes from \a a, or from \a buf's own allocator
+    when \a a is NULL.
+
+    \returns NULL on failure, in which case \a buf is untouched.
+*/
+static void* block_realloc(const FifoAllocator *a, void *buf, size_t nbytes)
+{ block_t *h;
+  void *out;
+  if(!buf)
+    return block_alloc(a,nbytes);
+  h = block_of(buf);
+  if(!a) a = &h->allocator;
+  if(block_is_plain(a) && block_is_plain(&h->allocator))
+  { block_t *t = (block_t*)realloc(h->base,BLOCK_HEADER_BYTES+nbytes);
+    if(!t)
+      return NULL;
+    t->base   = t;
+    t->nbytes = nbytes;
+    return BLOCK_DATA(t);
+  }
+  if(h->mapped && nbytes<=h->reserved && MOD_UNSIGNED_POW2((size_t)buf,block_alignment(a))==0)
+  { block_touch(h,h->nbytes,nbytes);
+    h->nbytes = nbytes;
+    return buf;
+  }
+  if(!(out=block_alloc(a,nbytes)))
+    return NULL;
+  memcpy(out,buf,MIN(h->nbytes,nbytes));
+  block_release(h);
+  return out;
+}
+
+void* Fifo_Realloc_Token_Buffer(void *buf, size_t nbytes)
+{ return block_realloc(NULL,buf,nbytes);
+}
+
+void Fifo_Free_Token_Buffer(void *buf)
+{ if(buf)
+    block_release(block_of(buf));
+}
+
 //////////////////////////////////////////////////////////////////////
 //  Fifo   ///////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
@@ -182,26 +425,64 @@ typedef struct _ring_fifo
   size_t        tail; // read  cursor
 
   size_t        buffer_size_bytes;
+  FifoAllocator allocator; // all zero for plain malloc()
+  vector_PVOID  spares;    // buffers for the next Fifo_Expand().  See Fifo_Add_Spare().
 } Fifo_;
 
+static void *fifo_buffer_alloc( Fifo_ *self, const char *msg )
+{ void *buf = block_alloc( &self->allocator, self->buffer_size_bytes );
+  if( !buf )
+    fifo_error("Could not allocate memory.\n%s\n",msg);
+  return buf;
+}
+
+// Swapping a buffer on to the queue: make sure it's big enough and meets the
+// allocator's alignment.
+//   small arg - police  - resize to larger before swap
+//   null  arg -         - also handled by this mechanism
+//   big   arg - ignored
+#define FIFO_POLICE(self,pbuf,sz) \
+  ( (sz)<(self)->buffer_size_bytes || MOD_UNSIGNED_POW2((size_t)*(pbuf),block_alignment(&(self)->allocator)) )
+
+static void fifo_police( Fifo_ *self, void **pbuf, size_t sz )
+{ void *t = block_realloc( &self->allocator, *pbuf, MAX(sz,self->buffer_size_bytes) );
+  if( !t )
+    fifo_error("Could not reallocate memory.\n%s\n","Fifo: resizing token buffer");
+  *pbuf = t;
+}
+
+void
+Fifo_Get_Allocator( Fifo *self_, FifoAllocator *out )
+{ *out = ((Fifo_*)self_)->allocator;
+}
+
 Fifo*
 Fifo_Alloc(size_t buffer_count, size_t buffer_size_bytes )
+{ return Fifo_Alloc_With(buffer_count,buffer_size_bytes,NULL);
+}
+
+Fifo*
+Fifo_Alloc_With(size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator )
 { Fifo_ *self;
   
   Fifo_Assert( IS_POW2( buffer_count ) );
   return_val_if(!IS_POW2(buffer_count),NULL);
+  Fifo_Assert( !allocator || IS_POW2_OR_ZERO( allocator->alignment ) );
 
   self = (Fifo_ *)Fifo_Malloc( sizeof(Fifo_), "Fifo_Alloc" ); 
   self->head = 0;
   self->tail = 0;
   self->buffer_size_bytes = buffer_size_bytes;
+  if(allocator) self->allocator = *allocator;
+  else          memset(&self->allocator,0,sizeof(self->allocator));
+  memset(&self->spares,0,sizeof(self->spares));
 
   self->ring = vector_PVOID_alloc( buffer_count );
   { vector_PVOID *r = self->ring;
     PVOID *cur = r->contents + r->nelem,
           *beg = r->contents;
     while( cur-- > beg )
-      *cur = Fifo_Malloc( buffer_size_bytes, "Fifo_Alloc: Allocating buffers" );
+      *cur = fifo_buffer_alloc( self, "Fifo_Alloc: Allocating buffers" );
   }
 
 #ifdef DEBUG_RINGFIFO_ALLOC
@@ -220,13 +501,23 @@ Fifo_Free( Fifo *self_ )
     PVOID *cur = r->contents + r->nelem,
           *beg = r->contents;
     while( cur-- > beg )
-      free(*cur);
+      Fifo_Free_Token_Buffer(*cur);
     vector_PVOID_free( r );
     self->ring = NULL;    
   }
+  while( self->spares.count )
+    Fifo_Free_Token_Buffer( self->spares.contents[--self->spares.count] );
+  vector_PVOID_free_contents( &self->spares );
   free(self);	
 }
 
+// Spares were policed when they were added and by every Resize since.
+static void *fifo_spare_or_alloc( Fifo_ *self, const char *msg )
+{ if( self->spares.count )
+    return self->spares.contents[--self->spares.count];
+  return fifo_buffer_alloc( self, msg );
+}
+
 void 
 Fifo_Expand( Fifo *self_ ) 
 { Fifo_ *self = (Fifo_*)self_;
@@ -234,8 +525,7 @@ Fifo_Expand( Fifo *self_ )
   size_t old  = r->nelem,   // size of ring buffer _before_ realloc
          n,                 // delta in size (number of added elements)
          head = MOD_UNSIGNED_POW2( self->head, old ),
-         tail = MOD_UNSIGNED_POW2( self->tail, old ),
-         buffer_size_bytes = self->buffer_size_bytes;
+         tail = MOD_UNSIGNED_POW2( self->tail, old );
 
   vector_PVOID_request_pow2( r, old/*+1*/ ); // size to next pow2  
   n = r->nelem - old; // the number of slots added
@@ -266,8 +556,7 @@ Fifo_Expand( Fifo *self_ )
       cur += old;
     }
     while( cur-- > beg )
-      *cur = Fifo_Malloc( buffer_size_bytes, 
-                             "Fifo_Expand: Allocating new buffers" );
+      *cur = fifo_spare_or_alloc( self, "Fifo_Expand: Allocating new buffers" );
   }
 }
 
@@ -285,13 +574,34 @@ Fifo_Resize(Fifo* self_, size_t buffer_size_bytes)
     { size_t idx;
       void *t;
       idx = MOD_UNSIGNED_POW2(i,n);
-      Fifo_Assert(t = realloc(r->contents[idx], buffer_size_bytes));
+      Fifo_Assert(t = block_realloc(&self->allocator,r->contents[idx],buffer_size_bytes)); // in place if there's reserve
       r->contents[idx] = t;
     }
+    for(i=0;i<self->spares.count;++i)
+    { void *t;
+      Fifo_Assert(t = block_realloc(&self->allocator,self->spares.contents[i],buffer_size_bytes));
+      self->spares.contents[i] = t;
+    }
   }
   self->buffer_size_bytes = buffer_size_bytes;
 }
 
+size_t
+Fifo_Spares_Needed( Fifo *self_ )
+{ Fifo_ *self = (Fifo_*)self_;
+  size_t n = self->ring->nelem; // Expand doubles the ring
+  return (self->spares.count<n)?(n-self->spares.count):0;
+}
+
+void
+Fifo_Add_Spare( Fifo *self_, void *buf, size_t sz )
+{ Fifo_ *self = (Fifo_*)self_;
+  if( FIFO_POLICE(self,&buf,sz) )
+    fifo_police(self,&buf,sz);
+  vector_PVOID_request( &self->spares, self->spares.count );
+  self->spares.contents[self->spares.count++] = buf;
+}
+
 static inline size_t
 _swap( Fifo *self_, void **pbuf, size_t idx)
 { Fifo_ *self = (Fifo_*)self_;
@@ -311,8 +621,8 @@ Fifo_Pop( Fifo *self_, void **pbuf, size_t sz)
   fifo_debug("- head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   if( Fifo_Is_Empty(self) )
     return 1;
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-    Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  if( FIFO_POLICE(self,pbuf,sz) )
+    fifo_police(self,pbuf,sz);
   _swap( self, pbuf, self->tail++ );                        //big   arg - ignored
   return 0;
 }
@@ -323,7 +633,7 @@ Fifo_Peek( Fifo *self_, void **pbuf, size_t sz)
   fifo_debug("o head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   return_val_if( Fifo_Is_Empty(self), 1);
   if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  { Fifo_Assert(*pbuf = Fifo_Realloc_Token_Buffer(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PEEK;
   }
   
@@ -341,7 +651,7 @@ Fifo_Peek_At( Fifo *self_, void **pbuf, size_t sz, size_t index)
   fifo_debug("o head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   return_val_if( Fifo_Is_Empty(self), 1);  
   if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  { Fifo_Assert(*pbuf = Fifo_Realloc_Token_Buffer(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PEEK;
   }
     
@@ -353,6 +663,29 @@ Fifo_Peek_At( Fifo *self_, void **pbuf, size_t sz, size_t index)
   return 0;
 }
 
+void*
+Fifo_Newest( Fifo *self_ )
+{ Fifo_ *self = (Fifo_*)self_;
+  vector_PVOID *r = self->ring;
+  return_val_if( Fifo_Is_Empty(self), NULL );
+  return r->contents[MOD_UNSIGNED_POW2(self->head-1, r->nelem)];
+}
+
+void*
+Fifo_At( Fifo *self_, size_t index )
+{ Fifo_ *self = (Fifo_*)self_;
+  vector_PVOID *r = self->ring;
+  return_val_if( index>=self->head-self->tail, NULL );
+  return r->contents[MOD_UNSIGNED_POW2(self->tail+index, r->nelem)];
+}
+
+void
+Fifo_Drop( Fifo *self_, size_t n )
+{ Fifo_ *self = (Fifo_*)self_;
+  Fifo_Assert( n<=self->head-self->tail );
+  self->tail += n;
+}
+
 unsigned int
 Fifo_Push_Try( Fifo *self_, void **pbuf, size_t sz)
 { //fifo_debug("+?head: %-5d tail: %-5d size: %-5d TRY\r\n",self->head, self->tail, self->head - self->tail);
@@ -360,8 +693,8 @@ Fifo_Push_Try( Fifo *self_, void **pbuf, size_t sz)
   if( Fifo_Is_Full(self) )
     return 1;
       
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  if( FIFO_POLICE(self,pbuf,sz) )
+  { fifo_police(self,pbuf,sz);
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //big   arg - police  - resize queue storage.
   }
   if(sz>self->buffer_size_bytes)                            
@@ -380,8 +713,8 @@ Fifo_Push( Fifo *self_, void **pbuf, size_t sz, int expand_on_full)
   
   // Handle when full      
     
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  if( FIFO_POLICE(self,pbuf,sz) )
+  { fifo_police(self,pbuf,sz);
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //big   arg - police  - resize queue storage.
   }
   if(sz>self->buffer_size_bytes)                            
@@ -395,6 +728,41 @@ Fifo_Push( Fifo *self_, void **pbuf, size_t sz, int expand_on_full)
   return !expand_on_full;   // return true iff data was overwritten
 }
 
+// The producer owns head and the consumer owns tail.  Each side reads the
+// other's cursor with acquire semantics and publishes its own with release
+// semantics after the swap, so the slot contents travel with the cursor.
+unsigned int
+Fifo_Push_Try_SPSC( Fifo *self_, void **pbuf, size_t sz)
+{ Fifo_ *self = (Fifo_*)self_;
+  size_t head = self->head,
+         tail = Atomic_Load_Acquire((volatile size_t*)&self->tail);
+  if( head == tail + self->ring->nelem )                    // full
+    return 1;
+  if( sz>self->buffer_size_bytes )                          // needs a Resize - caller has to lock
+    return 1;
+  if( FIFO_POLICE(self,pbuf,sz) )
+  { fifo_police(self,pbuf,sz);
+    DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;
+  }
+  _swap( self, pbuf, head );
+  Atomic_Store_Release((volatile size_t*)&self->head,head+1);
+  return 0;
+}
+
+unsigned int
+Fifo_Pop_Try_SPSC( Fifo *self_, void **pbuf, size_t sz)
+{ Fifo_ *self = (Fifo_*)self_;
+  size_t tail = self->tail,
+         head = Atomic_Load_Acquire((volatile size_t*)&self->head);
+  if( head == tail )                                        // empty
+    return 1;
+  if( FIFO_POLICE(self,pbuf,sz) )
+    fifo_police(self,pbuf,sz);
+  _swap( self, pbuf, tail );
+  Atomic_Store_Release((volatile size_t*)&self->tail,tail+1);
+  return 0;
+}
+
 inline 
 size_t Fifo_Buffer_Size_Bytes(Fifo *self)
 { return ((Fifo_*)self)->buffer_size_bytes;
@@ -408,21 +776,33 @@ size_t Fifo_Buffer_Count(Fifo *self)
 void*
 Fifo_Alloc_Token_Buffer( Fifo *self_ )
 { Fifo_ *self = (Fifo_*)self_;
-  return Fifo_Malloc( self->buffer_size_bytes, 
-                         "Fifo_Alloc_Token_Buffer" );
+  return fifo_buffer_alloc( self, "Fifo_Alloc_Token_Buffer" );
 }
 
+// Contents are preserved, up to the new size.
 void Fifo_Resize_Token_Buffer( Fifo *self_, void **pbuf )
 { Fifo_ *self = (Fifo_*)self_;
-  Fifo_Realloc( pbuf, self->buffer_size_bytes, 
-                         "Fifo_Realloc_Token_Buffer" );
+  void *t = block_realloc( &self->allocator, *pbuf, self->buffer_size_bytes );
+  if( !t )
+    fifo_error("Could not reallocate memory.\n%s\n","Fifo_Realloc_Token_Buffer");
+  *pbuf = t;
 }
 
+// Cursors are read with acquire semantics so these are also meaningful
+// while an _SPSC push or pop is in flight on another thread.
 unsigned char Fifo_Is_Empty(Fifo *self_)
 { Fifo_ *self = (Fifo_*)self_;
-  return ( (self)->head == (self)->tail );
+  return ( Atomic_Load_Acquire((volatile size_t*)&self->head) == Atomic_Load_Acquire((volatile size_t*)&self->tail) );
 }
 unsigned char Fifo_Is_Full (Fifo *self_)
 { Fifo_ *self = (Fifo_*)self_;
-  return ( (self)->head == (self)->tail + (self)->ring->nelem );
+  return ( Atomic_Load_Acquire((volatile size_t*)&self->head) == Atomic_Load_Acquire((volatile size_t*)&self->tail) + (self)->ring->nelem );
+}
+// tail is read first so a concurrent pop can't make this underflow.
+size_t Fifo_Count(Fifo *self_)
+{ Fifo_ *self = (Fifo_*)self_;
+  size_t tail = Atomic_Load_Acquire((volatile size_t*)&self->tail),
+         head = Atomic_Load_Acquire((volatile size_t*)&self->head),
+         n    = head-tail;
+  return (n>self->ring->nelem)?self->ring->nelem:n;
 }
@@ -32,6 +32,11 @@ extern "C"{
  used by multiple threads, but synchronization is required for proper use of a
  given fifo instance.
 
+ The exception is the _SPSC pair below.  One producer thread may call
+ Push_Try_SPSC while one consumer thread calls Pop_Try_SPSC without any
+ other synchronization.  Nothing else (Resize, Expand, Peek, the locked
+ Push/Pop) may run on the same instance while either is in flight.
+
  Interface Notes
  ---------------
  Alloc
@@ -40,7 +45,16 @@ extern "C"{
 
  Expand
    Add's more buffers to the queue.  Does not resize the buffers.  Sizes the
-   queue to the next power of two.
+   queue to the next power of two.  Only the ring of pointers is copied.
+   New slots get their buffers from the spares first and only malloc what's
+   missing.
+
+ Spares_Needed
+ Add_Spare
+   Let the caller allocate the next Expand's buffers ahead of time, e.g.
+   outside whatever lock guards the fifo.  Spares_Needed says how many the
+   next Expand would still have to allocate.  Add_Spare hands one over; it
+   gets policed like a pushed buffer.  Resize resizes spares too.
 
  Resize
    Changes the size of enqueued buffers.  Operates by realloc'ing buffers in
@@ -58,25 +72,88 @@ extern "C"{
  Peek_At
    Operate by copying data out of the read point into a passed buffer.
 
+ Newest
+ At
+   Return the most recently pushed buffer (or the <index>'th buffer from the
+   read point) in place, or NULL if there isn't one.  The buffer still
+   belongs to the queue.
+
+ Drop
+   Advances the read point by <n> without handing out any buffers.  Used to
+   share a queue between several readers that each keep their own cursor.
+
+ Push_Try_SPSC
+ Pop_Try_SPSC
+   Lock-free single-producer/single-consumer versions of Push_Try and Pop.
+   Return 0 on success, 1 if the queue was full (empty).  Push_Try_SPSC
+   also returns 1 when sz is larger than the queue's buffers, since that
+   requires a Resize.
+
+ Buffer allocation
+ -----------------
+ Fifo_Alloc() gets buffers from malloc().  Fifo_Alloc_With() takes a
+ FifoAllocator describing how buffers should be allocated:
+
+   <alignment>      Power of two.  e.g. 64 for vector loads, 4096 for pages,
+                    2 MiB for huge pages.  0 leaves it up to malloc().
+   <reserve_bytes>  Address space to reserve for each buffer.  Resize grows
+                    buffers in place, without a copy, up to this size.
+   <flags>          FIFO_ALLOC_HUGE_PAGES  Back buffers with huge (large)
+                                           pages when the OS allows it.
+                    FIFO_ALLOC_LOCK        Pin buffers in physical memory.
+                    FIFO_ALLOC_PREFAULT    Touch every page at allocation so
+                                           the first push doesn't fault.
+
+ Buffers may migrate between fifos with different allocators.  Push and
+ Pop police the alignment of buffers swapped on to the queue the same way
+ they police the size.  Every token buffer carries a small header in front
+ of it that records how it was allocated, so token buffers must come from
+ Fifo_Alloc_Token_Buffer() (or Chan_Token_Buffer_Alloc()), be released with
+ Fifo_Free_Token_Buffer() and be resized with Fifo_Realloc_Token_Buffer().
+ Never pass them to free() or realloc(), or hand a Fifo a buffer from
+ malloc().  NULL is fine anywhere a buffer is swapped in.  Resizing always
+ preserves contents, up to the new size.
+
 */
 typedef void Fifo;
 
+typedef struct _fifo_allocator
+{ size_t   alignment;
+  size_t   reserve_bytes;
+  unsigned flags;
+} FifoAllocator;
+
+#define FIFO_ALLOC_HUGE_PAGES (1)
+#define FIFO_ALLOC_LOCK       (2)
+#define FIFO_ALLOC_PREFAULT   (4)
+
 Fifo*   Fifo_Alloc   ( size_t buffer_count, size_t buffer_size_bytes );
+Fifo*   Fifo_Alloc_With( size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator ); // allocator==NULL is the same as Fifo_Alloc()
+void    Fifo_Get_Allocator( Fifo *self, FifoAllocator *out );
 void    Fifo_Expand  ( Fifo *self );
+size_t  Fifo_Spares_Needed( Fifo *self );
+void    Fifo_Add_Spare( Fifo *self, void *buf, size_t sz );                // takes ownership of buf
 void    Fifo_Resize  ( Fifo *self, size_t buffer_size_bytes );
 void    Fifo_Free    ( Fifo *self );
 
 extern unsigned int Fifo_Pop       ( Fifo *self, void **pbuf, size_t sz);                    //                             *pbuf==NULL ok (allocs)
 extern unsigned int Fifo_Peek      ( Fifo *self, void **pbuf, size_t sz);                    // copies, might resize *pbuf, *pbuf==NULL ok (allocs)
 extern unsigned int Fifo_Peek_At   ( Fifo *self, void **pbuf, size_t sz, size_t index);      // copies, might resize *pbuf
+extern void*        Fifo_Newest    ( Fifo *self );                                           // no copy.  NULL if empty
+extern void*        Fifo_At        ( Fifo *self, size_t index );                             // no copy.  NULL if out of range
+extern void         Fifo_Drop      ( Fifo *self, size_t n );                                 // n must be <= Fifo_Count()
 extern unsigned int Fifo_Push      ( Fifo *self, void **pbuf, size_t sz, int expand_on_full);// might resize queue's bufs,  *pbuf==NULL ok (allocs)
 extern unsigned int Fifo_Push_Try  ( Fifo *self, void **pbuf, size_t sz);                    // might resize queue's bufs,  *pbuf==NULL ok (allocs)
+extern unsigned int Fifo_Push_Try_SPSC( Fifo *self, void **pbuf, size_t sz);                 // never resizes queue's bufs, *pbuf==NULL ok (allocs)
+extern unsigned int Fifo_Pop_Try_SPSC ( Fifo *self, void **pbuf, size_t sz);                 //                             *pbuf==NULL ok (allocs)
 
 extern size_t       Fifo_Buffer_Size_Bytes ( Fifo *self );
 extern size_t       Fifo_Buffer_Count      ( Fifo *self );
+extern size_t       Fifo_Count             ( Fifo *self );   // number of enqueued items
        void*        Fifo_Alloc_Token_Buffer( Fifo *self );
        void         Fifo_Resize_Token_Buffer( Fifo *pself, void **pbuf );
-#define Fifo_Free_Token_Buffer(e) free(e)
+       void*        Fifo_Realloc_Token_Buffer( void *buf, size_t nbytes ); // keeps buf's allocator.  buf==NULL ok (mallocs)
+       void         Fifo_Free_Token_Buffer ( void *buf );                  // buf==NULL ok
 
 extern unsigned char Fifo_Is_Empty(Fifo *self_);
 extern unsigned char Fifo_Is_Full (Fifo *self_);
@@ -22,6 +22,8 @@
 #include "devices\tiling.h"
 #include "AdaptiveTiledAcquisition.h"
 #include "CalibrationStack.h"
+#include "algo/classify.h"
+#include "util/util-mylib.h"
 
 #define CHKJMP(expr) if(!(expr)) {warning("%s(%d)"ENDL"\tExpression indicated failure:"ENDL"\t%s"ENDL,__FILE__,__LINE__,#expr); goto Error;}
 #define WARN(msg)    warning("%s(%d)"ENDL"\t%s"ENDL,__FILE__,__LINE__,msg)
@@ -109,58 +111,17 @@ Error:
 		  return (distanceFromXYCenterUm < crossSectionRadiusUm); //DGA: If the tile is within the ellipse, return true
 	  }
       ///// CLASSIFY //////////////////////////////////////////////////
-      template<class T>
-      static int _classify(mylib::Array *src, int ichan, double intensity_thresh, double area_thresh)
-      { T* data;
-        mylib::Array tmp=*src,*image=&tmp;
-        if(ichan>=0)
-        { image=mylib::Get_Array_Plane(&tmp,ichan);
-        }
-        data = (T*)image->data;
-        size_t i,count=0;
-        if(!image->size) return 0;
-        for(i=0;i<image->size;++i)
-          count+=(data[i]>intensity_thresh);
-#if 0
-        mylib::Write_Image("classify.tif",image,mylib::DONT_PRESS);
-#endif
-        DBG("Fraction above thresh: %f\n\t\tintensity thresh: %f\n\t\tarea_thresh: %f\n",
-          count/((double)image->size),
-          intensity_thresh,
-          area_thresh);        
-        return (count/((double)image->size))>area_thresh;
-      }
-      #define CLASSIFY(type_id,type) case type_id: return _classify<type>(image,ichan,intensity_thresh,area_thresh); break
       /**
-      \returns 0 if background, 1 if foreground
+      \returns 0 if background, 1 if foreground.  See classify().
 
       Image could be multiple channels.  Channels are assumed to plane-wise.
       */
-      static int classify(mylib::Array *image, int ichan, double intensity_thresh, double area_thresh)
-      {
-        if(image->ndims<3)  // check that there are enough dimensions to select a channel
-        { ichan=-1;
-        } else if(ichan>=image->dims[image->ndims-1]) // is ichan sane?  If not, use chan 0.
-        { ichan=0;
-        }
-
-        switch(image->type)
-        {
-          CLASSIFY( mylib::UINT8_TYPE   ,uint8_t );
-          CLASSIFY( mylib::UINT16_TYPE  ,uint16_t);
-          CLASSIFY( mylib::UINT32_TYPE  ,uint32_t);
-          CLASSIFY( mylib::UINT64_TYPE  ,uint64_t);
-          CLASSIFY( mylib::INT8_TYPE    , int8_t );
-          CLASSIFY( mylib::INT16_TYPE   , int16_t);
-          CLASSIFY( mylib::INT32_TYPE   , int32_t);
-          CLASSIFY( mylib::INT64_TYPE   , int64_t);
-          CLASSIFY( mylib::FLOAT32_TYPE ,float   );
-          CLASSIFY( mylib::FLOAT64_TYPE ,double  );
-          default:
-            return 0;
-        }
+      static int classify_snapshot(mylib::Array *image, int ichan, double intensity_thresh, double area_thresh)
+      { classify_threshold_t t={ichan,intensity_thresh,area_thresh};
+        size_t nplanes=(image->ndims<3)?1:image->dims[image->ndims-1];
+        if(!nplanes) return 0;
+        return classify(image->data,mylib::arrayTypeToFetchType(image->type),image->size/nplanes,(unsigned)nplanes,&t,1);
       }
-      #undef CLASSIFY
 
       ///// EXPLORE  //////////////////////////////////////////////////
 
@@ -217,7 +178,7 @@ Error:
           CHKJMP(im=dc->snapshot(cfg.z_um(),cfg.timeout_ms()));
           tiling->markExplored();
 		  
-          tiling->markDetected(classify(im,cfg.ichan(),cfg.intensity_threshold(),cfg.area_threshold()));
+          tiling->markDetected(classify_snapshot(im,cfg.ichan(),cfg.intensity_threshold(),cfg.area_threshold()));
 		  if (digcfg.kind() == cfg::device::Digitizer_DigitizerType_Simulated){	//DGA: If digitizer is simulated, then simulate an ellipsoidal volume
 			  if (!insideSimulationOfEllipse(cfg.maxz_mm()*1000, dc->stage()->getTarget().z()*1000.0, tilepos)) tiling->markDetected(false); //DGA: If the tile is outside the simulated volume, mark as undetected (by default, simulation mode marks everything as detected)
 		  }
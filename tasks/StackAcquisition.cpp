@@ -165,7 +165,7 @@ Error:
 
             //Chan_Wait_For_Writer_Count(dc->__scan_agent._owner->_out->contents[0],1);
 
-            { HANDLE hs[] = {dc->__scan_agent._thread,
+            { HANDLE hs[] = {dc->__scan_agent._notify_done,
                              dc->__self_agent._notify_stop};
               DWORD res;
               int   t;
@@ -349,6 +349,7 @@ Error:
             DBG("%s(%d)"ENDL "\tTask: StackAcquisition<%s>: pushing frame"ENDL,__FILE__,__LINE__, TypeStr<TPixel> ());
             if(CHAN_FAILURE( SCANNER_PUSH(qdata,(void**)&frm,nbytes) ))
             { warning("(%s:%d) Scanner output frame queue overflowed."ENDL"\tAborting stack acquisition task."ENDL,__FILE__,__LINE__);
+              { char stats[512]; warning("%s",Chan_Format_Stats(qdata,stats,sizeof(stats))); }
               goto Error;
             }
             ref.format(frm);
@@ -381,8 +382,8 @@ Error:
 Finalize:
           d->_scanner2d._shutter.Shut();
 
-          free(frm);
-          free(wfm);
+          Chan_Token_Buffer_Free(frm);
+          Chan_Token_Buffer_Free(wfm);
           Chan_Close(qdata);
           Chan_Close(qwfm);
           //niscope_debug_print_status(vi);
@@ -453,6 +454,7 @@ Error:
 
 		    if (CHAN_FAILURE(SCANNER_PUSH(qdata, (void**)&frm, nbytes)))
 		    { warning("Scanner output frame queue overflowed."ENDL"\tAborting acquisition task."ENDL);
+			    { char stats[512]; warning("%s",Chan_Format_Stats(qdata,stats,sizeof(stats))); }
 			    goto Error;
 		    }
 		    ref.format(frm);
@@ -461,7 +463,7 @@ Error:
           HERE;
 	  Finalize:
 		  Chan_Close(qdata);
-          free( frm ); 
+          Chan_Token_Buffer_Free( frm );
           return status; // status == 0 implies success, error otherwise
 	  Error:
           warning("Error occurred during ScanStack<%s> task."ENDL,TypeStr<TPixel>());
@@ -515,7 +517,7 @@ Error:
 Finalize:
           TS_CLOSE;
           ctx->running=0;
-          if(frm) free(frm);
+          if(frm) Chan_Token_Buffer_Free(frm);
           Chan_Close(q);
           return 0;
 Error:
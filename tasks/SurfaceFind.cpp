@@ -86,7 +86,7 @@ Error:
       {   int eflag=0;
           eflag |= agent->run() != 1;
           { HANDLE hs[] = {
-              agent->_thread,
+              agent->_notify_done,
               master->_notify_stop};
             DWORD res;
             int   t;            
@@ -146,8 +146,10 @@ TODO:
         dc->scanner.set_config(scope.scanner3d());
 
         // 2. [ ] setup pipeline
+        // The pipeline's own output is in scan order.  The end of the chain
+        // may be a replicated trip detector, which emits in completion order.
         { IDevice* c=dc->configPipeline();
-          c=dc->surface_finder.apply(c);
+          dc->pipeline.observe(&dc->surface_finder); // sees each frame on its way to the trash
           dc->trash.apply(c);
         }
 
@@ -169,8 +171,8 @@ TODO:
           CHKJMP(0==dc->__scan_agent.disarm(timeout_ms));
           CHKJMP(0==dc->__scan_agent.arm(&scan,&dc->scanner));
 
+          dc->surface_finder.reset();
           eflag |= (dc->trash._agent->run()!=1);
-          eflag |= (dc->surface_finder._agent->run()!=1);
           eflag |= dc->runPipeline();
           eflag |= run_and_wait(&dc->__self_agent,&dc->__scan_agent,NULL,NULL); // perform the scan
           eflag |= dc->stopPipeline();         // wait till everything stops
@@ -231,6 +233,7 @@ TODO:
         
 // [ ] FIXME task is not restartable...had a bug at one point        
 Finalize:
+        dc->pipeline.unobserve(&dc->surface_finder);
         dc->surface_finder.reset();
         CHKJMP(dc->__scan_agent.stop());
         CHKJMP(0==dc->__scan_agent.disarm(timeout_ms)); 
@@ -111,7 +111,7 @@ Error:
 
           { // Wait for stack to finish
             HANDLE hs[] = {
-              dc->__scan_agent._thread,
+              dc->__scan_agent._notify_done,
               dc->__self_agent._notify_stop};
             DWORD res;
             int   t;
@@ -275,6 +275,7 @@ namespace fetch
           DBG("Task: Video<%s>: pushing frame\r\n",TypeStr<TPixel>());
           if(CHAN_FAILURE( SCANNER_PUSH(qdata,(void**)&frm,nbytes) ))
           { warning("Scanner output frame queue overflowed.\r\n\tAborting acquisition task.\r\n");
+            { char stats[512]; warning("%s",Chan_Format_Stats(qdata,stats,sizeof(stats))); }
             goto Error;
           }
           ref.format(frm);
@@ -292,8 +293,8 @@ namespace fetch
 Finalize:
 		TS_CLOSE;
         //d->get2d()->_shutter.Shut();
-        free( frm );
-        free( wfm );
+        Chan_Token_Buffer_Free( frm );
+        Chan_Token_Buffer_Free( wfm );
         Chan_Close(qdata);
         Chan_Close(qwfm);
         //niscope_debug_print_status(vi);
@@ -375,6 +376,7 @@ Error:
 		  TS_TOC;
           if(CHAN_FAILURE( SCANNER_PUSH(qdata,(void**)&frm,nbytes) ))
           { warning("Scanner output frame queue overflowed.\r\n\tAborting acquisition task.\r\n");
+            { char stats[512]; warning("%s",Chan_Format_Stats(qdata,stats,sizeof(stats))); }
             goto Error;
           }
           ref.format(frm);
@@ -383,7 +385,7 @@ Error:
 Finalize:
 		TS_CLOSE;
         Chan_Close(qdata);
-        free( frm );
+        Chan_Token_Buffer_Free( frm );
         return status; // status == 0 implies success, error otherwise
 Error:
         warning("Error occurred during Video<%s> task.\r\n",TypeStr<TPixel>());
@@ -429,7 +431,7 @@ Error:
 Finalize:
         TS_CLOSE;
         ctx->running=0;
-        if(frm) free(frm);
+        if(frm) Chan_Token_Buffer_Free(frm);
         Chan_Close(q);
         return 0;
 Error:
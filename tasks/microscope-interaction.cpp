@@ -82,7 +82,7 @@ namespace fetch
 
         {
           HANDLE hs[] = {
-            dc->__scan_agent._thread,
+            dc->__scan_agent._notify_done,
             dc->__self_agent._notify_stop
           };
           DWORD res;
@@ -156,6 +156,11 @@ inline void Thread_Exit(unsigned exitcode)
 { ExitThread((DWORD)exitcode);
 }
 
+void Thread_Terminate(Thread *self_)
+{ thread_t *self = (thread_t*)self_;
+  thread_assert_win32(TerminateThread(self->handle,127));
+}
+
 inline native_thread_id_t Thread_SelfID()
 { return GetCurrentThreadId();
 }
@@ -293,11 +298,75 @@ void Condition_Notify_All(Condition* self)
   WakeAllConditionVariable(PCONDCAST(self));
 }
 
+//////////////////////////////////////////////////////////////////////
+//  Atomics  /////////////////////////////////////////////////////////
+//
+//  x86 and x64 only.  Aligned loads and stores are already acquire and
+//  release there, so those just need to keep the compiler honest.
+//////////////////////////////////////////////////////////////////////
+
+size_t Atomic_Load_Acquire(volatile size_t *v)
+{ size_t x = *v;
+  _ReadWriteBarrier();
+  return x;
+}
+
+void Atomic_Store_Release(volatile size_t *v, size_t x)
+{ _ReadWriteBarrier();
+  *v = x;
+}
+
+size_t Atomic_Exchange(volatile size_t *v, size_t x)
+{
+#ifdef _WIN64
+  return (size_t)InterlockedExchange64((volatile LONG64*)v,(LONG64)x);
+#else
+  return (size_t)InterlockedExchange((volatile LONG*)v,(LONG)x);
+#endif
+}
+
+size_t Atomic_Add(volatile size_t *v, size_t x)
+{
+#ifdef _WIN64
+  return (size_t)InterlockedExchangeAdd64((volatile LONG64*)v,(LONG64)x)+x;
+#else
+  return (size_t)InterlockedExchangeAdd((volatile LONG*)v,(LONG)x)+x;
+#endif
+}
+
+void Thread_Yield(void)
+{ SwitchToThread();
+}
+
+unsigned Thread_Processor_Count(void)
+{ SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (unsigned)info.dwNumberOfProcessors;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Clock  ///////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+double Clock_Seconds(void)
+{ static double rate = 0.0;
+  LARGE_INTEGER t;
+  if(rate==0.0)
+  { QueryPerformanceFrequency(&t);
+    rate = 1.0/(double)t.QuadPart;
+  }
+  QueryPerformanceCounter(&t);
+  return rate*(double)t.QuadPart;
+}
+
 #endif // win32
 
 
 #ifdef USE_PTHREAD
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
 #define thread_assert_pthread(e) if(!(e)) {perror("Thread(pthread)"); \
                                            thread_error("Assert failed in thread module" ENDL \
                                                         "\tFailed: %s " ENDL \
@@ -336,6 +405,12 @@ inline void Thread_Exit(unsigned exitcode)
 { pthread_exit((void*)exitcode);
 }
 
+void Thread_Terminate(Thread *self_)
+{ thread_t *self = (thread_t*)self_;
+  pth_asrt_success(pthread_cancel(self->handle));
+  pth_asrt_success(pthread_detach(self->handle)); // Thread_Free() won't join
+}
+
 inline native_thread_id_t Thread_SelfID()
 { return pthread_self();
 }
@@ -349,6 +424,186 @@ inline int Thread_Equal( native_thread_id_t a, native_thread_id_t b)
 { return pthread_equal(a,b);
 }
 
+#ifdef USE_FUTEX
+//////////////////////////////////////////////////////////////////////
+//  Mutex (futex)  ///////////////////////////////////////////////////
+//
+//  The pthread version below takes two pthread mutexes per lock so it can
+//  catch recursive locks.  This one is a single word: a compare-exchange
+//  when uncontended, a short spin, then FUTEX_WAIT.  See Drepper, "Futexes
+//  Are Tricky" (mutex2).
+//
+//  Recursive locks, and unlocks by a thread that doesn't hold the lock,
+//  are only caught with DEBUG_MUTEX.
+//////////////////////////////////////////////////////////////////////
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+
+#if 0
+#define DEBUG_MUTEX
+#endif
+
+#define MUTEX_SPINS 100 // tries before sleeping.  Most critical sections here are a few hundred cycles.
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax()
+#endif
+
+static int futex(volatile int *addr, int op, int val, const struct timespec *timeout)
+{ return (int)syscall(SYS_futex,(int*)addr,op,val,timeout,NULL,0);
+}
+
+// Spinning only helps if the holder can be running at the same time.
+static int mutex_spins(void)
+{ static volatile int spins = -1;
+  if(spins<0)
+    spins = (sysconf(_SC_NPROCESSORS_ONLN)>1)?MUTEX_SPINS:0;
+  return spins;
+}
+
+Mutex* Mutex_Alloc()
+{ Mutex *m;
+  thread_assert(m=(Mutex*)calloc(1,sizeof(Mutex)));
+  return m;
+}
+
+void Mutex_Free(Mutex* self)
+{ 
+  if(self) free(self);
+}
+
+void Mutex_Lock(Mutex* self)
+{ int c=0, i, n=mutex_spins();
+#ifdef DEBUG_MUTEX
+  if( (self->is_owned) && pthread_equal(pthread_self(),self->owner) )
+    goto ErrorAttemptedRecursiveLock;
+#endif
+  if(__atomic_compare_exchange_n(&self->state,&c,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+    goto Acquired;
+  for(i=0;i<n && c!=2;++i)
+  { cpu_relax();
+    c=0;
+    if(__atomic_compare_exchange_n(&self->state,&c,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+      goto Acquired;
+  }                     // stops early if somebody's already asleep.  Spinning won't help.
+  if(c!=2)
+    c=__atomic_exchange_n(&self->state,2,__ATOMIC_ACQUIRE);
+  while(c!=0)
+  { futex(&self->state,FUTEX_WAIT_PRIVATE,2,NULL);
+    c=__atomic_exchange_n(&self->state,2,__ATOMIC_ACQUIRE);
+  }
+Acquired:
+#ifdef DEBUG_MUTEX
+  self->owner=pthread_self();
+  self->is_owned=1;
+#endif
+  return;
+#ifdef DEBUG_MUTEX
+ErrorAttemptedRecursiveLock:
+  thread_error("Detected an attempt to recursively acquire a mutex.  This isn't allowed."ENDL);
+#endif
+}
+
+void Mutex_Unlock(Mutex* self)
+{ 
+#ifdef DEBUG_MUTEX
+  if(!self->is_owned)
+    goto ErrorUnownedUnlock;
+  if(!pthread_equal(pthread_self(),self->owner))
+    goto ErrorStolenUnlock;
+  self->is_owned=0;
+#endif
+  if(__atomic_exchange_n(&self->state,0,__ATOMIC_RELEASE)==2)
+    futex(&self->state,FUTEX_WAKE_PRIVATE,1,NULL);
+  return;
+#ifdef DEBUG_MUTEX
+ErrorUnownedUnlock:
+  thread_error("Detected an attempt to unlock a mutex that hasn't been locked.  This isn't allowed."ENDL);
+ErrorStolenUnlock:
+  thread_error("Detected an attempt to unlock a mutex by a thread that's not the owner.  This isn't allowed."ENDL);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Condition Variables (futex)  /////////////////////////////////////
+//
+//  A waiter samples seq while it holds the lock, then sleeps for as long as
+//  seq hasn't changed.  A notify bumps seq, so a notify that lands between
+//  the unlock and the FUTEX_WAIT isn't lost.  Like pthreads, waits may
+//  wake spuriously.
+//
+//  Waiters register in nwaiters while holding the lock.  Whoever changed
+//  the predicate did so under the same lock, so a notify that finds
+//  nwaiters==0 has nobody to wake and can return right away.
+//////////////////////////////////////////////////////////////////////
+
+Condition* Condition_Alloc()
+{ Condition *c;
+  thread_assert(c = (Condition*)calloc(1,sizeof(Condition)));
+  return c;
+}
+
+void Condition_Initialize(Condition* c)
+{ 
+  memset(c,0,sizeof(*c));
+}
+
+void Condition_Free(Condition* self)
+{ 
+  if(self) free(self);
+}
+
+/** \returns 1 if woken, 0 on timeout. */
+static int condition_wait(Condition* self, Mutex* lock, const struct timespec *timeout)
+{ int seq, ecode=0;
+  __atomic_add_fetch(&self->nwaiters,1,__ATOMIC_SEQ_CST);
+  seq = __atomic_load_n(&self->seq,__ATOMIC_SEQ_CST);
+  Mutex_Unlock(lock);
+  if(futex(&self->seq,FUTEX_WAIT_PRIVATE,seq,timeout)!=0)
+    ecode = errno;   // EAGAIN: already notified.  EINTR: spurious.
+  Mutex_Lock(lock);
+  __atomic_add_fetch(&self->nwaiters,-1,__ATOMIC_SEQ_CST);
+  return ecode!=ETIMEDOUT;
+}
+
+void Condition_Wait(Condition* self, Mutex* lock)
+{ 
+  condition_wait(self,lock,NULL);
+}
+
+/** \returns 1 if woken, 0 on timeout.
+    A timeout of (unsigned)-1 waits forever, like INFINITE on win32.
+*/
+int Condition_Timed_Wait(Condition* self, Mutex* lock, unsigned timeout_ms)
+{ struct timespec t;
+  if(timeout_ms==(unsigned)-1)
+    return condition_wait(self,lock,NULL);
+  t.tv_sec  = timeout_ms/1000;                 // FUTEX_WAIT wants a relative time
+  t.tv_nsec = (timeout_ms%1000)*1000000L;
+  return condition_wait(self,lock,&t);
+}
+
+void Condition_Notify(Condition* self)
+{ 
+  if(!__atomic_load_n(&self->nwaiters,__ATOMIC_ACQUIRE))
+    return;
+  __atomic_add_fetch(&self->seq,1,__ATOMIC_SEQ_CST);
+  futex(&self->seq,FUTEX_WAKE_PRIVATE,1,NULL);
+}
+
+void Condition_Notify_All(Condition* self)
+{ 
+  if(!__atomic_load_n(&self->nwaiters,__ATOMIC_ACQUIRE))
+    return;
+  __atomic_add_fetch(&self->seq,1,__ATOMIC_SEQ_CST);
+  futex(&self->seq,FUTEX_WAKE_PRIVATE,INT_MAX,NULL);
+}
+
+#else // !USE_FUTEX
 //////////////////////////////////////////////////////////////////////
 //  Mutex  ///////////////////////////////////////////////////////////
 //
@@ -389,6 +644,7 @@ void Mutex_Lock(Mutex* self)
     goto ErrorAttemptedRecursiveLock;
   pth_asrt_success(pthread_mutex_lock(M_NATIVE(self)));
   self->owner=caller;
+  self->is_owned=1;
   pth_asrt_success(pthread_mutex_unlock(M_SELF(self)));
   return;
 ErrorAttemptedRecursiveLock:
@@ -443,6 +699,33 @@ void Condition_Wait(Condition* self, Mutex* lock)
 { 
   pth_asrt_success(pthread_cond_wait(self,M_NATIVE(lock)));
   lock->owner = pthread_self();
+  lock->is_owned = 1;
+}
+
+/** \returns 1 if woken, 0 on timeout.
+    A timeout of (unsigned)-1 waits forever, like INFINITE on win32.
+*/
+int Condition_Timed_Wait(Condition* self, Mutex* lock, unsigned timeout_ms)
+{ struct timespec t;
+  int ecode;
+  if(timeout_ms==(unsigned)-1)
+  { Condition_Wait(self,lock);
+    return 1;
+  }
+  clock_gettime(CLOCK_REALTIME,&t); // pthread_cond_timedwait() wants an absolute time
+  t.tv_sec  += timeout_ms/1000;
+  t.tv_nsec += (timeout_ms%1000)*1000000L;
+  if(t.tv_nsec>=1000000000L)
+  { t.tv_sec++;
+    t.tv_nsec-=1000000000L;
+  }
+  ecode = pthread_cond_timedwait(self,M_NATIVE(lock),&t);
+  lock->owner = pthread_self();
+  lock->is_owned = 1;
+  if(ecode==ETIMEDOUT)
+    return 0;
+  pth_asrt_success(ecode);
+  return 1;
 }
 
 void Condition_Notify(Condition* self)
@@ -454,4 +737,46 @@ void Condition_Notify_All(Condition* self)
 { 
   pth_asrt_success(pthread_cond_broadcast(self));
 }
+#endif // !USE_FUTEX
+
+//////////////////////////////////////////////////////////////////////
+//  Atomics  /////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+#include <sched.h>
+#include <unistd.h>
+
+size_t Atomic_Load_Acquire(volatile size_t *v)
+{ return __atomic_load_n(v,__ATOMIC_ACQUIRE);
+}
+
+void Atomic_Store_Release(volatile size_t *v, size_t x)
+{ __atomic_store_n(v,x,__ATOMIC_RELEASE);
+}
+
+size_t Atomic_Exchange(volatile size_t *v, size_t x)
+{ return __atomic_exchange_n(v,x,__ATOMIC_SEQ_CST);
+}
+
+size_t Atomic_Add(volatile size_t *v, size_t x)
+{ return __atomic_add_fetch(v,x,__ATOMIC_SEQ_CST);
+}
+
+void Thread_Yield(void)
+{ sched_yield();
+}
+
+unsigned Thread_Processor_Count(void)
+{ long n=sysconf(_SC_NPROCESSORS_ONLN);
+  return (n>0)?(unsigned)n:1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Clock  ///////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+double Clock_Seconds(void)
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+}
 #endif // pthread
@@ -28,6 +28,19 @@
 //     of a windows thread isn't wide enough to use as a pointer on 64-bit
 //     systems.  As a result, it doesn't get used for Thread_Join(). 
 //
+// Thread_Terminate(Thread*)
+//
+//   - is a last resort for a thread that won't return.  Windows uses
+//     TerminateThread().  Pthreads use pthread_cancel(), which only takes
+//     effect at the thread's next cancellation point.  Only Thread_Free()
+//     may be called on the thread afterwards.
+//
+// Mutex and Condition on Linux
+//
+//   - are built on futexes rather than pthreads.  Define THREAD_NO_FUTEX
+//     to get the pthread versions back.  The futex Mutex only catches
+//     recursive locks when thread.c is built with DEBUG_MUTEX.
+//
 //////////////////////////////////////////////////////////////////////
 
 //////////////////////////////////////////////////////////////////////
@@ -37,6 +50,9 @@
 #define USE_WIN32_THREADS
 #else
 #define USE_PTHREAD
+#if defined(__linux__) && !defined(THREAD_NO_FUTEX)
+#define USE_FUTEX   // Mutex and Condition on raw futexes.  Threads are still pthreads.
+#endif
 #endif
 
 #ifdef __cplusplus
@@ -48,9 +64,18 @@ extern "C"{
 typedef pthread_t       native_thread_t;
 typedef pthread_t       native_thread_id_t;
 typedef pthread_mutex_t native_mutex_t;
+#ifdef USE_FUTEX
+typedef struct _futex_cond_t
+{ volatile int seq;       // bumped by every notify
+  volatile int nwaiters;  // lets a notify skip the syscall
+} native_cond_t;
+#define MUTEX_INITIALIZER     {0,0,0}
+#define CONDITION_INITIALIZER {0,0}
+#else
 typedef pthread_cond_t  native_cond_t;
 #define MUTEX_INITIALIZER     {PTHREAD_MUTEX_INITIALIZER,PTHREAD_MUTEX_INITIALIZER,0}
 #define CONDITION_INITIALIZER PTHREAD_COND_INITIALIZER
+#endif //USE_FUTEX
 #endif //USE_PTHREAD
 
 #ifdef USE_WIN32_THREADS
@@ -73,12 +98,20 @@ typedef _CONDITION_VARIABLE native_cond_t;
 #endif //USE_WIN32_THREADS
 
 
+#ifdef USE_FUTEX
+typedef struct _mutex_t
+{ volatile int       state;    // 0: unlocked, 1: locked, 2: locked and maybe contended
+  native_thread_id_t owner;    // owner and is_owned are only kept up with DEBUG_MUTEX.  See thread.c.
+  int                is_owned;
+} Mutex;
+#else
 typedef struct _mutex_t
 { native_mutex_t  lock; 
   native_mutex_t  self_lock;  
   native_thread_id_t owner;
   int is_owned;
 } Mutex;
+#endif
        
 typedef void          Thread;
 typedef native_cond_t Condition;
@@ -95,6 +128,7 @@ Thread*  Thread_Alloc       ( ThreadProc function, ThreadProcArg arg);
 void     Thread_Free        ( Thread* self);
 void*    Thread_Join        ( Thread* self);
 void     Thread_Exit        ( unsigned exitcode);
+void     Thread_Terminate   ( Thread* self);
 void     Thread_Self        ( Thread* out );
 extern int                Thread_Equal  ( native_thread_id_t a, native_thread_id_t b);
 extern native_thread_id_t Thread_SelfID ( );
@@ -114,6 +148,25 @@ int        Condition_Timed_Wait( Condition* self, Mutex* lock, unsigned timeout_
 void       Condition_Notify    ( Condition* self);
 void       Condition_Notify_All( Condition* self);
 
+//////////////////////////////////////////////////////////////////////
+// Atomics
+//
+// Just enough to build single-producer/single-consumer structures on.
+// Operate on pointer-sized integers.  Loads have acquire semantics,
+// stores have release semantics.  Exchange and Add are full barriers.
+//////////////////////////////////////////////////////////////////////
+size_t     Atomic_Load_Acquire ( volatile size_t *v);
+void       Atomic_Store_Release( volatile size_t *v, size_t x);
+size_t     Atomic_Exchange     ( volatile size_t *v, size_t x); ///< returns the previous value
+size_t     Atomic_Add          ( volatile size_t *v, size_t x); ///< returns the new value
+void       Thread_Yield        ( void );
+unsigned   Thread_Processor_Count( void ); ///< logical processors online
+
+//////////////////////////////////////////////////////////////////////
+// Clock
+//////////////////////////////////////////////////////////////////////
+double     Clock_Seconds       ( void ); ///< monotonic.  Only differences are meaningful.
+
 #ifdef __cplusplus
 }
 #endif
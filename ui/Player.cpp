@@ -64,33 +64,32 @@ AsynqPlayer::~AsynqPlayer()
 
 void AsynqPlayer::run()
 {
-  Frame *buf =  (Frame*)Chan_Token_Buffer_Alloc(in_);
-  size_t nbytes  = Chan_Buffer_Size_Bytes(in_);
+  Frame *buf = NULL;
   mylib::Array im;
   mylib::Dimn_Type dims[3];
   Chan *reader = Chan_Open(in_,CHAN_PEEK);
   TicTocTimer t = tic();
-  // Notes: o Peek copies from current data into frame buffer.
-  //        o Peek might realloc the input frame buffer.
+  // Notes: o Borrows the newest frame in place.  No copy.
+  //        o The frame is read only till it's released.  The data pointer
+  //          is computed here rather than by format() for that reason.
 
   { QMutexLocker locker(&lock_); 
     running_ = 1;
     const float fps = 60.0;
     float ms = 1000.0/fps - toc(&t)*1000.0; // in ms;
     while(running(ms))
-    { if(CHAN_SUCCESS( Chan_Peek_Timed(reader,(void**)&buf,nbytes,peek_timeout_ms_) ))
+    { if(CHAN_SUCCESS( Chan_Peek_Borrow(reader,(void**)&buf,peek_timeout_ms_) ))
       { 
-        nbytes = buf->size_bytes();
-        buf->format(buf);                                                    // resets the data pointer  - super gross and icky
         castFetchFrameToDummyArray(&im,buf,dims);
+        im.data = (char*)buf + buf->self_size;                               // what format() would set
         emit imageReady(&im);                                                // blocks until receiver returns      //...what if there's no reciever?        
+        Chan_Release(reader,buf);
       }       
       ms = 1000.0/fps - toc(&t)*1000.0; // in ms
       ms = (ms>0)?ms:0;                                                                        
     }
   }
   Chan_Close(reader);  
-  Chan_Token_Buffer_Free(buf);
   //debug("%s(%d): player out!"ENDL,__FILE__,__LINE__);
 }
 
@@ -26,6 +26,14 @@ namespace mylib
     return frameTypeToArrayType[id];
   }
 
+  Basic_Type_ID arrayTypeToFetchType(Value_Type type)
+  { int i;
+    for(i=0;i<MAX_TYPE_ID;++i)
+      if(frameTypeToArrayType[i]==type)
+        return (Basic_Type_ID)i;
+    return id_unspecified;
+  }
+
   static size_t frameTypeToArrayScale[] = {
     8, //id_u8 = 0,
     16,//id_u16,
@@ -13,6 +13,7 @@ namespace mylib
 namespace mylib
 {
   mylib::Value_Type fetchTypeToArrayType(Basic_Type_ID id);
+  Basic_Type_ID arrayTypeToFetchType(mylib::Value_Type type); // id_unspecified if there's no match
   int fetchTypeToArrayScale(Basic_Type_ID id);
   void castFetchFrameToDummyArray(mylib::Array* dest, fetch::Frame* src, mylib::Dimn_Type dims[3]);
 } //end namespace mylib
@@ -66,6 +66,17 @@ void onfalse()
 #define REPORT
 #endif
 
+unsigned long long fingerprint(const std::string &serialized)
+{ const unsigned char *p=(const unsigned char*)serialized.data();
+  unsigned long long h=14695981039346656037ULL;
+  size_t i,n=serialized.size();
+  for(i=0;i<n;++i)
+  { h^=p[i];
+    h*=1099511628211ULL;
+  }
+  return h;
+}
+
 bool equals(const google::protobuf::Message *a,const google::protobuf::Message *b)
 { return equals(*a,*b);
 }
@@ -78,6 +89,8 @@ bool equals(const google::protobuf::Message &a,const google::protobuf::Message &
     *ra = a.GetReflection(),
     *rb = b.GetReflection();
   
+  if(&a==&b)
+    return true;
   if( (da->full_name()  !=db->full_name())   // must have same descriptor name
     ||(da->field_count()!=db->field_count()) // and field count
     )
@@ -4,6 +4,13 @@
 //bool operator!=(const google::protobuf::Message &a,const google::protobuf::Message &b);
 //bool operator==(const google::protobuf::Message *a,const google::protobuf::Message *b);
 bool equals(const google::protobuf::Message *a,const google::protobuf::Message *b);
+
+/** 64-bit content hash (FNV-1a) of a serialized message.
+    Messages with the same fields set to the same values have the same
+    fingerprint.  The converse doesn't hold for equals(): it ignores tiny
+    float differences and a field set to its default equals an unset one.
+*/
+unsigned long long fingerprint(const std::string &serialized);
 //bool operator!=(const google::protobuf::Message *a,const google::protobuf::Message *b);
 
 namespace pb
@@ -12,7 +12,6 @@
  */
 #include "config.h"
 #include "Pipeline.h"
-#include "algo/pipeline.h"
 #include "algo/pipeline-image-frame.h"
 
 //#define PROFILE
@@ -54,19 +53,61 @@ namespace fetch
   bool operator==(const cfg::worker::Pipeline& a, const cfg::worker::Pipeline& b)
   { return  (a.frame_average_count()==b.frame_average_count()) &&
             (a.downsample_count()==b.downsample_count()) &&
-            (a.invert_intensity()==b.invert_intensity());
+            (a.invert_intensity()==b.invert_intensity()) &&
+            (a.nthreads()==b.nthreads()) &&
+            (a.frames_in_flight()==b.frames_in_flight());
   }
   bool operator!=(const cfg::worker::Pipeline& a, const cfg::worker::Pipeline& b)
   { return !(a==b);
   }
   namespace task
   {
+    static void init_dst(Frame_With_Interleaved_Planes *fdst, Chan *q)
+    { size_t dst_bytes = Chan_Buffer_Size_Bytes(q);
+      Frame_With_Interleaved_Planes ref(dst_bytes,1,1,id_u8); // just a 1d array with the right number of bytes. dst will get formated correctly later.
+      ref.format(fdst);
+    }
+
+    /** Waits for the oldest frame in flight and pushes its output if it emits.
+        Observers of \a d see the output just before it's pushed.
+    */
+    static int retire(IDevice *d, pipeline_t ctx, Chan *writer, Chan *qdst, Frame_With_Interleaved_Planes **fdst, int emit)
+    { TRY(pipeline_retire(ctx));
+      if(emit)
+      { //REMIND((*fdst)->totif("pipeline-dst.tif"));
+        d->_notify_observers(0,*fdst,(*fdst)->size_bytes());
+        TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)fdst,(*fdst)->size_bytes())));
+        init_dst(*fdst,qdst);
+      }
+      return 1;
+    Error:
+      return 0;
+    }
+
+    /**
+      Up to cfg::worker::Pipeline::frames_in_flight frames are in flight, each
+      with its own source and destination buffers (a slot).  While frames are
+      in flight, a new frame is only taken if one is already waiting;
+      otherwise the oldest frame is retired and emitted.  That way reading
+      the next frame overlaps processing, and output isn't held back waiting
+      for input that isn't there.
+    */
     unsigned int
     Pipeline::run(IDevice *idc)
     { int eflag = 0;
       PipelineAgent *dc = dynamic_cast<PipelineAgent*>(idc);
       pipeline_param_t params={0};
       pipeline_t ctx=0;
+      pipeline_image_t pipesrc[PIPELINE_MAX_IN_FLIGHT]={0},
+                       pipedst[PIPELINE_MAX_IN_FLIGHT]={0};
+      Frame_With_Interleaved_Planes *fsrc[PIPELINE_MAX_IN_FLIGHT]={0},
+                                    *fdst[PIPELINE_MAX_IN_FLIGHT]={0};
+      int      emit[PIPELINE_MAX_IN_FLIGHT]={0};
+      unsigned depth,i,submitted=0,retired=0;
+      size_t   src_bytes;
+      Chan *qsrc = dc->_in->contents[0],
+           *qdst = dc->_out->contents[0],
+           *reader=0, *writer=0;
       TS_OPEN("timer-pipeline.f32");
 
       // read in parameters
@@ -74,62 +115,68 @@ namespace fetch
         params.frame_average_count = cfg.frame_average_count();
         params.pixel_average_count = cfg.downsample_count();
         params.invert_intensity    = (unsigned) cfg.invert_intensity();
+        params.nthreads            = cfg.nthreads();
         params.scan_rate_Hz        = dc->scan_rate_Hz();
         params.sample_rate_MHz     = dc->sample_rate_Mhz();
+        depth = cfg.frames_in_flight();
+        if(depth<1)                      depth=1;
+        if(depth>PIPELINE_MAX_IN_FLIGHT) depth=PIPELINE_MAX_IN_FLIGHT;
       }
-      TRY(ctx=pipeline_make(&params));
+      TRY(ctx=dc->context(params));
 
       // open channels
-      pipeline_image_t pipesrc=0,pipedst=0;
-      Chan *qsrc = dc->_in->contents[0],
-           *qdst = dc->_out->contents[0],
-           *reader, *writer;
-
-      Frame_With_Interleaved_Planes *fsrc = (Frame_With_Interleaved_Planes*) Chan_Token_Buffer_Alloc(qsrc),
-                                    *fdst = (Frame_With_Interleaved_Planes*) Chan_Token_Buffer_Alloc(qdst);
-      f32 *acc = NULL;
-      { // init fdst
-        size_t dst_bytes = Chan_Buffer_Size_Bytes(qdst);
-        Frame_With_Interleaved_Planes ref(dst_bytes,1,1,id_u8); // just a 1d array with the right number of bytes. dst will get formated correctly later.
-        ref.format(fdst);
+      for(i=0;i<depth;++i)
+      { fsrc[i] = (Frame_With_Interleaved_Planes*) Chan_Token_Buffer_Alloc(qsrc);
+        fdst[i] = (Frame_With_Interleaved_Planes*) Chan_Token_Buffer_Alloc(qdst);
+        init_dst(fdst[i],qdst);
       }
       reader = Chan_Open(qsrc,CHAN_READ);
       writer = Chan_Open(qdst,CHAN_WRITE);
 
       // MAIN LOOP
-      size_t src_bytes=Chan_Buffer_Size_Bytes(qsrc);
-      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&fsrc,src_bytes)))
-      { int emit=0;
-        //REMIND(fsrc->totif("pipeline-src.tif"));
+      src_bytes=Chan_Buffer_Size_Bytes(qsrc);
+      while(1)
+      { if(submitted-retired==depth) // no free slot
+        { TRY(retire(dc,ctx,writer,qdst,fdst+retired%depth,emit[retired%depth]));
+          ++retired;
+        }
+        i=submitted%depth;
+        if(submitted==retired)
+        { if(!CHAN_SUCCESS(Chan_Next(reader,(void**)&fsrc[i],src_bytes)))
+            break;
+        } else if(!CHAN_SUCCESS(Chan_Next_Try(reader,(void**)&fsrc[i],src_bytes)))
+        { TRY(retire(dc,ctx,writer,qdst,fdst+retired%depth,emit[retired%depth])); // nothing waiting
+          ++retired;
+          continue;
+        }
+        //REMIND(fsrc[i]->totif("pipeline-src.tif"));
         TS_TIC;
-        TRY(pipesrc=pipeline_set_image_from_frame(pipesrc,fsrc));
-        TRY(pipedst=pipeline_make_dst_image(pipedst,ctx,pipesrc));
-        TRY(fdst=pipeline_format_frame(pipedst,fdst)); // maybe realloc fdst and format the frame.
-        pipeline_image_set_data(pipedst,fdst->data);
-        TRY(pipeline_exec(ctx,pipedst,pipesrc,&emit));
+        TRY(pipesrc[i]=pipeline_set_image_from_frame(pipesrc[i],fsrc[i]));
+        TRY(pipedst[i]=pipeline_make_dst_image(pipedst[i],ctx,pipesrc[i]));
+        TRY(fdst[i]=pipeline_format_frame(pipedst[i],fdst[i])); // maybe realloc fdst and format the frame.
+        pipeline_image_set_data(pipedst[i],fdst[i]->data);
+        TRY(pipeline_submit(ctx,pipedst[i],pipesrc[i],emit+i));
+        ++submitted;
         TS_TOC;
-        if(emit)
-        { //REMIND(fdst->totif("pipeline-dst.tif"));
-          TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&fdst,fdst->size_bytes())));
-          { // init fdst
-            size_t dst_bytes = Chan_Buffer_Size_Bytes(qdst);
-            Frame_With_Interleaved_Planes ref(dst_bytes,1,1,id_u8); // just a 1d array with the right number of bytes. dst will get formated correctly later.
-            ref.format(fdst);
-          }
-        }
+      }
+      while(retired<submitted)
+      { TRY(retire(dc,ctx,writer,qdst,fdst+retired%depth,emit[retired%depth]));
+        ++retired;
       }
 Finalize:
       TS_CLOSE;
-      pipeline_free(&ctx);
-      pipeline_free_image(&pipesrc);
-      pipeline_free_image(&pipedst);
-      Chan_Close(reader);
-      Chan_Close(writer);
-      Chan_Token_Buffer_Free(fsrc);
-      Chan_Token_Buffer_Free(fdst);
+      for(i=0;i<PIPELINE_MAX_IN_FLIGHT;++i)
+      { pipeline_free_image(pipesrc+i);
+        pipeline_free_image(pipedst+i);
+        Chan_Token_Buffer_Free(fsrc[i]);
+        Chan_Token_Buffer_Free(fdst[i]);
+      }
+      if(reader) Chan_Close(reader);
+      if(writer) Chan_Close(writer);
       return eflag;
 Error:
       warning("%s(%d) %s()\r\n\tSomething went wrong with the pipeline.\r\n",__FILE__,__LINE__,__FUNCTION__);
+      dc->free_context(); // don't reuse a context in an unknown state.  This also stops work on frames in flight.
       eflag=1;
       goto Finalize;
     }
@@ -141,13 +188,47 @@ Error:
     PipelineAgent::PipelineAgent(): WorkAgent<TaskType,Config>("Pipeline")
       ,scan_rate_Hz_(7920)
       ,sample_rate_Mhz_(125)
+      ,ctx_(NULL)
+      ,ctx_params_()
     {}
 
     PipelineAgent::PipelineAgent(Config *config): WorkAgent<TaskType,Config>(config,"Pipeline")
       ,scan_rate_Hz_(7920)
       ,sample_rate_Mhz_(125)
+      ,ctx_(NULL)
+      ,ctx_params_()
     {}
 
+    PipelineAgent::~PipelineAgent()
+    { free_context();
+    }
+
+    static bool same_params(const pipeline_param_t& a, const pipeline_param_t& b)
+    { return a.frame_average_count==b.frame_average_count
+          && a.pixel_average_count==b.pixel_average_count
+          && a.invert_intensity   ==b.invert_intensity
+          && a.scan_rate_Hz       ==b.scan_rate_Hz
+          && a.sample_rate_MHz    ==b.sample_rate_MHz
+          && a.isa                ==b.isa
+          && a.nthreads           ==b.nthreads;
+    }
+
+    pipeline_t PipelineAgent::context(const pipeline_param_t& params)
+    { if(ctx_ && !same_params(params,ctx_params_))
+        free_context();
+      if(!ctx_)
+      { if(!(ctx_=pipeline_make(&params)))
+          return NULL;
+        ctx_params_=params;
+      } else
+        pipeline_reset(ctx_);
+      return ctx_;
+    }
+
+    void PipelineAgent::free_context()
+    { pipeline_free(&ctx_);
+    }
+
     unsigned PipelineAgent::scan_rate_Hz()                  {return scan_rate_Hz_;}
     unsigned PipelineAgent::sample_rate_Mhz()               {return sample_rate_Mhz_;}
     void     PipelineAgent::set_scan_rate_Hz(unsigned v)    {scan_rate_Hz_=v;}
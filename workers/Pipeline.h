@@ -11,6 +11,7 @@
 #include "WorkAgent.h"
 #include "WorkTask.h"
 #include "workers.pb.h"
+#include "algo/pipeline.h"
 
 namespace fetch
 {
@@ -27,12 +28,25 @@ namespace fetch
   bool operator!=(const cfg::worker::Pipeline& a, const cfg::worker::Pipeline& b);
   namespace worker
   {
+    /** Keeps a warm pipeline context between runs so starting the pipeline
+        for each tile doesn't rebuild lookup tables, reallocate buffers or
+        restart the CPU backend's threads.  The context is replaced when the
+        pipeline parameters change.  It rebuilds its own tables if the input
+        width changes.  Only the task uses the context.
+    */
     class PipelineAgent:public WorkAgent<task::Pipeline,cfg::worker::Pipeline>
     {   unsigned scan_rate_Hz_;
         unsigned sample_rate_Mhz_;
+        pipeline_t       ctx_;
+        pipeline_param_t ctx_params_;
       public:
         PipelineAgent();
         PipelineAgent(Config *config);
+        ~PipelineAgent();
+
+        pipeline_t context(const pipeline_param_t& params); // a context for params with any partial frame average dropped.  NULL on error.
+        void       free_context();
+
         unsigned scan_rate_Hz();
         unsigned sample_rate_Mhz();
 
@@ -0,0 +1,543 @@
+/*
+ * ReplicatedWorkAgent.h
+ */
+/*
+ * Copyright 2010 Howard Hughes Medical Institute.
+ * All rights reserved.
+ * Use is subject to Janelia Farm Research Campus Software Copyright 1.1
+ * license terms (http://license.janelia.org/license/jfrc_copyright_1_1.html).
+ */
+/*
+ * ReplicatedWorkAgent<TWorkTask,TConfig>
+ * --------------------------------------
+ *
+ * A WorkAgent that runs several copies (replicas) of the same WorkTask on
+ * one input queue so a CPU-heavy stage can use more than one core.  The
+ * number of replicas is TConfig::replicas(), so TConfig needs a replicas
+ * field.  With one replica it's the same as a WorkAgent.
+ *
+ * How it works
+ * ------------
+ * The agent's own thread pops frames from in[0], tags them with a sequence
+ * number and pushes them to a private queue that the replicas read.  The
+ * replicas push their output to a second private queue.  A sequencer
+ * thread pops from that, holds on to frames that arrive early and pushes
+ * them to out[0] in sequence order.
+ *
+ * The sequence number rides in a trailer just past the message's
+ * size_bytes() in the private queues' buffers, so the Message header (and
+ * everything written to disk) is untouched.  Frames reach out[0] without
+ * the trailer.
+ *
+ * The replicas and the sequencer are threads owned by the task.  They're
+ * started by the first replicated run and park between runs, like an
+ * Agent's worker.  They're only restarted if the number of replicas
+ * changes.
+ *
+ * Frames are dispatched at most 2*replicas (rounded up to a power of two)
+ * ahead of the sequencer, so one slow frame holds back a bounded number of
+ * finished ones.
+ *
+ * Observers (IDevice::observe) are notified by the replicas, so they see
+ * frames in the order they finish rather than in sequence order.  They're
+ * still called one frame at a time.
+ *
+ * Requirements for TWorkTask
+ * --------------------------
+ * - Must be an InPlaceWorkTask or a OneToOneWorkTask.  The replicas call
+ *   its work() (and reshape()) for each frame; its run() is only used with
+ *   one replica.
+ * - work() is called on several threads at once with the same device.  Any
+ *   state the task keeps in the device needs a lock.
+ * - Frames may be processed out of order.
+ * - If a replica fails, the others are stopped and the run fails.
+ */
+#pragma once
+
+#include "WorkAgent.h"
+#include "WorkTask.h"
+
+#define TRY(expr,lbl) \
+  if(!(expr)) \
+    { warning("%s(%d): %s"ENDL"\t%s"ENDL"\tExpression evaluated to false.",__FILE__,__LINE__,#lbl,#expr); \
+      goto lbl; \
+    }
+
+namespace fetch
+{
+  namespace task
+  {
+    template<typename TWorkTask, typename TConfig> class Replicated;
+  }
+
+  template<typename TWorkTask, typename TConfig>
+  class ReplicatedWorkAgent : public WorkAgent<task::Replicated<TWorkTask,TConfig>,TConfig>
+  {
+  public:
+    ReplicatedWorkAgent(char* name=NULL);
+    ReplicatedWorkAgent(TConfig *config,char* name=NULL);
+    ReplicatedWorkAgent(IDevice *source, int ichan, TConfig *config,char* name=NULL);
+    virtual ~ReplicatedWorkAgent();
+
+    unsigned replicas(); ///< from the config.  At least 1.
+
+  public: // used by task::Replicated
+    vector_PCHAN *replica_in_,  ///< the replicas' input.  Kept between runs.
+                 *replica_out_; ///< the replicas' output.  Kept between runs.
+  };
+
+  namespace task
+  {
+    template<typename TWorkTask, typename TConfig>
+    class Replicated : public WorkTask
+    { public:
+        Replicated();
+        virtual ~Replicated();
+
+        unsigned int config(IDevice *d)             {return inner_.config(d);}
+        unsigned int run(IDevice *d);
+        virtual void alloc_output_queues(IDevice *d) {inner_.alloc_output_queues(d);}
+
+        TWorkTask inner_;
+
+      private:
+        struct run_t
+        { Replicated *self;
+          IDevice    *d;
+          Chan       *qmid_in,*qmid_out,*qout;
+          unsigned    n;              // replicas
+          u64         dispatched,     // frames tagged so far.  Only written by the dispatcher.
+                      emitted;        // frames pushed in order to out[0].  Protected by lock_.
+          unsigned    window;
+          int         failed;         // protected by lock_
+          unsigned    replicas_left,  // protected by lock_
+                      sequencer_left; // protected by lock_
+        };
+        struct member_t
+        { Replicated *self;
+          unsigned    index;          // replicas are 0..n-1.  n is the sequencer.
+          u64         seen;           // the last generation_ this member ran
+        };
+
+        Mutex     *lock_;     // protects everything below and the shared parts of run_
+        Condition *wake_,     // the crew waits here for a run (or quit_)
+                  *cv_;       // progress: frames emitted, failures, crew members finishing
+        Thread   **crew_;     // replicas_ replicas and then the sequencer.  Parked between runs.
+        member_t  *members_;
+        unsigned   replicas_;
+        u64        generation_;
+        int        quit_;
+        run_t     *run_;
+
+        int   crew_start(unsigned n);
+        void  crew_stop();
+        static void* crew_main(void *arg);
+        static void  replica(run_t *r);
+        static void  sequencer(run_t *r);
+        static void  fail(run_t *r);
+
+        template<typename TMessage> static int step(InPlaceWorkTask<TMessage>  *t, run_t *r, Message **src, size_t *srccap, Message **dst, size_t *dstcap);
+        template<typename TMessage> static int step(OneToOneWorkTask<TMessage> *t, run_t *r, Message **src, size_t *srccap, Message **dst, size_t *dstcap);
+    };
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  //
+  // Implementation
+  //
+  ////////////////////////////////////////////////////////////////////////////
+
+  template<typename TWorkTask,typename TConfig>
+  ReplicatedWorkAgent<TWorkTask,TConfig>::ReplicatedWorkAgent(char* name)
+    :WorkAgent<task::Replicated<TWorkTask,TConfig>,TConfig>(name)
+    ,replica_in_(NULL)
+    ,replica_out_(NULL)
+  {}
+
+  template<typename TWorkTask,typename TConfig>
+  ReplicatedWorkAgent<TWorkTask,TConfig>::ReplicatedWorkAgent(TConfig *config,char* name)
+    :WorkAgent<task::Replicated<TWorkTask,TConfig>,TConfig>(config,name)
+    ,replica_in_(NULL)
+    ,replica_out_(NULL)
+  {}
+
+  template<typename TWorkTask,typename TConfig>
+  ReplicatedWorkAgent<TWorkTask,TConfig>::ReplicatedWorkAgent(IDevice *source, int ichan, TConfig *config,char* name)
+    :WorkAgent<task::Replicated<TWorkTask,TConfig>,TConfig>(source,ichan,config,name)
+    ,replica_in_(NULL)
+    ,replica_out_(NULL)
+  {}
+
+  template<typename TWorkTask,typename TConfig>
+  ReplicatedWorkAgent<TWorkTask,TConfig>::~ReplicatedWorkAgent()
+  { IDevice::_free_qs(&replica_in_);
+    IDevice::_free_qs(&replica_out_);
+  }
+
+  template<typename TWorkTask,typename TConfig>
+  unsigned ReplicatedWorkAgent<TWorkTask,TConfig>::replicas()
+  { unsigned n=this->_config->replicas();
+    return n?n:1;
+  }
+
+  namespace task
+  {
+    // The sequence number trailer.  It starts at the first 8-byte boundary
+    // past the message.
+    inline size_t replica_seq_offset(Message *m) {return (m->size_bytes()+7)&~(size_t)7;}
+    inline size_t replica_token_bytes(Message *m){return replica_seq_offset(m)+sizeof(u64);}
+    inline u64*   replica_seq(Message *m)        {return (u64*)((u8*)m+replica_seq_offset(m));}
+
+    template<typename TWorkTask, typename TConfig>
+    Replicated<TWorkTask,TConfig>::Replicated()
+      :lock_(NULL),wake_(NULL),cv_(NULL),crew_(NULL),members_(NULL)
+      ,replicas_(0),generation_(0),quit_(0),run_(NULL)
+    {}
+
+    template<typename TWorkTask, typename TConfig>
+    Replicated<TWorkTask,TConfig>::~Replicated()
+    { crew_stop();
+      if(cv_)   Condition_Free(cv_);
+      if(wake_) Condition_Free(wake_);
+      if(lock_) Mutex_Free(lock_);
+    }
+
+    /** Makes sure there's a parked crew of \a n replicas and a sequencer.
+        \returns 1 on success, 0 otherwise.
+    */
+    template<typename TWorkTask, typename TConfig>
+    int Replicated<TWorkTask,TConfig>::crew_start(unsigned n)
+    { unsigned i;
+      if(!lock_)
+      { TRY(lock_=Mutex_Alloc(),Error);
+        TRY(wake_=Condition_Alloc(),Error);
+        TRY(cv_  =Condition_Alloc(),Error);
+      }
+      if(crew_ && replicas_==n)
+        return 1;
+      crew_stop();
+      TRY(crew_   =(Thread**)  calloc(n+1,sizeof(Thread*)),Error);
+      TRY(members_=(member_t*)calloc(n+1,sizeof(member_t)),Error);
+      replicas_=n;
+      for(i=0;i<=n;++i)
+      { members_[i].self=this;
+        members_[i].index=i;
+        members_[i].seen=generation_; // not read by the thread, which might start after the next run
+        TRY(crew_[i]=Thread_Alloc(crew_main,members_+i),Error);
+      }
+      return 1;
+    Error:
+      crew_stop();
+      return 0;
+    }
+
+    template<typename TWorkTask, typename TConfig>
+    void Replicated<TWorkTask,TConfig>::crew_stop()
+    { unsigned i;
+      if(!crew_)
+        return;
+      Mutex_Lock(lock_);
+      quit_=1;
+      Condition_Notify_All(wake_);
+      Mutex_Unlock(lock_);
+      for(i=0;i<=replicas_;++i)
+        if(crew_[i])
+        { Thread_Join(crew_[i]);
+          Thread_Free(crew_[i]);
+        }
+      free(crew_);
+      free(members_);
+      crew_=NULL;
+      members_=NULL;
+      replicas_=0;
+      quit_=0;
+    }
+
+    /** A crew member parks on wake_ till run() bumps generation_. */
+    template<typename TWorkTask, typename TConfig>
+    void* Replicated<TWorkTask,TConfig>::crew_main(void *arg)
+    { member_t   *m=(member_t*)arg;
+      Replicated *self=m->self;
+      run_t      *r;
+      Mutex_Lock(self->lock_);
+      while(1)
+      { while(self->generation_==m->seen && !self->quit_)
+          Condition_Wait(self->wake_,self->lock_);
+        if(self->quit_)
+          break;
+        m->seen=self->generation_;
+        r=self->run_;
+        Mutex_Unlock(self->lock_);
+        if(m->index<r->n)
+          replica(r);
+        else
+          sequencer(r);
+        Mutex_Lock(self->lock_);
+        if(m->index<r->n) --r->replicas_left;
+        else              --r->sequencer_left;
+        Condition_Notify_All(self->cv_);
+      }
+      Mutex_Unlock(self->lock_);
+      return NULL;
+    }
+
+    template<typename TWorkTask, typename TConfig>
+    void Replicated<TWorkTask,TConfig>::fail(run_t *r)
+    { Mutex_Lock(r->self->lock_);
+      r->failed=1;
+      Condition_Notify_All(r->self->cv_);
+      Mutex_Unlock(r->self->lock_);
+    }
+
+    // The replicas and the sequencer keep track of how big each buffer they
+    // hold is (\c cap), so the size handed to Chan_Next() is always the size
+    // of the buffer being handed over.
+
+    /** Runs an in-place task on one tagged frame.  The result is swapped
+        into \a *dst.  \returns 1 on success, 0 otherwise.
+    */
+    template<typename TWorkTask, typename TConfig>
+    template<typename TMessage>
+    int Replicated<TWorkTask,TConfig>::step(InPlaceWorkTask<TMessage> *t, run_t *r, Message **src, size_t *srccap, Message **dst, size_t *dstcap)
+    { u64 seq=*replica_seq(*src);
+      TRY(t->work(r->d,(TMessage*)*src),Error);
+      *replica_seq(*src)=seq;               // in case work() moved the end of the message
+      r->d->_notify_observers(0,*src,(*src)->size_bytes());
+      { Message *tmp=*src;    *src=*dst;       *dst=tmp;    }
+      { size_t   tmp=*srccap; *srccap=*dstcap; *dstcap=tmp; }
+      return 1;
+    Error:
+      return 0;
+    }
+
+    /** Runs a one-to-one task on one tagged frame.  The result is left in
+        \a *dst, tagged like the source.  \returns 1 on success, 0 otherwise.
+    */
+    template<typename TWorkTask, typename TConfig>
+    template<typename TMessage>
+    int Replicated<TWorkTask,TConfig>::step(OneToOneWorkTask<TMessage> *t, run_t *r, Message **src, size_t *srccap, Message **dst, size_t *dstcap)
+    { TMessage *fsrc=(TMessage*)*src,
+               *fdst=(TMessage*)*dst;
+      size_t    nout;
+      fsrc->format(fdst);
+      TRY(t->reshape(r->d,fdst),Error);
+      nout=replica_token_bytes(fdst);
+      if(nout>*dstcap)
+      { TRY(fdst=(TMessage*)Chan_Token_Buffer_Realloc(fdst,nout),Error);
+        *dst=fdst;
+        *dstcap=nout;
+        fsrc->format(fdst);
+        TRY(t->reshape(r->d,fdst),Error);
+      }
+      TRY(t->work(r->d,fdst,fsrc),Error);
+      *replica_seq(fdst)=*replica_seq(fsrc);
+      r->d->_notify_observers(0,fdst,fdst->size_bytes());
+      return 1;
+    Error:
+      return 0;
+    }
+
+    /** Runs one replica.  A replica that fails stops the run and then drains
+        its input so the dispatcher doesn't block on a queue nobody reads.
+    */
+    template<typename TWorkTask, typename TConfig>
+    void Replicated<TWorkTask,TConfig>::replica(run_t *r)
+    { Chan    *reader=Chan_Open(r->qmid_in,CHAN_READ),
+              *writer=Chan_Open(r->qmid_out,CHAN_WRITE);
+      Message *src=(Message*)Chan_Token_Buffer_Alloc(r->qmid_in),
+              *dst=(Message*)Chan_Token_Buffer_Alloc(r->qmid_out);
+      size_t   srccap=Chan_Buffer_Size_Bytes(r->qmid_in),
+               dstcap=Chan_Buffer_Size_Bytes(r->qmid_out),
+               nout;
+      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&src,srccap)))
+      { srccap=Chan_Buffer_Size_Bytes(r->qmid_in);
+        TRY(step(&r->self->inner_,r,&src,&srccap,&dst,&dstcap),WorkError);
+        nout=replica_token_bytes(dst);
+        if(nout>Chan_Buffer_Size_Bytes(r->qmid_out))
+          Chan_Resize(writer,nout);
+        TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&dst,dstcap)),WorkError);
+        dstcap=Chan_Buffer_Size_Bytes(r->qmid_out);
+      }
+    Finalize:
+      Chan_Close(writer);
+      Chan_Close(reader);
+      Chan_Token_Buffer_Free(src);
+      Chan_Token_Buffer_Free(dst);
+      return;
+    WorkError:
+      warning("%s(%d)"ENDL "\t[%s] A replica failed."ENDL,__FILE__,__LINE__,r->d->_agent->name());
+      fail(r);
+      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&src,srccap)))
+        srccap=Chan_Buffer_Size_Bytes(r->qmid_in);
+      goto Finalize;
+    }
+
+    /** Puts the replicas' output back in order.
+        Frame \c seq waits in \c stash[seq%window] till every frame before it
+        has been pushed.  Once the replicas are done, whatever is left (only
+        after a failure) is pushed in order with the gaps skipped.
+    */
+    template<typename TWorkTask, typename TConfig>
+    void Replicated<TWorkTask,TConfig>::sequencer(run_t *r)
+    { Chan *reader=Chan_Open(r->qmid_out,CHAN_READ),
+           *writer=Chan_Open(r->qout,CHAN_WRITE);
+      Message  *buf=(Message*)Chan_Token_Buffer_Alloc(r->qmid_out),
+              **stash=(Message**)calloc(r->window,sizeof(Message*));
+      size_t   *cap  =(size_t*)  calloc(r->window,sizeof(size_t)),
+                bufcap=Chan_Buffer_Size_Bytes(r->qmid_out);
+      char     *full =(char*)    calloc(r->window,sizeof(char));
+      u64       next=0;
+      unsigned  i,k;
+      int       ok=(stash && cap && full);
+      for(i=0;ok && i<r->window;++i)
+      { stash[i]=(Message*)Chan_Token_Buffer_Alloc(r->qmid_out);
+        cap[i]=bufcap;
+      }
+      if(!ok) fail(r);
+
+#define PUSH(i) \
+      { size_t nout=stash[i]->size_bytes(); \
+        if(nout>Chan_Buffer_Size_Bytes(r->qout)) \
+          Chan_Resize(writer,nout); \
+        if(CHAN_FAILURE(Chan_Next(writer,(void**)&stash[i],cap[i]))) \
+        { ok=0; \
+          fail(r); \
+        } \
+        cap[i]=Chan_Buffer_Size_Bytes(r->qout); \
+        full[i]=0; \
+      }
+
+      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&buf,bufcap)))
+      { bufcap=Chan_Buffer_Size_Bytes(r->qmid_out);
+        if(!ok) continue; // drain so the replicas can finish
+        i=(unsigned)(*replica_seq(buf)%r->window);
+        { Message *t=stash[i]; stash[i]=buf; buf=t; }
+        { size_t   t=cap[i];   cap[i]=bufcap; bufcap=t; }
+        full[i]=1;
+        while(ok && full[i=(unsigned)(next%r->window)])
+        { PUSH(i);
+          ++next;
+          Mutex_Lock(r->self->lock_);
+          r->emitted=next;
+          Condition_Notify_All(r->self->cv_);
+          Mutex_Unlock(r->self->lock_);
+        }
+      }
+      for(k=0;ok && k<r->window;++k)
+        if(full[i=(unsigned)((next+k)%r->window)])
+          PUSH(i);
+#undef PUSH
+
+      if(stash)
+        for(i=0;i<r->window;++i)
+          Chan_Token_Buffer_Free(stash[i]);
+      free(stash);
+      free(cap);
+      free(full);
+      Chan_Token_Buffer_Free(buf);
+      Chan_Close(reader);
+      Chan_Close(writer);
+      if(!ok) fail(r);
+    }
+
+    /** The dispatcher.  See ReplicatedWorkAgent. */
+    template<typename TWorkTask, typename TConfig>
+    unsigned int Replicated<TWorkTask,TConfig>::run(IDevice *d)
+    { ReplicatedWorkAgent<TWorkTask,TConfig> *dc = dynamic_cast<ReplicatedWorkAgent<TWorkTask,TConfig>*>(d);
+      const unsigned n=dc->replicas();
+      Chan *qin=dc->_in->contents[0],
+           *reader=0,*writer=0,*hold=0;
+      Message *buf=0,*t;
+      run_t r;
+      size_t bufcap,ntoken,trailer=2*sizeof(u64); // room for the trailer and its alignment
+      unsigned sts=0;
+      int ok,started=0;
+
+      if(n<2)
+        return inner_.run(d);
+
+      memset(&r,0,sizeof(r));
+      r.self=this;
+      r.d=d;
+      r.n=n;
+      for(r.window=2;r.window<2*n;r.window<<=1) {} // queue buffer counts have to be powers of two
+      r.replicas_left=n;
+      r.sequencer_left=1;
+      r.qout=dc->_out->contents[0];
+      // private queues, reused while the shape stays the same
+      if(!dc->replica_in_ || Chan_Buffer_Count(dc->replica_in_->contents[0])!=r.window)
+      { IDevice::_alloc_qs_easy(&dc->replica_in_ ,1,r.window,Chan_Buffer_Size_Bytes(qin)   +trailer,&IDevice::FRAME_QUEUE_ALLOCATOR);
+        IDevice::_alloc_qs_easy(&dc->replica_out_,1,r.window,Chan_Buffer_Size_Bytes(r.qout)+trailer,&IDevice::FRAME_QUEUE_ALLOCATOR);
+      }
+      r.qmid_in =dc->replica_in_->contents[0];
+      r.qmid_out=dc->replica_out_->contents[0];
+      TRY(crew_start(n),ThreadError);
+
+      reader=Chan_Open(qin,CHAN_READ);
+      writer=Chan_Open(r.qmid_in,CHAN_WRITE); // before the replicas start, so their reads wait for it
+      hold  =Chan_Open(r.qmid_out,CHAN_WRITE);// same for the sequencer, till every replica is done
+      buf=(Message*)Chan_Token_Buffer_Alloc(qin);
+      bufcap=Chan_Buffer_Size_Bytes(qin);
+      Mutex_Lock(lock_);
+      run_=&r;
+      ++generation_;
+      Condition_Notify_All(wake_);
+      Mutex_Unlock(lock_);
+      started=1;
+
+      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&buf,bufcap)))
+      { bufcap=Chan_Buffer_Size_Bytes(qin);
+        ntoken=replica_token_bytes(buf);
+        Mutex_Lock(lock_);
+        while(r.dispatched-r.emitted>=r.window && !r.failed)
+          Condition_Wait(cv_,lock_);
+        ok=!r.failed;
+        Mutex_Unlock(lock_);
+        if(!ok) break;
+        if(ntoken>bufcap)  // make room for the trailer.  Keeps the contents.
+        { TRY(t=(Message*)Chan_Token_Buffer_Realloc(buf,ntoken),MemoryError);
+          buf=t;
+          bufcap=ntoken;
+        }
+        *replica_seq(buf)=r.dispatched++;
+        if(ntoken>Chan_Buffer_Size_Bytes(r.qmid_in))
+          Chan_Resize(writer,ntoken);
+        if(CHAN_FAILURE(Chan_Next(writer,(void**)&buf,bufcap)))
+        { warning("%s(%d)"ENDL "\t[%s] Could not push to the replicas."ENDL,__FILE__,__LINE__,d->_agent->name());
+          fail(&r);
+          break;
+        }
+        bufcap=Chan_Buffer_Size_Bytes(r.qmid_in);
+      }
+    Finalize:
+      if(writer) Chan_Close(writer); // lets the replicas finish
+      if(started)
+      { Mutex_Lock(lock_);
+        while(r.replicas_left)
+          Condition_Wait(cv_,lock_);
+        Mutex_Unlock(lock_);
+      }
+      if(hold) Chan_Close(hold);     // lets the sequencer finish
+      if(started)
+      { Mutex_Lock(lock_);
+        while(r.sequencer_left)
+          Condition_Wait(cv_,lock_);
+        run_=NULL;
+        Mutex_Unlock(lock_);
+      }
+      sts|=r.failed;
+      if(reader) Chan_Close(reader);
+      if(buf)    Chan_Token_Buffer_Free(buf);
+      return sts!=0;
+    MemoryError:
+      warning("%s(%d)"ENDL "\t[%s] Could not make room to tag a frame."ENDL,__FILE__,__LINE__,d->_agent->name());
+      fail(&r);
+      goto Finalize;
+    ThreadError:
+      warning("%s(%d)"ENDL "\t[%s] Could not start the replicas."ENDL,__FILE__,__LINE__,d->_agent->name());
+      sts=1;
+      goto Finalize;
+    }
+  }
+}
+#undef TRY
@@ -12,7 +12,7 @@
  */
 #include "config.h"
 #include "SurfaceFindWorker.h"
-#include "util/util-mylib.h"
+#include "algo/classify.h"
 
 //#define PROFILE
 #if 0 //def PROFILE // PROFILING
@@ -62,56 +62,6 @@ namespace fetch
   {
 
 
-      ///// CLASSIFY //////////////////////////////////////////////////
-      template<class T>
-      static int _classify(mylib::Array *src, int ichan, double intensity_thresh, double area_thresh)
-      { T* data;
-        mylib::Array tmp=*src,*image=&tmp;
-        if(ichan>=0)
-        { image=mylib::Get_Array_Plane(&tmp,ichan);
-        }
-        data = (T*)image->data;
-        size_t i,count=0;
-        if(!image->size) return 0;
-        for(i=0;i<image->size;++i)
-          count+=(data[i]>intensity_thresh);
-#if 0
-        mylib::Write_Image("classify.tif",image,mylib::DONT_PRESS);
-#endif
-        DBG("Fraction above thresh: %f",count/((double)image->size));
-        return (count/((double)image->size))>area_thresh;
-      }
-      #define CLASSIFY(type_id,type) case type_id: return _classify<type>(image,ichan,intensity_thresh,area_thresh); break
-      /**
-      \returns 0 if background, 1 if foreground
-
-      Image could be multiple channels.  Channels are assumed to plane-wise.
-      */
-      static int classify(mylib::Array *image, int ichan, double intensity_thresh, double area_thresh)
-      {
-        if(image->ndims<3)  // check that there are enough dimensions to select a channel
-        { ichan=-1;
-        } else if(ichan>=image->dims[image->ndims-1]) // is ichan sane?  If not, use chan 0.
-        { ichan=0;
-        }
-
-        switch(image->type)
-        {
-          CLASSIFY( mylib::UINT8_TYPE   ,uint8_t );
-          CLASSIFY( mylib::UINT16_TYPE  ,uint16_t);
-          CLASSIFY( mylib::UINT32_TYPE  ,uint32_t);
-          CLASSIFY( mylib::UINT64_TYPE  ,uint64_t);
-          CLASSIFY( mylib::INT8_TYPE    , int8_t );
-          CLASSIFY( mylib::INT16_TYPE   , int16_t);
-          CLASSIFY( mylib::INT32_TYPE   , int32_t);
-          CLASSIFY( mylib::INT64_TYPE   , int64_t);
-          CLASSIFY( mylib::FLOAT32_TYPE ,float   );
-          CLASSIFY( mylib::FLOAT64_TYPE ,double  );
-          default:
-            return 0;
-        }
-      }
-      #undef CLASSIFY
 
 
     unsigned int
@@ -132,23 +82,14 @@ namespace fetch
 
       // MAIN LOOP
       dc->reset();
-      size_t count=0;
       while(CHAN_SUCCESS(Chan_Next(reader,(void**)&fsrc,nbytes_in)))
       { nbytes_in = fsrc->size_bytes();
-        mylib::Array im;
-        mylib::Dimn_Type dims[3]={0};
-
         //REMIND(fsrc->totif("SurfaceFindWorker-src.tif"));
         TS_TIC;          
-        mylib::castFetchFrameToDummyArray(&im,fsrc,dims);
-        if(classify(&im,dc->get_config().ichan(),dc->get_config().intensity_threshold(),dc->get_config().area_threshold()))
-        { LOG("[SurfaceFindWorker] Classify() triggered on count %d\n",count);
-          dc->set(count);         
-        }
-        ++count;
+        dc->test(fsrc);
         TS_TOC;
         //REMIND(fdst->totif("SurfaceFindWorker-dst.tif"));
-        
+        dc->_notify_observers(0,fsrc,fsrc->size_bytes());
         TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&fsrc,fsrc->size_bytes())));        
       }
 Finalize:
@@ -170,19 +111,35 @@ Error:
     SurfaceFindWorkerAgent::SurfaceFindWorkerAgent(): WorkAgent<TaskType,Config>("SurfaceFindWorker")
       ,last_found_(0)
       ,any_found_(0)
+      ,count_(0)
     {}
 
     SurfaceFindWorkerAgent::SurfaceFindWorkerAgent(Config *config): WorkAgent<TaskType,Config>(config,"SurfaceFindWorker")
       ,last_found_(0)
       ,any_found_(0)
+      ,count_(0)
     {}
 
     void     SurfaceFindWorkerAgent::set(unsigned i)     {if(!any_found_) {any_found_=1; last_found_=i;}}
     unsigned SurfaceFindWorkerAgent::which()             {return last_found_;}
     unsigned SurfaceFindWorkerAgent::any()               {return !(too_inside()||too_outside());}
-    void     SurfaceFindWorkerAgent::reset()             {any_found_=0;last_found_=0;}
+    void     SurfaceFindWorkerAgent::reset()             {any_found_=0;last_found_=0;count_=0;}
     unsigned SurfaceFindWorkerAgent::too_inside()        { return any_found_ && (which()<=1); }
     unsigned SurfaceFindWorkerAgent::too_outside()       { return !any_found_; }
 
+    void SurfaceFindWorkerAgent::test(Frame_With_Interleaved_Planes *f)
+    { ConfigSnapshot c(this); // no lock, no copy
+      classify_threshold_t t={(int)c->ichan(),c->intensity_threshold(),c->area_threshold()};
+      if(classify(f->data,f->rtti,(size_t)f->width*f->height,f->nchan,&t,1))
+      { LOG("[SurfaceFindWorker] Classify() triggered on count %d\n",count_);
+        set(count_);
+      }
+      ++count_;
+    }
+
+    void SurfaceFindWorkerAgent::on_message(IDevice *source, size_t ichan, void *msg, size_t nbytes)
+    { test((Frame_With_Interleaved_Planes*)msg);
+    }
+
   } //fetch::worker
 }   // fetch
\ No newline at end of file
@@ -24,10 +24,15 @@ namespace fetch
   bool operator!=(const cfg::tasks::SurfaceFind& a, const cfg::tasks::SurfaceFind& b);
   namespace worker
   {
-    class SurfaceFindWorkerAgent:public WorkAgent<task::SurfaceFindWorker,cfg::tasks::SurfaceFind>
+    /** Finds the first frame of a stack that classifies as foreground.
+        Works as a stage or as an observer of another device's output.
+        reset() before each stack.
+    */
+    class SurfaceFindWorkerAgent:public WorkAgent<task::SurfaceFindWorker,cfg::tasks::SurfaceFind>, public IObserver
     { 
       unsigned last_found_;
     	unsigned any_found_;
+      unsigned count_;      // frames seen since reset()
       public:
         SurfaceFindWorkerAgent();
         SurfaceFindWorkerAgent(Config *config);
@@ -38,6 +43,8 @@ namespace fetch
         unsigned too_outside();  // no planes trip threshold
 
         void reset();
+        void test(Frame_With_Interleaved_Planes *f); // classifies the next frame of the stack
+        virtual void on_message(IDevice *source, size_t ichan, void *msg, size_t nbytes); // IObserver.  Calls test().
     };
   }
 
@@ -27,45 +27,34 @@ namespace fetch
     Terminator::run(IDevice *d)
     {
       Chan **q;   // input queues (all input channels)
-      void **buf;  // array of token buffers
-      size_t *szs; // array of buffer sizes
-      unsigned int i, n, any;
+      void  *buf; // borrowed message
+      size_t i, n, ready=0;
       
       n = d->_in->nelem;
       q   = (Chan **) (Guarded_Malloc(n*sizeof(Chan*),
                                      "Worker device task - Terminator"));
-      buf = (void**)  (Guarded_Malloc(n * sizeof(void*),
-                                     "Worker device task - Terminator"));
-      szs = (size_t*) (Guarded_Malloc(n * sizeof(size_t),
-                                     "Worker device task - Terminator"));
-      // alloc the token buffers
       for (i = 0; i < n; i++)
-      { q[i]   = Chan_Open(d->_in->contents[i],CHAN_READ);
-        buf[i] = Chan_Token_Buffer_Alloc(q[i]);
-        szs[i] = Chan_Buffer_Size_Bytes(q[i]);
-      }
+        q[i] = Chan_Open(d->_in->contents[i],CHAN_READ);
 
-      // main loop      
+      // main loop
+      // Drains whichever input has data.  Borrowing works on normal and
+      // broadcast queues.  On a broadcast queue, popping would copy every
+      // frame just to throw it away.
       
-      do
+      while(CHAN_SUCCESS(Chan_Wait_Any(q,n,(unsigned)-1,&ready))) // quits when all inputs are drained and closed
       { 
 #if 0
         if( !Chan_Is_Empty(q[0]) ) DBG("Convenient break point\r\n");
 #endif
-        any=0;
-        for(i=0;i<n;++i)
-        { any |= CHAN_SUCCESS(Chan_Next(q[i],buf+i,szs[i]));
-          szs[i] = Chan_Buffer_Size_Bytes(q[i]);
-        }        
-      } while(any); // quits when all inputs fail to pop
+        if(CHAN_SUCCESS(Chan_Next_Borrow(q[ready],&buf,0)))
+          Chan_Release(q[ready],buf);
+      }
       
       // cleanup
       for (i = 0; i < n; i++)
-      { Chan_Token_Buffer_Free(buf[i]);
         Chan_Close(q[i]);
-      }
 
-      free(buf);
+      free(q);
       return 0; // success
     }
 
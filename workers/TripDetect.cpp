@@ -12,7 +12,8 @@
  */
 #include "config.h"
 #include "TripDetect.h"
-#include "util/util-mylib.h"
+#include "algo/classify.h"
+#include <vector>
 #include "devices/Microscope.h"
 
 //#define PROFILE
@@ -43,6 +44,8 @@
 #define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
 #define TRY(e)       do{ECHO(#e);if(!(e)){REPORT(#e);goto Error;}}while(0)
 
+#define PANIC(e)     do{if(!(e)) error("%s(%d)"ENDL "\tExpression evaluated to false."ENDL "\t%s"ENDL,__FILE__,__LINE__,#e);}while(0)
+
 #define REMIND(expr) \
   warning("%s(%d): %s"ENDL "\tDumping debug data."ENDL, __FILE__,__LINE__,__FUNCTION__);\
   (expr)
@@ -55,6 +58,16 @@ namespace fetch
   { 
     if( a.frame_threshold() != b.frame_threshold() )
       return 0;
+    if( a.replicas() != b.replicas() )
+      return 0;
+    if( a.sample_mode()       != b.sample_mode()
+     || a.sample_stride()     != b.sample_stride()
+     || a.sample_count()      != b.sample_count()
+     || a.sample_confidence() != b.sample_confidence()
+     || a.roi_x() != b.roi_x() || a.roi_y() != b.roi_y()
+     || a.roi_w() != b.roi_w() || a.roi_h() != b.roi_h()
+     || a.budget_ms()         != b.budget_ms() )
+      return 0;
     if( a.threshold_size() != b.threshold_size() )
       return 0;
     int i;
@@ -73,137 +86,146 @@ namespace fetch
   {
 
 
-      ///// CLASSIFY //////////////////////////////////////////////////
-      template<class T>
-      static int _classify(mylib::Array *src, int ichan, double intensity_thresh, double area_thresh)
-      { T* data;
-        mylib::Array tmp=*src,*image=&tmp;
-        if(ichan>=0)
-        { image=mylib::Get_Array_Plane(&tmp,ichan);
-        }
-        data = (T*)image->data;
-        size_t i,count=0;
-        if(!image->size) return 0;
-        for(i=0;i<image->size;++i)
-          count+=(data[i]>intensity_thresh);
-#if 0
-        mylib::Write_Image("classify.tif",image,mylib::DONT_PRESS);
-#endif
-        DBG("Fraction above thresh: %f",count/((double)image->size));
-        return (count/((double)image->size))>area_thresh;
-      }
-      #define CLASSIFY(type_id,type) case type_id: return _classify<type>(image,ichan,intensity_thresh,area_thresh); break
-      /**
-      \returns 0 if background, 1 if foreground
-
-      Image could be multiple channels.  Channels are assumed to plane-wise.
-      */
-      static int classify(mylib::Array *image, int ichan, double intensity_thresh, double area_thresh)
-      {
-        if(image->ndims<3)  // check that there are enough dimensions to select a channel
-        { ichan=-1;
-        } else if(ichan>=image->dims[image->ndims-1]) // is ichan sane?  If not, use chan 0.
-        { ichan=0;
-        }
-
-        switch(image->type)
-        {
-          CLASSIFY( mylib::UINT8_TYPE   ,uint8_t );
-          CLASSIFY( mylib::UINT16_TYPE  ,uint16_t);
-          CLASSIFY( mylib::UINT32_TYPE  ,uint32_t);
-          CLASSIFY( mylib::UINT64_TYPE  ,uint64_t);
-          CLASSIFY( mylib::INT8_TYPE    , int8_t );
-          CLASSIFY( mylib::INT16_TYPE   , int16_t);
-          CLASSIFY( mylib::INT32_TYPE   , int32_t);
-          CLASSIFY( mylib::INT64_TYPE   , int64_t);
-          CLASSIFY( mylib::FLOAT32_TYPE ,float   );
-          CLASSIFY( mylib::FLOAT64_TYPE ,double  );
-          default:
-            return 0;
-        }
-      }
-      #undef CLASSIFY
 
 
     unsigned int
-    TripDetectWorker::run(IDevice *idc)
-    { int eflag = 0;
-      TripDetectWorkerAgent *dc = dynamic_cast<TripDetectWorkerAgent*>(idc);
-      TS_OPEN("timer-TripDetectWorker.f32");
-
-      // open channels
-      Chan *qsrc = dc->_in->contents[0],
-           *qdst = dc->_out->contents[0],
-           *reader, *writer;
-
-      Frame_With_Interleaved_Planes  *fsrc =  (Frame_With_Interleaved_Planes*)Chan_Token_Buffer_Alloc(qsrc);
-      size_t nbytes_in  = Chan_Buffer_Size_Bytes(qsrc);
-      reader = Chan_Open(qsrc,CHAN_READ);
-      writer = Chan_Open(qdst,CHAN_WRITE);
-
-      // MAIN LOOP
-      while(CHAN_SUCCESS(Chan_Next(reader,(void**)&fsrc,nbytes_in)) && dc->ok())
-      { nbytes_in = fsrc->size_bytes();
-        mylib::Array im;
-        mylib::Dimn_Type dims[3]={0};
-
-        //REMIND(fsrc->totif("TripDetectWorker-src.tif"));
-        TS_TIC;
-        mylib::castFetchFrameToDummyArray(&im,fsrc,dims);
-        dc->inc();
-        int all=1;
-        for(int i=0;i<dc->_config->threshold_size();++i)
-        { const cfg::worker::Threshold t=dc->_config->threshold(i);
-          all &= classify(&im,t.ichan(),t.intensity_threshold(),t.area_threshold());
-        }
-        if(all)
-            dc->reset();
-        TS_TOC;
-        //REMIND(fdst->totif("TripDetectWorker-dst.tif"));
-        TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&fsrc,fsrc->size_bytes())));  
-        
-        if(!dc->ok())
-        { 
-          warning("[TripDetectWorker] Too many dark frames.  Will cycle power to the PMTs.");
-          dc->reset(); // reset dark frame count
-          if(!dc->cycle_pmts()) {
-            warning("[TripDetectWorker] Too many PMT trips detected.  Stopping.");
-            dc->sig_stop();
-          }
-        }
-      }
-Finalize:
-      TS_CLOSE;
-      Chan_Close(reader);
-      Chan_Close(writer);
-      Chan_Token_Buffer_Free(fsrc);
-      return eflag;
-Error:
-      warning("%s(%d) %s()\r\n\tSomething went wrong with the TripDetectWorker.\r\n",__FILE__,__LINE__,__FUNCTION__);
-      eflag=1;
-      goto Finalize;
+    TripDetectWorker::work(IDevice *idc, Frame_With_Interleaved_Planes *f)
+    { TripDetectWorkerAgent *dc = dynamic_cast<TripDetectWorkerAgent*>(idc);
+      //REMIND(f->totif("TripDetectWorker-src.tif"));
+      dc->check(f);
+      return 1;
     }
 
   } // fetch::task
 
   namespace worker
   {
-    TripDetectWorkerAgent::TripDetectWorkerAgent(device::Microscope* dc): microscope_(dc), WorkAgent<TaskType,Config>("TripDetectWorkerAgent")
+    TripDetectWorkerAgent::TripDetectWorkerAgent(device::Microscope* dc): microscope_(dc), ReplicatedWorkAgent<task::TripDetectWorker,Config>("TripDetectWorkerAgent")
       ,number_dark_frames_(0)
       ,number_resets_(0)
-    {}
+      ,lock_(0)
+      ,wake_(0)
+      ,cycler_(0)
+      ,cycle_(CYCLE_IDLE)
+      ,quit_(0)
+    { init();
+    }
 
-    TripDetectWorkerAgent::TripDetectWorkerAgent(device::Microscope* dc,Config *config): microscope_(dc), WorkAgent<TaskType,Config>(config,"TripDetectWorkerAgent")
+    TripDetectWorkerAgent::TripDetectWorkerAgent(device::Microscope* dc,Config *config): microscope_(dc), ReplicatedWorkAgent<task::TripDetectWorker,Config>(config,"TripDetectWorkerAgent")
       ,number_dark_frames_(0)
       ,number_resets_(0)
-    {}
+      ,lock_(0)
+      ,wake_(0)
+      ,cycler_(0)
+      ,cycle_(CYCLE_IDLE)
+      ,quit_(0)
+    { init();
+    }
+
+    void TripDetectWorkerAgent::init()
+    { PANIC(lock_=Mutex_Alloc());
+      PANIC(wake_=Condition_Alloc());
+      PANIC(cycler_=Thread_Alloc(cycler_main,this));
+    }
+
+    TripDetectWorkerAgent::~TripDetectWorkerAgent()
+    { if(cycler_)
+      { Mutex_Lock(lock_);
+        quit_=1;
+        Condition_Notify_All(wake_);
+        Mutex_Unlock(lock_);
+        Thread_Join(cycler_);
+        Thread_Free(cycler_);
+      }
+      if(wake_) Condition_Free(wake_);
+      if(lock_) Mutex_Free(lock_);
+    }
+
+    // Parks till check() requests a cycle.  A cycle that's asked for while
+    // one is running is dropped: trip() won't request one till this is idle.
+    void* TripDetectWorkerAgent::cycler_main(void *arg)
+    { TripDetectWorkerAgent *self=(TripDetectWorkerAgent*)arg;
+      Mutex_Lock(self->lock_);
+      while(1)
+      { while(self->cycle_!=CYCLE_REQUESTED && !self->quit_)
+          Condition_Wait(self->wake_,self->lock_);
+        if(self->quit_)
+          break;
+        self->cycle_=CYCLE_RUNNING;
+        Mutex_Unlock(self->lock_);
+        warning("[TripDetectWorker] Too many dark frames.  Will cycle power to the PMTs.");
+        if(!self->cycle_pmts())
+        { warning("[TripDetectWorker] Too many PMT trips detected.  Stopping.");
+          self->sig_stop();
+        }
+        Mutex_Lock(self->lock_);
+        self->number_dark_frames_=0; // frames seen during the reset don't count
+        self->cycle_=CYCLE_IDLE;
+      }
+      Mutex_Unlock(self->lock_);
+      return NULL;
+    }
+
+    void     TripDetectWorkerAgent::reset()      {Mutex_Lock(lock_); number_dark_frames_=0; Mutex_Unlock(lock_);}
+    void     TripDetectWorkerAgent::inc()        {Mutex_Lock(lock_); number_dark_frames_++; Mutex_Unlock(lock_);}
+    unsigned TripDetectWorkerAgent::ok()         {unsigned v; Mutex_Lock(lock_); v=number_dark_frames_<_config->frame_threshold(); Mutex_Unlock(lock_); return v;}
+    unsigned TripDetectWorkerAgent::trip()
+    { unsigned v;
+      Mutex_Lock(lock_);
+      if(v=(cycle_==CYCLE_IDLE && number_dark_frames_>=_config->frame_threshold()))
+      { number_dark_frames_=0;
+        cycle_=CYCLE_REQUESTED;
+        Condition_Notify_All(wake_);
+      }
+      Mutex_Unlock(lock_);
+      return v;
+    }
+    unsigned TripDetectWorkerAgent::cycle_pmts()
+    { unsigned n;
+      Mutex_Lock(lock_);
+      n=++number_resets_;
+      Mutex_Unlock(lock_);
+      microscope_->pmt_.reset();
+      return n<_config->max_reset_count();
+    }
+    void TripDetectWorkerAgent::check(Frame_With_Interleaved_Planes *f)
+    { inc();
+      { ConfigSnapshot c(this); // no lock, no copy
+        std::vector<classify_threshold_t> ths(c->threshold_size());
+        classify_options_t opts={0};
+        for(int i=0;i<c->threshold_size();++i)
+        { const cfg::worker::Threshold &t=c->threshold(i);
+          ths[i].ichan    =(int)t.ichan();
+          ths[i].intensity=t.intensity_threshold();
+          ths[i].area     =t.area_threshold();
+        }
+        opts.x=c->roi_x();
+        opts.y=c->roi_y();
+        opts.w=c->roi_w();
+        opts.h=c->roi_h();
+        switch(c->sample_mode())
+        { case cfg::worker::TripDetect_SampleMode_Stride: opts.sample=CLASSIFY_SAMPLE_STRIDE; break;
+          case cfg::worker::TripDetect_SampleMode_Random: opts.sample=CLASSIFY_SAMPLE_RANDOM; break;
+          default:                                        opts.sample=CLASSIFY_SAMPLE_NONE;
+        }
+        opts.stride    =c->sample_stride();
+        opts.count     =c->sample_count();
+        opts.confidence=c->sample_confidence();
+        opts.budget_s  =c->budget_ms()*1e-3;
+        if(classify_ex(f->data,f->rtti,f->width,f->height,f->nchan,ths.empty()?NULL:&ths[0],(unsigned)ths.size(),&opts))
+          reset();
+      }
+      trip(); // hands the PMT cycle to cycler_, so this doesn't block
+    }
+
+    void TripDetectWorkerAgent::on_message(IDevice *source, size_t ichan, void *msg, size_t nbytes)
+    { check((Frame_With_Interleaved_Planes*)msg);
+    }
 
-    void     TripDetectWorkerAgent::reset()      {number_dark_frames_=0;}
-    void     TripDetectWorkerAgent::inc()        {number_dark_frames_++;}
-    unsigned TripDetectWorkerAgent::cycle_pmts() {number_resets_++; microscope_->pmt_.reset(); return number_resets_<_config->max_reset_count(); }
-    unsigned TripDetectWorkerAgent::ok()         {return number_dark_frames_<_config->frame_threshold();}
     void     TripDetectWorkerAgent::sig_stop()   {
+      Mutex_Lock(lock_);
       number_resets_=0;
+      Mutex_Unlock(lock_);
       microscope_->__scan_agent.stop_nowait();
       microscope_->__self_agent.stop_nowait();
     }
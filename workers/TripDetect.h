@@ -7,6 +7,7 @@
 
 #include "WorkAgent.h"
 #include "WorkTask.h"
+#include "ReplicatedWorkAgent.h"
 #include "workers.pb.h"
 
 namespace fetch
@@ -16,29 +17,51 @@ namespace fetch
   namespace task
   {
    
-    class TripDetectWorker : public WorkTask
+    class TripDetectWorker : public InPlaceWorkTask<Frame_With_Interleaved_Planes>
     { public:
-        unsigned int run(IDevice* dc);
+        unsigned int work(IDevice* dc, Frame_With_Interleaved_Planes* f);
     };
   }
   bool operator==(const cfg::worker::TripDetect& a, const cfg::worker::TripDetect& b);
   bool operator!=(const cfg::worker::TripDetect& a, const cfg::worker::TripDetect& b);
   namespace worker
   {
-    class TripDetectWorkerAgent:public WorkAgent<task::TripDetectWorker,cfg::worker::TripDetect>
+    /** Counts dark frames and cycles the PMTs when there are too many.
+        Works as a stage (it passes frames through untouched) or as an
+        observer of the stage before it, which saves a queue and a hop.
+
+        Cycling the PMTs blocks for a while, so check() only flags the trip.
+        A thread of the agent's own does the reset, and dark frames aren't
+        counted until it's done.  The frame stream never waits on the PMTs.
+    */
+    class TripDetectWorkerAgent:public ReplicatedWorkAgent<task::TripDetectWorker,cfg::worker::TripDetect>, public IObserver
     { 
       unsigned number_dark_frames_; // incremented for every dark frame
       unsigned number_resets_;      // incremented for every reset of the pmt controller
+      Mutex   *lock_;               // protects the counters; replicas share them
+      Condition *wake_;             // signals cycler_ when cycle_ or quit_ change
+      Thread  *cycler_;             // cycles the PMTs off the frame path
+      unsigned cycle_,              // CYCLE_*.  protected by lock_
+               quit_;               // protected by lock_
       device::Microscope* microscope_;
+
+      enum {CYCLE_IDLE=0,CYCLE_REQUESTED,CYCLE_RUNNING};
+      static void* cycler_main(void *arg);
+      void init();
       public:
         TripDetectWorkerAgent(device::Microscope* dc);
         TripDetectWorkerAgent(device::Microscope* dc,Config *config);
+        virtual ~TripDetectWorkerAgent();
         
         void inc();
         unsigned ok(); // returns 1 if number_of_dark_frames_ < threshold specified in config
+        unsigned trip(); // returns 1 if !ok() and no cycle is under way.  Resets the count and requests a cycle.
         unsigned cycle_pmts(); // turns the pmt's off and on again.  returns 1 if number_of_resets_ < threshold specified in config
         void reset();  // manually resets number_dark_frames_ to 0.
         void sig_stop(); // signal the microscope to stop the current task
+
+        void check(Frame_With_Interleaved_Planes *f); // classifies one frame and handles a trip
+        virtual void on_message(IDevice *source, size_t ichan, void *msg, size_t nbytes); // IObserver.  Calls check().
     };
   }
 }
\ No newline at end of file
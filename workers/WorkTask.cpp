@@ -19,7 +19,8 @@ namespace fetch
       d->_alloc_qs_easy(&d->_out,
                         1,                                             // number of output channels to allocate
                         Chan_Buffer_Count(d->_in->contents[0]),        // copy number of output buffers from input queue
-                        Chan_Buffer_Size_Bytes(d->_in->contents[0]));  // copy buffer size from input queue
+                        Chan_Buffer_Size_Bytes(d->_in->contents[0]),   // copy buffer size from input queue
+                        &IDevice::FRAME_QUEUE_ALLOCATOR);
     }
 
   }
@@ -141,13 +141,14 @@ namespace fetch
           nbytes_out = fdst->size_bytes();
           if(nbytes_out>Chan_Buffer_Size_Bytes(qdst))
           { Chan_Resize(writer,nbytes_out);
-            TRY(fdst = (TMessage *) realloc(fdst,nbytes_out),MemoryError);
+            TRY(fdst = (TMessage *) Chan_Token_Buffer_Realloc(fdst,nbytes_out),MemoryError);
             fsrc->format(fdst);
             TRY(reshape(d,fdst),FormatFunctionFailure);
           }
           TS_TIC;
           TRY(work(d,fdst,fsrc),WorkFunctionFailure);
           TS_TOC;
+          d->_notify_observers(0,fdst,nbytes_out);
           TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&fdst, nbytes_out)),OutputQueueTimeoutError);
         }
 
@@ -201,6 +202,7 @@ OutputQueueTimeoutError:
           TRY(work(d,fsrc),WorkFunctionFailure);
           TS_TOC;
           nbytes_in = MAX( Chan_Buffer_Size_Bytes(qdst), nbytes_in ); // XXX - awkward
+          d->_notify_observers(0,fsrc,fsrc->size_bytes());
           TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&fsrc, nbytes_in)),OutputQueueTimeoutError);
         }
     Finalize: